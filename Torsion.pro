@@ -35,7 +35,7 @@ lessThan(QT_MAJOR_VERSION,5)|lessThan(QT_MINOR_VERSION,1) {
 
 TARGET = Torsion
 TEMPLATE = app
-QT += core gui network quick widgets
+QT += core gui network quick widgets concurrent
 
 VERSION = 1.0.0
 
@@ -104,9 +104,15 @@ SOURCES += src/main.cpp \
     src/tor/ProtocolInfoCommand.cpp \
     src/tor/AuthenticateCommand.cpp \
     src/tor/SetConfCommand.cpp \
+    src/tor/AddOnionCommand.cpp \
     src/utils/StringUtil.cpp \
     src/core/ContactsManager.cpp \
     src/core/ContactUser.cpp \
+    src/core/AvatarEncoder.cpp \
+    src/core/ConnectionRamp.cpp \
+    src/core/ContactRequestDispatcher.cpp \
+    src/core/MessageHistory.cpp \
+    src/core/MessageSearchIndex.cpp \
     src/protocol/ProtocolCommand.cpp \
     src/protocol/PingCommand.cpp \
     src/protocol/IncomingSocket.cpp \
@@ -117,9 +123,11 @@ SOURCES += src/main.cpp \
     src/tor/HiddenService.cpp \
     src/protocol/ProtocolSocket.cpp \
     src/utils/CryptoKey.cpp \
+    src/utils/CryptoService.cpp \
     src/utils/SecureRNG.cpp \
     src/protocol/ContactRequestClient.cpp \
     src/protocol/ContactRequestServer.cpp \
+    src/protocol/RequestPuzzle.cpp \
     src/core/OutgoingContactRequest.cpp \
     src/core/IncomingRequestManager.cpp \
     src/core/ContactIDValidator.cpp \
@@ -127,12 +135,19 @@ SOURCES += src/main.cpp \
     src/core/UserIdentity.cpp \
     src/core/IdentityManager.cpp \
     src/utils/AppSettings.cpp \
+    src/utils/StateDatabase.cpp \
+    src/utils/TimerWheel.cpp \
+    src/utils/TokenBucket.cpp \
     src/ui/AvatarImageProvider.cpp \
     src/ui/ConversationModel.cpp \
+    src/ui/MessageSearchModel.cpp \
     src/tor/TorProcess.cpp \
     src/tor/TorManager.cpp \
     src/tor/TorSocket.cpp \
-    src/protocol/OutgoingContactSocket.cpp
+    src/tor/ReconnectScheduler.cpp \
+    src/protocol/OutgoingContactSocket.cpp \
+    src/protocol/ProbeCommand.cpp \
+    src/protocol/ConnectionProbe.cpp
 
 HEADERS += src/ui/MainWindow.h \
     src/ui/ContactsModel.h \
@@ -142,9 +157,15 @@ HEADERS += src/ui/MainWindow.h \
     src/tor/ProtocolInfoCommand.h \
     src/tor/AuthenticateCommand.h \
     src/tor/SetConfCommand.h \
+    src/tor/AddOnionCommand.h \
     src/utils/StringUtil.h \
     src/core/ContactsManager.h \
     src/core/ContactUser.h \
+    src/core/AvatarEncoder.h \
+    src/core/ConnectionRamp.h \
+    src/core/ContactRequestDispatcher.h \
+    src/core/MessageHistory.h \
+    src/core/MessageSearchIndex.h \
     src/protocol/ProtocolCommand.h \
     src/protocol/PingCommand.h \
     src/protocol/IncomingSocket.h \
@@ -156,9 +177,11 @@ HEADERS += src/ui/MainWindow.h \
     src/tor/HiddenService.h \
     src/protocol/ProtocolSocket.h \
     src/utils/CryptoKey.h \
+    src/utils/CryptoService.h \
     src/utils/SecureRNG.h \
     src/protocol/ContactRequestClient.h \
     src/protocol/ContactRequestServer.h \
+    src/protocol/RequestPuzzle.h \
     src/core/OutgoingContactRequest.h \
     src/core/IncomingRequestManager.h \
     src/core/ContactIDValidator.h \
@@ -166,13 +189,20 @@ HEADERS += src/ui/MainWindow.h \
     src/core/UserIdentity.h \
     src/core/IdentityManager.h \
     src/utils/AppSettings.h \
+    src/utils/StateDatabase.h \
+    src/utils/TimerWheel.h \
+    src/utils/TokenBucket.h \
     src/ui/AvatarImageProvider.h \
     src/ui/ConversationModel.h \
+    src/ui/MessageSearchModel.h \
     src/tor/TorProcess.h \
     src/tor/TorProcess_p.h \
     src/tor/TorManager.h \
     src/tor/TorSocket.h \
-    src/protocol/OutgoingContactSocket.h
+    src/tor/ReconnectScheduler.h \
+    src/protocol/OutgoingContactSocket.h \
+    src/protocol/ProbeCommand.h \
+    src/protocol/ConnectionProbe.h
 
 RESOURCES += translation/embedded.qrc \
     src/ui/qml/qml.qrc
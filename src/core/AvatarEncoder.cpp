@@ -0,0 +1,184 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "AvatarEncoder.h"
+#include <QRunnable>
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QThread>
+#include <QDebug>
+
+class AvatarEncodeJob : public QRunnable
+{
+public:
+    AvatarEncodeJob(AvatarEncoder *encoder, const AvatarEncoder::Request &request)
+        : m_encoder(encoder), m_request(request)
+    {
+    }
+
+    virtual void run()
+    {
+        m_request.data = AvatarEncoder::encodeImage(m_request.image);
+        m_request.image = QImage();
+
+        QMutexLocker locker(&m_encoder->m_resultsMutex);
+        bool wasEmpty = m_encoder->m_results.isEmpty();
+        m_encoder->m_results.append(m_request);
+        if (wasEmpty)
+            QMetaObject::invokeMethod(m_encoder, "deliverResults", Qt::QueuedConnection);
+    }
+
+private:
+    AvatarEncoder *m_encoder;
+    AvatarEncoder::Request m_request;
+};
+
+AvatarEncoder *AvatarEncoder::instance()
+{
+    static AvatarEncoder *p = 0;
+    if (!p)
+        p = new AvatarEncoder(qApp);
+    return p;
+}
+
+AvatarEncoder::AvatarEncoder(QObject *parent)
+    : QObject(parent), m_running(0), m_nextId(0)
+{
+    m_pool.setMaxThreadCount(qBound(1, QThread::idealThreadCount(), 4));
+}
+
+QByteArray AvatarEncoder::encodeImage(QImage image)
+{
+    if (image.isNull())
+        return QByteArray();
+
+    /* Reduce large sources cheaply to twice the final size, then smooth the last step */
+    if (image.width() > AvatarSize * 2 || image.height() > AvatarSize * 2)
+        image = image.scaled(QSize(AvatarSize * 2, AvatarSize * 2), Qt::KeepAspectRatio, Qt::FastTransformation);
+    if (image.width() > AvatarSize || image.height() > AvatarSize)
+        image = image.scaled(QSize(AvatarSize, AvatarSize), Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+    QBuffer buffer;
+    buffer.open(QBuffer::ReadWrite);
+    if (!image.save(&buffer, "jpeg", 90))
+        return QByteArray();
+    return buffer.buffer();
+}
+
+void AvatarEncoder::encode(QObject *target, const QImage &image)
+{
+    Q_ASSERT(target);
+
+    Request request;
+    request.id = m_nextId++;
+    request.target = target;
+    request.image = image;
+
+    if (!m_latest.contains(target))
+        connect(target, SIGNAL(destroyed(QObject*)), SLOT(targetDestroyed(QObject*)));
+    m_latest.insert(target, request.id);
+
+    if (image.isNull()) {
+        complete(request);
+        return;
+    }
+
+    /* A waiting request for the same target is replaced in its place, so the queue
+     * never holds more than one request per target */
+    for (int i = 0; i < m_queue.size(); i++) {
+        if (m_queue[i].target == target) {
+            m_queue[i] = request;
+            return;
+        }
+    }
+
+    m_queue.enqueue(request);
+    startRequests();
+}
+
+void AvatarEncoder::startRequests()
+{
+    /* Only as many jobs as threads are given to the pool, so superseded requests can be skipped */
+    while (!m_queue.isEmpty() && m_running < m_pool.maxThreadCount()) {
+        Request request = m_queue.dequeue();
+        if (!request.target || m_latest.value(request.target) != request.id)
+            continue;
+
+        m_running++;
+        m_pool.start(new AvatarEncodeJob(this, request));
+    }
+}
+
+void AvatarEncoder::complete(const Request &request)
+{
+    QObject *target = request.target;
+    if (!target || m_latest.value(target) != request.id)
+        return;
+
+    m_latest.remove(target);
+    disconnect(target, SIGNAL(destroyed(QObject*)), this, SLOT(targetDestroyed(QObject*)));
+
+    if (!QMetaObject::invokeMethod(target, "setAvatarData", Qt::DirectConnection, Q_ARG(QByteArray, request.data)))
+        qWarning() << "AvatarEncoder: Target" << target << "has no setAvatarData slot";
+    emit avatarEncoded(target);
+}
+
+void AvatarEncoder::deliverResults()
+{
+    QList<Request> results;
+    {
+        QMutexLocker locker(&m_resultsMutex);
+        results.swap(m_results);
+    }
+
+    foreach (const Request &request, results) {
+        m_running--;
+        complete(request);
+    }
+
+    startRequests();
+    if (!results.isEmpty() && !pendingCount())
+        emit finished();
+}
+
+void AvatarEncoder::waitForDone()
+{
+    while (pendingCount()) {
+        m_pool.waitForDone();
+        deliverResults();
+    }
+}
+
+void AvatarEncoder::targetDestroyed(QObject *target)
+{
+    m_latest.remove(target);
+}
@@ -0,0 +1,108 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AVATARENCODER_H
+#define AVATARENCODER_H
+
+#include <QObject>
+#include <QImage>
+#include <QPointer>
+#include <QQueue>
+#include <QHash>
+#include <QMutex>
+#include <QThreadPool>
+
+/* Scales and encodes avatar images on a pool of worker threads.
+ *
+ * Requests wait in a queue and are started as workers become free; encoding
+ * never happens on the caller's thread.
+ * When a request completes, the encoded JPEG is passed to the target's
+ * setAvatarData(QByteArray) slot on the main thread, and avatarEncoded is
+ * emitted. A newer request for the same target supersedes any earlier one, and
+ * takes its place in the queue. */
+class AvatarEncoder : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(AvatarEncoder)
+
+public:
+    /* Largest width and height of a stored avatar */
+    static const int AvatarSize = 160;
+
+    static AvatarEncoder *instance();
+
+    /* A null image removes the avatar immediately */
+    void encode(QObject *target, const QImage &image);
+    int pendingCount() const { return m_queue.size() + m_running; }
+    /* Completes all pending requests before returning */
+    void waitForDone();
+
+    /* Scales and encodes image on the calling thread; empty if image is null */
+    static QByteArray encodeImage(QImage image);
+
+signals:
+    void avatarEncoded(QObject *target);
+    /* Emitted when the last pending request is completed */
+    void finished();
+
+private slots:
+    void deliverResults();
+    void targetDestroyed(QObject *target);
+
+private:
+    friend class AvatarEncodeJob;
+
+    struct Request
+    {
+        quint64 id;
+        QPointer<QObject> target;
+        QImage image;
+        QByteArray data;
+    };
+
+    QThreadPool m_pool;
+    QQueue<Request> m_queue;
+    int m_running;
+    quint64 m_nextId;
+    /* Most recent request for each target */
+    QHash<QObject*,quint64> m_latest;
+    /* Completed requests waiting for the main thread, protected by m_resultsMutex */
+    QMutex m_resultsMutex;
+    QList<Request> m_results;
+
+    explicit AvatarEncoder(QObject *parent = 0);
+
+    void startRequests();
+    void complete(const Request &request);
+};
+
+#endif // AVATARENCODER_H
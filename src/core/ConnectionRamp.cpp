@@ -0,0 +1,184 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ConnectionRamp.h"
+#include "ContactUser.h"
+#include "tor/TorControl.h"
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <limits>
+
+ConnectionRamp *ConnectionRamp::instance()
+{
+    static ConnectionRamp *p = 0;
+    if (!p)
+        p = new ConnectionRamp(qApp);
+    return p;
+}
+
+ConnectionRamp::ConnectionRamp(QObject *parent)
+    : QObject(parent), m_pendingSerial(0), m_maxConcurrent(8), m_onlineCount(0)
+{
+    /* Queued contacts are started on the next event loop iteration, so contacts
+     * loaded together are ordered together */
+    m_startTimer.setSingleShot(true);
+    m_startTimer.setInterval(0);
+    connect(&m_startTimer, SIGNAL(timeout()), SLOT(startAttempts()));
+
+    m_expireTimer.setInterval(1000);
+    connect(&m_expireTimer, SIGNAL(timeout()), SLOT(expireAttempts()));
+
+    connect(torControl, SIGNAL(connectivityChanged()), SLOT(connectivityChanged()));
+}
+
+void ConnectionRamp::setMaxConcurrent(int max)
+{
+    m_maxConcurrent = qMax(1, max);
+    m_startTimer.start();
+}
+
+bool ConnectionRamp::admit(ContactUser *user)
+{
+    if (m_active.contains(user))
+        return true;
+    if (m_pendingKeys.contains(user))
+        return false;
+
+    PendingKey key(-user->lastActivity(), m_pendingSerial++);
+    m_pending.insert(key, user);
+    m_pendingKeys.insert(user, key);
+    connect(user, SIGNAL(destroyed(QObject*)), SLOT(userDestroyed(QObject*)), Qt::UniqueConnection);
+
+    if (!m_startTimer.isActive())
+        m_startTimer.start();
+    return false;
+}
+
+void ConnectionRamp::prioritize(ContactUser *user)
+{
+    QHash<ContactUser*,PendingKey>::Iterator it = m_pendingKeys.find(user);
+    if (it == m_pendingKeys.end())
+        return;
+
+    /* Ahead of every contact queued by activity, and of those prioritized earlier */
+    m_pending.remove(*it);
+    *it = PendingKey(std::numeric_limits<qint64>::min(), -m_pendingSerial++);
+    m_pending.insert(*it, user);
+}
+
+void ConnectionRamp::connectivityChanged()
+{
+    if (torControl->hasConnectivity()) {
+        m_rampTime.start();
+        m_onlineCount = 0;
+        startAttempts();
+    }
+}
+
+void ConnectionRamp::startAttempts()
+{
+    if (!torControl->hasConnectivity())
+        return;
+
+    while (!m_pending.isEmpty() && m_active.size() < m_maxConcurrent) {
+        ContactUser *user = m_pending.take(m_pending.firstKey());
+        m_pendingKeys.remove(user);
+
+        /* Connected or changed while queued; it's queued again if it goes offline */
+        if (!user->canConnectOutgoing()) {
+            disconnect(user, 0, this, 0);
+            continue;
+        }
+
+        m_active.insert(user, QDateTime::currentMSecsSinceEpoch() + AttemptTimeout * 1000);
+        connect(user, SIGNAL(connected()), SLOT(userConnected()));
+
+        user->setupOutgoingSocket();
+    }
+
+    if (!m_active.isEmpty() && !m_expireTimer.isActive())
+        m_expireTimer.start();
+}
+
+void ConnectionRamp::userConnected()
+{
+    ContactUser *user = static_cast<ContactUser*>(sender());
+    if (!m_active.contains(user))
+        return;
+
+    if (m_rampTime.isValid()) {
+        m_onlineCount++;
+        if (m_onlineCount == 1 || m_onlineCount == 10 || m_onlineCount % 50 == 0)
+            qDebug() << "Connection ramp:" << m_onlineCount << "contacts online after" << m_rampTime.elapsed() << "ms";
+    }
+
+    finishAttempt(user);
+}
+
+void ConnectionRamp::userDestroyed(QObject *object)
+{
+    ContactUser *user = static_cast<ContactUser*>(object);
+    if (m_pendingKeys.contains(user))
+        m_pending.remove(m_pendingKeys.take(user));
+    if (m_active.contains(user))
+        finishAttempt(user);
+}
+
+void ConnectionRamp::expireAttempts()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<ContactUser*> expired;
+    for (QHash<ContactUser*,qint64>::ConstIterator it = m_active.constBegin(); it != m_active.constEnd(); ++it) {
+        if (it.value() <= now)
+            expired.append(it.key());
+    }
+
+    foreach (ContactUser *user, expired)
+        finishAttempt(user);
+}
+
+void ConnectionRamp::finishAttempt(ContactUser *user)
+{
+    m_active.remove(user);
+    disconnect(user, 0, this, 0);
+
+    if (m_active.isEmpty()) {
+        m_expireTimer.stop();
+        if (m_pending.isEmpty() && m_rampTime.isValid()) {
+            qDebug() << "Connection ramp finished with" << m_onlineCount << "contacts online after" << m_rampTime.elapsed() << "ms";
+            m_rampTime.invalidate();
+        }
+    }
+
+    startAttempts();
+}
@@ -0,0 +1,102 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CONNECTIONRAMP_H
+#define CONNECTIONRAMP_H
+
+#include <QObject>
+#include <QMap>
+#include <QHash>
+#include <QPair>
+#include <QTimer>
+#include <QElapsedTimer>
+
+class ContactUser;
+
+/* Staggers the first outgoing connection attempts to contacts.
+ *
+ * Without this, every contact would start a hidden service lookup the moment
+ * Tor has connectivity. Instead, contacts wait in order of recent activity,
+ * and at most maxConcurrent() attempts are in progress at once. An attempt
+ * ends when the contact connects or after AttemptTimeout; later retries are
+ * left to the socket. */
+class ConnectionRamp : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ConnectionRamp)
+
+public:
+    /* Seconds an attempt holds its slot if the contact doesn't connect */
+    static const int AttemptTimeout = 30;
+
+    static ConnectionRamp *instance();
+
+    int maxConcurrent() const { return m_maxConcurrent; }
+    void setMaxConcurrent(int max);
+
+    /* True if the contact may create its outgoing socket now. Otherwise it's queued,
+     * and ContactUser::setupOutgoingSocket is called again when its turn comes. */
+    bool admit(ContactUser *user);
+    /* Moves a queued contact to the front */
+    void prioritize(ContactUser *user);
+
+private slots:
+    void startAttempts();
+    void connectivityChanged();
+    void userConnected();
+    void userDestroyed(QObject *object);
+    void expireAttempts();
+
+private:
+    /* Queued contacts in the order they start: by descending activity, except for
+     * prioritized contacts, which come first. The second part of the key keeps
+     * contacts with equal activity in the order they were queued. */
+    typedef QPair<qint64,qint64> PendingKey;
+    QMap<PendingKey,ContactUser*> m_pending;
+    QHash<ContactUser*,PendingKey> m_pendingKeys;
+    qint64 m_pendingSerial;
+    /* Attempts in progress, with the time they expire */
+    QHash<ContactUser*,qint64> m_active;
+    int m_maxConcurrent;
+    QTimer m_startTimer;
+    QTimer m_expireTimer;
+
+    /* Startup measurement: time since connectivity until contacts came online */
+    QElapsedTimer m_rampTime;
+    int m_onlineCount;
+
+    explicit ConnectionRamp(QObject *parent = 0);
+
+    void finishAttempt(ContactUser *user);
+};
+
+#endif // CONNECTIONRAMP_H
@@ -32,7 +32,8 @@
 
 #include "ContactIDValidator.h"
 
-static QRegularExpression regex(QStringLiteral("torsion:[a-z2-7]{16}"));
+/* v2 onion services have 16 characters, and v3 services 56 */
+static QRegularExpression regex(QStringLiteral("^torsion:([a-z2-7]{16}|[a-z2-7]{56})$"));
 
 ContactIDValidator::ContactIDValidator(QObject *parent)
     : QRegularExpressionValidator(parent), m_uniqueIdentity(0)
@@ -83,9 +84,9 @@ QString ContactIDValidator::idFromHostname(const QString &hostname)
 {
     QString re = hostname;
 
-    if (re.size() != 16)
+    if (re.size() != 16 && re.size() != 56)
     {
-        if (re.size() == 22 && re.toLower().endsWith(QLatin1String(".onion")))
+        if ((re.size() == 22 || re.size() == 62) && re.toLower().endsWith(QLatin1String(".onion")))
             re.chop(6);
         else
             return QString();
@@ -0,0 +1,226 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ContactRequestDispatcher.h"
+#include "OutgoingContactRequest.h"
+#include "ContactUser.h"
+#include "tor/TorControl.h"
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <algorithm>
+
+ContactRequestDispatcher *ContactRequestDispatcher::instance()
+{
+    static ContactRequestDispatcher *p = 0;
+    if (!p)
+        p = new ContactRequestDispatcher(qApp);
+    return p;
+}
+
+ContactRequestDispatcher::ContactRequestDispatcher(QObject *parent)
+    : QObject(parent), m_maxConcurrent(8), m_bucket(Rate, Burst), m_successCount(0), m_averageLatency(0)
+{
+    /* Requests are started on the next event loop iteration, so requests loaded
+     * together are ordered together */
+    m_startTimer.setSingleShot(true);
+    m_startTimer.setInterval(0);
+    connect(&m_startTimer, SIGNAL(timeout()), SLOT(startAttempts()));
+
+    /* Expires attempts, and starts requests held back by the bucket or a retry delay */
+    m_tickTimer.setInterval(1000);
+    connect(&m_tickTimer, SIGNAL(timeout()), SLOT(expireAttempts()));
+
+    connect(torControl, SIGNAL(connectivityChanged()), SLOT(connectivityChanged()));
+}
+
+bool ContactRequestDispatcher::pendingLessThan(const Pending &a, const Pending &b)
+{
+    if (a.priority != b.priority)
+        return a.priority > b.priority;
+    return a.queued < b.queued;
+}
+
+void ContactRequestDispatcher::setMaxConcurrent(int max)
+{
+    m_maxConcurrent = qMax(1, max);
+    m_startTimer.start();
+}
+
+int ContactRequestDispatcher::pendingIndex(OutgoingContactRequest *request) const
+{
+    for (int i = 0; i < m_pending.size(); i++) {
+        if (m_pending[i].request == request)
+            return i;
+    }
+    return -1;
+}
+
+void ContactRequestDispatcher::enqueue(OutgoingContactRequest *request, int failures, qint64 notBefore)
+{
+    Pending p;
+    p.request = request;
+    p.priority = request->priority();
+    p.queued = QDateTime::currentMSecsSinceEpoch();
+    p.notBefore = notBefore;
+    p.failures = failures;
+    QList<Pending>::Iterator it = std::upper_bound(m_pending.begin(), m_pending.end(), p, pendingLessThan);
+    m_pending.insert(it, p);
+}
+
+void ContactRequestDispatcher::submit(OutgoingContactRequest *request)
+{
+    if (m_active.contains(request) || pendingIndex(request) >= 0)
+        return;
+
+    enqueue(request, 0, 0);
+    if (!m_startTimer.isActive())
+        m_startTimer.start();
+    emit metricsChanged();
+}
+
+void ContactRequestDispatcher::reprioritize(OutgoingContactRequest *request)
+{
+    int i = pendingIndex(request);
+    if (i < 0)
+        return;
+
+    Pending p = m_pending.takeAt(i);
+    p.priority = request->priority();
+    QList<Pending>::Iterator it = std::upper_bound(m_pending.begin(), m_pending.end(), p, pendingLessThan);
+    m_pending.insert(it, p);
+
+    if (!m_startTimer.isActive())
+        m_startTimer.start();
+}
+
+void ContactRequestDispatcher::finish(OutgoingContactRequest *request, bool succeeded)
+{
+    int i = pendingIndex(request);
+    if (i >= 0)
+        m_pending.removeAt(i);
+
+    if (m_active.contains(request)) {
+        Active attempt = m_active.take(request);
+        if (succeeded) {
+            qint64 latency = attempt.started.elapsed();
+            m_successCount++;
+            /* Exponential moving average, starting from the first sample */
+            if (m_successCount == 1)
+                m_averageLatency = latency;
+            else
+                m_averageLatency += (latency - m_averageLatency) * 0.2;
+
+            qDebug() << "Contact request for" << request->user->uniqueID << "answered after" << latency
+                     << "ms; average" << averageLatency() << "ms," << m_pending.size() << "queued";
+        }
+
+        if (!m_startTimer.isActive())
+            m_startTimer.start();
+    }
+
+    updateTimer();
+    emit metricsChanged();
+}
+
+void ContactRequestDispatcher::connectivityChanged()
+{
+    if (torControl->hasConnectivity())
+        startAttempts();
+}
+
+void ContactRequestDispatcher::startAttempts()
+{
+    if (!torControl->hasConnectivity()) {
+        updateTimer();
+        return;
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    int i = 0;
+    while (i < m_pending.size() && m_active.size() < m_maxConcurrent) {
+        if (!m_pending[i].request) {
+            m_pending.removeAt(i);
+            continue;
+        }
+
+        /* Waiting to retry; later requests may go first */
+        if (m_pending[i].notBefore > now) {
+            i++;
+            continue;
+        }
+
+        if (!m_bucket.take())
+            break;
+
+        Pending p = m_pending.takeAt(i);
+        Active attempt;
+        attempt.started.start();
+        attempt.failures = p.failures;
+        m_active.insert(p.request, attempt);
+
+        p.request->startAttempt();
+    }
+
+    updateTimer();
+    emit metricsChanged();
+}
+
+void ContactRequestDispatcher::expireAttempts()
+{
+    QList<OutgoingContactRequest*> expired;
+    for (QHash<OutgoingContactRequest*,Active>::ConstIterator it = m_active.constBegin(); it != m_active.constEnd(); ++it) {
+        if (it.value().started.hasExpired(AttemptTimeout * 1000))
+            expired.append(it.key());
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    foreach (OutgoingContactRequest *request, expired) {
+        int failures = m_active.take(request).failures + 1;
+        int delay = qMin(failures * RetryDelay, MaxRetryDelay);
+        qDebug() << "Contact request for" << request->user->uniqueID << "timed out; retrying in" << delay << "seconds";
+
+        /* Closing the connection frees its circuit for the next request */
+        request->stopAttempt();
+        enqueue(request, failures, now + delay * 1000);
+    }
+
+    startAttempts();
+}
+
+void ContactRequestDispatcher::updateTimer()
+{
+    if (m_active.isEmpty() && m_pending.isEmpty())
+        m_tickTimer.stop();
+    else if (!m_tickTimer.isActive())
+        m_tickTimer.start();
+}
@@ -0,0 +1,144 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CONTACTREQUESTDISPATCHER_H
+#define CONTACTREQUESTDISPATCHER_H
+
+#include <QObject>
+#include <QPointer>
+#include <QList>
+#include <QHash>
+#include <QTimer>
+#include <QElapsedTimer>
+#include "utils/TokenBucket.h"
+
+class OutgoingContactRequest;
+
+/* Schedules the connections of outgoing contact requests.
+ *
+ * At most maxConcurrent() requests are connecting at once; the rest wait in
+ * order of priority, then of the time they were queued. A request's attempt
+ * ends when the peer responds, or after AttemptTimeout, in which case its
+ * connection is closed and it is queued again after a delay that grows with
+ * each failed attempt. Starts are also paced by a token bucket, so a bulk
+ * import doesn't use every slot in the same second.
+ *
+ * An accepted request's connection becomes the contact's primary connection,
+ * so no second circuit is built for it. */
+class ContactRequestDispatcher : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ContactRequestDispatcher)
+
+    Q_PROPERTY(int queueDepth READ queueDepth NOTIFY metricsChanged)
+    Q_PROPERTY(int activeCount READ activeCount NOTIFY metricsChanged)
+    Q_PROPERTY(int successCount READ successCount NOTIFY metricsChanged)
+    Q_PROPERTY(int averageLatency READ averageLatency NOTIFY metricsChanged)
+
+public:
+    /* Seconds an attempt holds its slot without a response from the peer */
+    static const int AttemptTimeout = 120;
+    /* Seconds before retrying a timed out request, per failed attempt */
+    static const int RetryDelay = 60;
+    static const int MaxRetryDelay = 600;
+
+    static const int Burst = 10;
+    /* Attempts started per second beyond the burst */
+    static const int Rate = 1;
+
+    static ContactRequestDispatcher *instance();
+
+    int maxConcurrent() const { return m_maxConcurrent; }
+    void setMaxConcurrent(int max);
+
+    /* Queues the request to connect. OutgoingContactRequest::startAttempt is
+     * called when its turn comes. */
+    void submit(OutgoingContactRequest *request);
+    /* Ends the request's attempt or removes it from the queue. If succeeded, the
+     * time since the attempt started is recorded as its latency. */
+    void finish(OutgoingContactRequest *request, bool succeeded);
+    /* Reorders a queued request after its priority changed */
+    void reprioritize(OutgoingContactRequest *request);
+
+    /* Requests waiting for a slot */
+    int queueDepth() const { return m_pending.size(); }
+    /* Requests connecting now */
+    int activeCount() const { return m_active.size(); }
+    /* Requests that received a response since startup */
+    int successCount() const { return m_successCount; }
+    /* Moving average of milliseconds from the start of an attempt to the response */
+    int averageLatency() const { return qRound(m_averageLatency); }
+
+signals:
+    void metricsChanged();
+
+private slots:
+    void startAttempts();
+    void connectivityChanged();
+    void expireAttempts();
+
+private:
+    struct Pending
+    {
+        QPointer<OutgoingContactRequest> request;
+        int priority;
+        /* Queue time, and the earliest time it may start */
+        qint64 queued, notBefore;
+        int failures;
+    };
+
+    struct Active
+    {
+        QElapsedTimer started;
+        int failures;
+    };
+
+    QList<Pending> m_pending;
+    QHash<OutgoingContactRequest*,Active> m_active;
+    int m_maxConcurrent;
+    TokenBucket m_bucket;
+    QTimer m_startTimer;
+    QTimer m_tickTimer;
+
+    int m_successCount;
+    double m_averageLatency;
+
+    explicit ContactRequestDispatcher(QObject *parent = 0);
+
+    static bool pendingLessThan(const Pending &a, const Pending &b);
+
+    void enqueue(OutgoingContactRequest *request, int failures, qint64 notBefore);
+    int pendingIndex(OutgoingContactRequest *request) const;
+    void updateTimer();
+};
+
+#endif // CONTACTREQUESTDISPATCHER_H
@@ -38,21 +38,43 @@
 #include "protocol/GetSecretCommand.h"
 #include "protocol/ChatMessageCommand.h"
 #include "protocol/OutgoingContactSocket.h"
+#include "protocol/ConnectionProbe.h"
 #include "protocol/ProtocolConstants.h"
 #include "core/ContactIDValidator.h"
 #include "core/OutgoingContactRequest.h"
+#include "core/MessageHistory.h"
+#include "core/AvatarEncoder.h"
+#include "core/ConnectionRamp.h"
 #include <QPixmapCache>
 #include <QtDebug>
-#include <QBuffer>
 #include <QDateTime>
+#include <QDir>
+
+/* Keys of the settings that are cached by ContactUser */
+static const QLatin1String nicknameKey("nickname");
+static const QLatin1String hostnameKey("hostname");
+static const QLatin1String portKey("port");
+static const QLatin1String localSecretKey("localSecret");
+static const QLatin1String remoteSecretKey("remoteSecret");
+static const QLatin1String avatarKey("avatar");
+static const QLatin1String whenCreatedKey("whenCreated");
+static const QLatin1String lastConnectedKey("lastConnected");
+static const QLatin1String lastMessageKey("lastMessage");
+
+static const quint16 defaultPort = 9878;
 
 ContactUser::ContactUser(UserIdentity *ident, int id, QObject *parent)
     : QObject(parent)
     , identity(ident)
     , uniqueID(id)
+    , m_record(-1)
+    , m_port(defaultPort)
     , m_lastReceivedChatID(0)
     , m_contactRequest(0)
     , m_outgoingSocket(0)
+    , m_history(0)
+    , m_probe(0)
+    , m_probeBudget(0)
 {
     Q_ASSERT(uniqueID >= 0);
 
@@ -68,11 +90,22 @@ ContactUser::ContactUser(UserIdentity *ident, int id, QObject *parent)
 
 void ContactUser::loadSettings()
 {
-    config->beginGroup(QLatin1String("contacts/") + QString::number(uniqueID));
-
-    m_nickname = config->value("nickname", uniqueID).toString();
-
-    config->endGroup();
+    m_record = database->findRecord(StateDatabase::ContactRecord, uniqueID);
+    if (m_record < 0)
+        m_record = database->createRecord(StateDatabase::ContactRecord, uniqueID, identity->uniqueID);
+
+    m_nickname = database->nickname(m_record);
+    if (m_nickname.isEmpty())
+        m_nickname = QString::number(uniqueID);
+    m_hostname = QString::fromLatin1(database->hostname(m_record));
+    m_port = database->port(m_record);
+    if (!m_port)
+        m_port = defaultPort;
+    m_localSecret = database->localSecret(m_record);
+    m_remoteSecret = database->remoteSecret(m_record);
+    m_properties = database->properties(m_record);
+
+    m_contactID = ContactIDValidator::idFromHostname(m_hostname);
 }
 
 void ContactUser::loadContactRequest()
@@ -90,17 +123,100 @@ void ContactUser::loadContactRequest()
 
 QVariant ContactUser::readSetting(const QString &key, const QVariant &defaultValue) const
 {
-    return config->value(QString::fromLatin1("contacts/%1/%2").arg(uniqueID).arg(key), defaultValue);
+    QVariant value;
+
+    if (key == nicknameKey)
+        value = m_nickname;
+    else if (key == hostnameKey)
+        value = m_hostname;
+    else if (key == portKey)
+        value = m_port;
+    else if (key == localSecretKey)
+        value = m_localSecret;
+    else if (key == remoteSecretKey)
+        value = m_remoteSecret;
+    else if (key == avatarKey)
+        value = avatarData();
+    else if (key == whenCreatedKey)
+        value = database->time(m_record, StateDatabase::CreatedTime);
+    else if (key == lastConnectedKey)
+        value = database->time(m_record, StateDatabase::LastActiveTime);
+    else if (key == lastMessageKey)
+        value = database->time(m_record, StateDatabase::LastMessageTime);
+    else
+        value = m_properties.value(key);
+
+    if (value.isNull() || (value.type() == QVariant::ByteArray && value.toByteArray().isEmpty()))
+        return defaultValue;
+    return value;
 }
 
 void ContactUser::writeSetting(const QString &key, const QVariant &value)
 {
-    config->setValue(QString::fromLatin1("contacts/%1/%2").arg(uniqueID).arg(key), value);
+    if (writeCachedSetting(key, value))
+        return;
+
+    m_properties.insert(key, value);
+    database->setProperties(m_record, m_properties);
 }
 
 void ContactUser::removeSetting(const QString &key)
 {
-    config->remove(QString::fromLatin1("contacts/%1/%2").arg(uniqueID).arg(key));
+    if (key == remoteSecretKey) {
+        setRemoteSecret(QByteArray());
+    } else if (key == portKey) {
+        m_port = defaultPort;
+        database->setPort(m_record, 0);
+    } else if (key == avatarKey) {
+        database->setBlob(m_record, StateDatabase::AvatarBlob, QByteArray());
+    } else if (key == whenCreatedKey) {
+        database->setTime(m_record, StateDatabase::CreatedTime, QDateTime());
+    } else if (key == lastConnectedKey) {
+        database->setTime(m_record, StateDatabase::LastActiveTime, QDateTime());
+    } else if (key == lastMessageKey) {
+        database->setTime(m_record, StateDatabase::LastMessageTime, QDateTime());
+    } else {
+        /* As with QSettings, this also removes any keys in a group of that name */
+        QString group = key + QLatin1Char('/');
+        bool changed = m_properties.remove(key) > 0;
+        for (QVariantMap::Iterator it = m_properties.lowerBound(group); it != m_properties.end() && it.key().startsWith(group); )
+        {
+            it = m_properties.erase(it);
+            changed = true;
+        }
+
+        if (changed)
+            database->setProperties(m_record, m_properties);
+    }
+}
+
+/* Route writes to cached keys through their setters, so the cache and indexes stay current */
+bool ContactUser::writeCachedSetting(const QString &key, const QVariant &value)
+{
+    if (key == nicknameKey) {
+        setNickname(value.toString());
+    } else if (key == hostnameKey) {
+        setHostname(value.toString());
+    } else if (key == localSecretKey) {
+        setLocalSecret(value.toByteArray());
+    } else if (key == remoteSecretKey) {
+        setRemoteSecret(value.toByteArray());
+    } else if (key == portKey) {
+        m_port = (quint16)value.toUInt();
+        database->setPort(m_record, m_port);
+    } else if (key == avatarKey) {
+        database->setBlob(m_record, StateDatabase::AvatarBlob, value.toByteArray());
+    } else if (key == whenCreatedKey) {
+        database->setTime(m_record, StateDatabase::CreatedTime, value.toDateTime());
+    } else if (key == lastConnectedKey) {
+        database->setTime(m_record, StateDatabase::LastActiveTime, value.toDateTime());
+    } else if (key == lastMessageKey) {
+        database->setTime(m_record, StateDatabase::LastMessageTime, value.toDateTime());
+    } else {
+        return false;
+    }
+
+    return true;
 }
 
 ContactUser *ContactUser::addNewContact(UserIdentity *identity, int id)
@@ -109,7 +225,7 @@ ContactUser *ContactUser::addNewContact(UserIdentity *identity, int id)
     user->writeSetting("whenCreated", QDateTime::currentDateTime());
 
     /* Generate the local secret and set it */
-    user->writeSetting("localSecret", SecureRNG::random(16));
+    user->setLocalSecret(SecureRNG::random(16));
 
     return user;
 }
@@ -139,28 +255,48 @@ void ContactUser::updateStatus()
         setupOutgoingSocket();
 }
 
-void ContactUser::setupOutgoingSocket()
+bool ContactUser::canConnectOutgoing() const
 {
     if (m_status != Offline)
-        return;
+        return false;
 
-    QByteArray secret = readSetting("remoteSecret").toByteArray();
-    if (secret.isEmpty() || hostname().isEmpty() || !port())
-        return;
+    if (m_remoteSecret.isEmpty() || m_hostname.isEmpty() || !m_port)
+        return false;
 
     // Refuse to make outgoing connections to the local hostname
-    if (hostname() == identity->hostname())
+    return m_hostname != identity->hostname();
+}
+
+void ContactUser::setupOutgoingSocket()
+{
+    if (!canConnectOutgoing())
         return;
 
     if (!m_outgoingSocket) {
+        /* First attempts are staggered; the ramp calls this again when it's our turn */
+        if (!ConnectionRamp::instance()->admit(this))
+            return;
+
         qDebug() << "Creating outgoing connection socket for contact";
         m_outgoingSocket = new OutgoingContactSocket(this);
         // TODO: Need proper UI and handling for authenticationFailed and versionNegotiationFailed
         connect(m_outgoingSocket, SIGNAL(socketReady(QTcpSocket*)), SLOT(incomingProtocolSocket(QTcpSocket*)));
     }
 
-    m_outgoingSocket->setAuthentication(Protocol::PurposePrimary, secret);
-    m_outgoingSocket->connectToHost(hostname(), port());
+    m_outgoingSocket->setAuthentication(Protocol::PurposePrimary, m_remoteSecret);
+    m_outgoingSocket->setLastActivity(lastActivity());
+    m_outgoingSocket->connectToHost(m_hostname, m_port);
+}
+
+void ContactUser::prioritizeConnection()
+{
+    if (m_status != Offline)
+        return;
+
+    if (m_outgoingSocket)
+        m_outgoingSocket->reconnectNow();
+    else
+        ConnectionRamp::instance()->prioritize(this);
 }
 
 void ContactUser::onConnected()
@@ -176,7 +312,7 @@ void ContactUser::onConnected()
         Q_ASSERT(status() != RequestPending);
     }
 
-    if (readSetting("remoteSecret").isNull())
+    if (m_remoteSecret.isEmpty())
     {
         qDebug() << "Requesting remote secret from user" << uniqueID;
         GetSecretCommand *command = new GetSecretCommand(this);
@@ -192,10 +328,76 @@ void ContactUser::onDisconnected()
     qDebug() << "Contact" << uniqueID << "disconnected";
     writeSetting("lastConnected", QDateTime::currentDateTime());
 
+    /* Replies to outstanding probes will never arrive */
+    if (m_probe)
+        m_probe->cancel();
+
     updateStatus();
     emit disconnected();
 }
 
+QString ContactUser::historyDirectory() const
+{
+    return config->configLocation() + QLatin1String("history/") + QString::number(uniqueID);
+}
+
+qint64 ContactUser::lastActivity() const
+{
+    QDateTime connected = database->time(m_record, StateDatabase::LastActiveTime);
+    QDateTime message = database->time(m_record, StateDatabase::LastMessageTime);
+    return qMax(connected.isValid() ? connected.toMSecsSinceEpoch() : 0,
+                message.isValid() ? message.toMSecsSinceEpoch() : 0);
+}
+
+MessageHistory *ContactUser::history()
+{
+    if (!m_history) {
+        m_history = new MessageHistory(historyDirectory(), this);
+        if (!m_history->open())
+            qWarning() << "Cannot open message history for contact" << uniqueID;
+    }
+
+    return m_history;
+}
+
+ConnectionProbe *ContactUser::probe()
+{
+    if (!m_probe) {
+        m_probe = new ConnectionProbe(this, this);
+        connect(m_probe, SIGNAL(finished()), SIGNAL(probeFinished()));
+    }
+
+    return m_probe;
+}
+
+bool ContactUser::probeConnection()
+{
+    return probe()->start();
+}
+
+QVariantMap ContactUser::probeResult() const
+{
+    QVariantMap re;
+    if (!m_probe || !m_probe->hasResult())
+        return re;
+
+    ConnectionProbe::Result result = m_probe->result();
+    re.insert(QStringLiteral("probesSent"), result.probesSent);
+    re.insert(QStringLiteral("probesReceived"), result.probesReceived);
+    re.insert(QStringLiteral("probesRejected"), result.probesRejected);
+    re.insert(QStringLiteral("bytesSent"), result.bytesSent);
+    re.insert(QStringLiteral("bytesReceived"), result.bytesReceived);
+    re.insert(QStringLiteral("elapsed"), result.elapsed);
+    re.insert(QStringLiteral("uploadRate"), result.uploadRate);
+    re.insert(QStringLiteral("downloadRate"), result.downloadRate);
+    re.insert(QStringLiteral("rttMin"), result.rttMin);
+    re.insert(QStringLiteral("rttMedian"), result.rttMedian);
+    re.insert(QStringLiteral("rttP90"), result.rttP90);
+    re.insert(QStringLiteral("rttMax"), result.rttMax);
+    re.insert(QStringLiteral("jitter"), result.jitter);
+    return re;
+}
+
 void ContactUser::setNickname(const QString &nickname)
 {
     if (m_nickname == nickname)
@@ -204,25 +406,37 @@ void ContactUser::setNickname(const QString &nickname)
     /* non-critical, just a safety net for UI checks */
     Q_ASSERT(!identity->contacts.lookupNickname(nickname));
 
+    QString oldNickname = m_nickname;
     m_nickname = nickname;
 
-    writeSetting("nickname", nickname);
+    database->setNickname(m_record, nickname);
+    identity->contacts.updateNicknameIndex(this, oldNickname, nickname);
     emit nicknameChanged();
 }
 
-QString ContactUser::hostname() const
+void ContactUser::setLocalSecret(const QByteArray &secret)
 {
-    return readSetting("hostname").toString();
+    Q_ASSERT(secret.size() == 16);
+
+    if (m_localSecret == secret)
+        return;
+
+    QByteArray oldSecret = m_localSecret;
+    m_localSecret = secret;
+
+    database->setLocalSecret(m_record, secret);
+    identity->contacts.updateSecretIndex(this, oldSecret, secret);
 }
 
-quint16 ContactUser::port() const
+void ContactUser::setRemoteSecret(const QByteArray &secret)
 {
-    return (quint16)readSetting("port", 9878).toUInt();
+    m_remoteSecret = secret;
+    database->setRemoteSecret(m_record, secret);
 }
 
-QString ContactUser::contactID() const
+QByteArray ContactUser::avatarData() const
 {
-    return ContactIDValidator::idFromHostname(hostname());
+    return database->blob(m_record, StateDatabase::AvatarBlob);
 }
 
 void ContactUser::setHostname(const QString &hostname)
@@ -232,27 +446,29 @@ void ContactUser::setHostname(const QString &hostname)
     if (!hostname.endsWith(QLatin1String(".onion")))
         fh.append(QLatin1String(".onion"));
 
-    writeSetting(QLatin1String("hostname"), fh);
+    QString oldHostname = m_hostname;
+    m_hostname = fh;
+    m_contactID = ContactIDValidator::idFromHostname(m_hostname);
+
+    database->setHostname(m_record, fh.toLatin1());
+    identity->contacts.updateHostnameIndex(this, oldHostname, fh);
     setupOutgoingSocket();
 }
 
 void ContactUser::setAvatar(QImage image)
 {
-    if (image.width() > 160 || image.height() > 160)
-        image = image.scaled(QSize(160, 160), Qt::KeepAspectRatio, Qt::SmoothTransformation);
-
-    if (!image.isNull())
-    {
-        QBuffer buffer;
-        buffer.open(QBuffer::ReadWrite);
-        if (image.save(&buffer, "jpeg", 90))
-            writeSetting("avatar", buffer.buffer());
-        else
-            image = QImage();
-    }
+    /* Scaling and encoding happen on a worker thread, which calls setAvatarData */
+    AvatarEncoder::instance()->encode(this, image);
+}
 
-    if (image.isNull())
+void ContactUser::setAvatarData(const QByteArray &data)
+{
+    if (data.isEmpty())
         removeSetting("avatar");
+    else
+        writeSetting("avatar", data);
+
+    emit avatarChanged();
 }
 
 void ContactUser::deleteContact()
@@ -275,7 +491,13 @@ void ContactUser::deleteContact()
     delete m_conn;
     m_conn = 0;
 
-    config->remove(QLatin1String("contacts/") + QString::number(uniqueID));
+    database->removeRecord(m_record);
+    m_record = -1;
+
+    if (m_history)
+        m_history->removeAll();
+    else
+        QDir(historyDirectory()).removeRecursively();
 
     deleteLater();
 }
@@ -320,7 +542,7 @@ void ContactUser::incomingProtocolSocket(QTcpSocket *socket)
         conn()->connectedDuration() < 30)
     {
         // Fall back to comparing onion hostnames to decide which connection to keep
-        bool keepOutgoing = QString::compare(hostname(), identity->hostname()) < 0;
+        bool keepOutgoing = QString::compare(m_hostname, identity->hostname()) < 0;
         if (isOutgoing(socket) != keepOutgoing) {
             qDebug() << "Discarding new protocol connection because existing one is too recent";
             socket->setParent(this);
@@ -41,6 +41,7 @@
 #include <QPixmapCache>
 #include <QMetaType>
 #include <QVariant>
+#include <QElapsedTimer>
 #include "protocol/ProtocolSocket.h"
 
 class UserIdentity;
@@ -48,6 +49,8 @@ struct ChatMessageData;
 class ChatMessageCommand;
 class OutgoingContactRequest;
 class OutgoingContactSocket;
+class MessageHistory;
+class ConnectionProbe;
 
 /* Represents a user on the contact list.
  * All persistent uses of a ContactUser instance must either connect to the
@@ -66,10 +69,13 @@ class ContactUser : public QObject
     Q_PROPERTY(QString contactID READ contactID CONSTANT)
     Q_PROPERTY(Status status READ status NOTIFY statusChanged)
     Q_PROPERTY(OutgoingContactRequest* contactRequest READ contactRequest NOTIFY statusChanged)
+    Q_PROPERTY(QVariantMap probeResult READ probeResult NOTIFY probeFinished)
 
     friend class ContactsManager;
     friend class ChatMessageCommand;
+    friend class ProbeCommand;
     friend class OutgoingContactRequest;
+    friend class ConnectionRamp;
 
 public:
     enum Status
@@ -95,13 +101,46 @@ public:
 
     const QString &nickname() const { return m_nickname; }
     /* Hostname is in the onion hostname format, i.e. it ends with .onion */
-    QString hostname() const;
-    quint16 port() const;
+    const QString &hostname() const { return m_hostname; }
+    quint16 port() const { return m_port; }
     /* Contact ID in the torsion: format */
-    QString contactID() const;
+    const QString &contactID() const { return m_contactID; }
+
+    /* Secret used by this contact to authenticate connections to us */
+    const QByteArray &localSecret() const { return m_localSecret; }
+    /* Replaces the local secret; the contact must learn the new one before it can reconnect */
+    void setLocalSecret(const QByteArray &secret);
+    /* Secret we use to authenticate connections to this contact */
+    const QByteArray &remoteSecret() const { return m_remoteSecret; }
+    void setRemoteSecret(const QByteArray &secret);
+
+    /* Encoded avatar image */
+    QByteArray avatarData() const;
 
     Status status() const { return m_status; }
+    /* Most recent of the last connection and the last message, in milliseconds since the epoch */
+    qint64 lastActivity() const;
+
+    /* True if offline, and known well enough to make an outgoing connection */
+    bool canConnectOutgoing() const;
+
+    /* Retry connecting now, ahead of other contacts, if offline; e.g. when a chat is opened */
+    Q_INVOKABLE void prioritizeConnection();
+
+    /* Conversation history; opened on first use */
+    MessageHistory *history();
+
+    /* Measures the connection to this contact with the default ConnectionProbe settings.
+     * Returns false if not connected or a probe is already running; probeFinished is
+     * emitted when it's done. */
+    Q_INVOKABLE bool probeConnection();
+    /* Probe of this connection, created on first use */
+    ConnectionProbe *probe();
+    /* Results of the last completed probe, by ConnectionProbe::Result field name; empty if none */
+    QVariantMap probeResult() const;
 
+    /* Settings of this contact, stored in its database record. The typed accessors above
+     * are cached in memory and written through; writes to their keys here update the cache. */
     Q_INVOKABLE QVariant readSetting(const QString &key, const QVariant &defaultValue = QVariant()) const;
     QVariant readSetting(const char *key, const QVariant &defaultValue = QVariant()) const
     {
@@ -125,7 +164,10 @@ public:
 public slots:
     void setNickname(const QString &nickname);
     void setHostname(const QString &hostname);
+    /* Encodes image asynchronously; the avatar changes when it's done */
     void setAvatar(QImage image);
+    /* Encoded avatar image, or empty to remove it */
+    void setAvatarData(const QByteArray &data);
 
     void updateStatus();
 
@@ -137,6 +179,8 @@ signals:
     void disconnected();
 
     void nicknameChanged();
+    void avatarChanged();
+    void probeFinished();
     void contactDeleted(ContactUser *user);
 
     /* Hack to allow creating models/windows/etc to handle other signals before they're
@@ -151,16 +195,32 @@ private slots:
 
 private:
     ProtocolSocket *m_conn;
+    /* Index in the StateDatabase */
+    int m_record;
     QString m_nickname;
+    QString m_hostname;
+    QString m_contactID;
+    QByteArray m_localSecret;
+    QByteArray m_remoteSecret;
+    /* Settings without a field of their own in the database record */
+    QVariantMap m_properties;
+    quint16 m_port;
     Status m_status;
     quint16 m_lastReceivedChatID;
     OutgoingContactRequest *m_contactRequest;
     OutgoingContactSocket *m_outgoingSocket;
+    MessageHistory *m_history;
+    ConnectionProbe *m_probe;
+    /* Receiving side rate limit for ProbeCommand */
+    QElapsedTimer m_probeBudgetTime;
+    qint64 m_probeBudget;
 
     /* See ContactsManager::addContact */
     static ContactUser *addNewContact(UserIdentity *identity, int id);
 
+    QString historyDirectory() const;
     void loadSettings();
+    bool writeCachedSetting(const QString &key, const QVariant &value);
     void loadContactRequest();
     void setupOutgoingSocket();
 };
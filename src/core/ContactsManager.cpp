@@ -35,7 +35,12 @@
 #include "IncomingRequestManager.h"
 #include "OutgoingContactRequest.h"
 #include "ContactIDValidator.h"
+#include "utils/CryptoKey.h"
+#include "utils/SecureRNG.h"
 #include <QStringList>
+#include <QIODevice>
+#include <QSet>
+#include <QMessageAuthenticationCode>
 #include <QDebug>
 
 ContactsManager *contactsManager = 0;
@@ -44,27 +49,19 @@ ContactsManager::ContactsManager(UserIdentity *id)
     : identity(id), incomingRequests(this), highestID(-1)
 {
     contactsManager = this;
+    m_secretIndexKey = SecureRNG::random(32);
 }
 
 void ContactsManager::loadFromSettings()
 {
-    config->beginGroup(QLatin1String("contacts"));
-    QStringList sections = config->childGroups();
-    config->endGroup();
-
-    for (QStringList::Iterator it = sections.begin(); it != sections.end(); ++it)
+    QList<int> records = database->records(StateDatabase::ContactRecord, identity->uniqueID);
+    for (QList<int>::ConstIterator it = records.begin(); it != records.end(); ++it)
     {
-        bool ok = false;
-        int id = it->toInt(&ok);
-        if (!ok)
-        {
-            qWarning("Ignoring contact %s with a non-integer ID", qPrintable(*it));
-            continue;
-        }
-
+        int id = database->recordId(*it);
     	ContactUser *user = new ContactUser(identity, id, this);
         connectSignals(user);
     	pContacts.append(user);
+        indexContact(user);
         highestID = qMax(id, highestID);
     }
 
@@ -78,6 +75,7 @@ ContactUser *ContactsManager::addContact(const QString &nickname)
     highestID++;
     ContactUser *user = ContactUser::addNewContact(identity, highestID);
     user->setParent(this);
+    indexContact(user);
     user->setNickname(nickname);
     connectSignals(user);
 
@@ -111,14 +109,21 @@ ContactUser *ContactsManager::createContactRequest(const QString &contactid, con
         return 0;
     }
 
+    return addContactRequest(hostname, nickname, myNickname, message, OutgoingContactRequest::Interactive);
+}
+
+ContactUser *ContactsManager::addContactRequest(const QString &hostname, const QString &nickname,
+                                                const QString &myNickname, const QString &message,
+                                                OutgoingContactRequest::Priority priority)
+{
     bool b = blockSignals(true);
     ContactUser *user = addContact(nickname);
     blockSignals(b);
     if (!user)
         return user;
-    user->setHostname(ContactIDValidator::hostnameFromID(contactid));
+    user->setHostname(hostname);
 
-    OutgoingContactRequest::createNewRequest(user, myNickname, message);
+    OutgoingContactRequest::createNewRequest(user, myNickname, message, priority);
 
     /* Signal deferred from addContact to avoid changing the status immediately */
     Q_ASSERT(user->status() == ContactUser::RequestPending);
@@ -126,61 +131,188 @@ ContactUser *ContactsManager::createContactRequest(const QString &contactid, con
     return user;
 }
 
-void ContactsManager::contactDeleted(ContactUser *user)
+ContactsManager::ImportResult ContactsManager::importContacts(QIODevice *input, const QString &myNickname,
+                                                             const QString &message)
 {
-    pContacts.removeOne(user);
+    ImportResult result = { 0, 0, 0, true };
+
+    struct Entry
+    {
+        QByteArray serviceID;
+        QString nickname;
+    };
+
+    /* Validate the whole list first, so only good entries reach the database */
+    QList<Entry> entries;
+    QSet<QByteArray> seen;
+    while (!input->atEnd())
+    {
+        QByteArray line = input->readLine().trimmed();
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+
+        int sep = 0;
+        while (sep < line.size() && line[sep] != ' ' && line[sep] != '\t')
+            sep++;
+
+        Entry entry;
+        entry.serviceID = line.left(sep).toLower();
+        entry.nickname = QString::fromUtf8(line.mid(sep).trimmed());
+        if (entry.serviceID.startsWith("torsion:"))
+            entry.serviceID.remove(0, 8);
+        if (entry.serviceID.endsWith(".onion"))
+            entry.serviceID.chop(6);
+
+        if (!isValidTorServiceID(entry.serviceID)) {
+            result.invalid++;
+            continue;
+        }
+
+        if (seen.contains(entry.serviceID) || lookupHostname(QString::fromLatin1(entry.serviceID))) {
+            result.duplicates++;
+            continue;
+        }
+
+        seen.insert(entry.serviceID);
+        entries.append(entry);
+    }
+
+    database->beginBatch();
+    foreach (const Entry &entry, entries)
+    {
+        QString contactID = QStringLiteral("torsion:") + QString::fromLatin1(entry.serviceID);
+        QString nickname = entry.nickname;
+        if (nickname.isEmpty() || lookupNickname(nickname))
+            nickname = contactID;
+
+        if (addContactRequest(QString::fromLatin1(entry.serviceID) + QStringLiteral(".onion"), nickname,
+                              myNickname, message, OutgoingContactRequest::Background))
+            result.added++;
+    }
+    result.saved = database->endBatch();
+
+    qDebug() << "Imported" << result.added << "contacts," << result.duplicates << "duplicates and"
+             << result.invalid << "invalid entries";
+    if (!result.saved)
+        qWarning() << "Imported contacts could not be written to disk yet";
+    return result;
 }
 
-ContactUser *ContactsManager::lookupSecret(const QByteArray &secret) const
+int ContactsManager::exportContacts(QIODevice *output) const
 {
-    Q_ASSERT(secret.size() == 16);
-
-    for (QList<ContactUser*>::ConstIterator it = pContacts.begin(); it != pContacts.end(); ++it)
+    int count = 0;
+    foreach (ContactUser *user, pContacts)
     {
-        if ((*it)->readSetting("localSecret") == secret)
-            return *it;
+        QString nickname = user->nickname();
+        nickname.replace(QLatin1Char('\n'), QLatin1Char(' '));
+
+        QByteArray line = user->contactID().toLatin1() + ' ' + nickname.toUtf8() + '\n';
+        if (output->write(line) != line.size())
+            return -1;
+        count++;
     }
 
-    return 0;
+    return count;
 }
 
-ContactUser *ContactsManager::lookupHostname(const QString &hostname) const
+void ContactsManager::contactDeleted(ContactUser *user)
+{
+    pContacts.removeOne(user);
+    unindexContact(user);
+}
+
+QString ContactsManager::normalizedHostname(const QString &hostname)
 {
     QString ohost = ContactIDValidator::hostnameFromID(hostname);
     if (ohost.isNull())
-        ohost = hostname;
+        ohost = hostname.toLower();
 
     if (!ohost.endsWith(QLatin1String(".onion")))
         ohost.append(QLatin1String(".onion"));
 
-    for (QList<ContactUser*>::ConstIterator it = pContacts.begin(); it != pContacts.end(); ++it)
-    {
-        if (ohost.compare((*it)->hostname(), Qt::CaseInsensitive) == 0)
-            return *it;
-    }
+    return ohost;
+}
 
-    return 0;
+void ContactsManager::indexContact(ContactUser *user)
+{
+    m_idIndex.insert(user->uniqueID, user);
+    updateNicknameIndex(user, QString(), user->nickname());
+    updateHostnameIndex(user, QString(), user->hostname());
+    updateSecretIndex(user, QByteArray(), user->localSecret());
 }
 
-ContactUser *ContactsManager::lookupNickname(const QString &nickname) const
+void ContactsManager::unindexContact(ContactUser *user)
 {
-    for (QList<ContactUser*>::ConstIterator it = pContacts.begin(); it != pContacts.end(); ++it)
-    {
-        if (QString::compare(nickname, (*it)->nickname(), Qt::CaseInsensitive) == 0)
-            return *it;
+    if (m_idIndex.value(user->uniqueID) == user)
+        m_idIndex.remove(user->uniqueID);
+    updateNicknameIndex(user, user->nickname(), QString());
+    updateHostnameIndex(user, user->hostname(), QString());
+    updateSecretIndex(user, user->localSecret(), QByteArray());
+}
+
+void ContactsManager::updateHostnameIndex(ContactUser *user, const QString &oldHostname, const QString &newHostname)
+{
+    if (!oldHostname.isEmpty())
+        m_hostnameIndex.remove(normalizedHostname(oldHostname), user);
+
+    if (!newHostname.isEmpty()) {
+        QString key = normalizedHostname(newHostname);
+        if (!m_hostnameIndex.contains(key, user))
+            m_hostnameIndex.insert(key, user);
     }
+}
+
+void ContactsManager::updateNicknameIndex(ContactUser *user, const QString &oldNickname, const QString &newNickname)
+{
+    if (!oldNickname.isEmpty())
+        m_nicknameIndex.remove(oldNickname.toCaseFolded(), user);
 
-    return 0;
+    if (!newNickname.isEmpty()) {
+        QString key = newNickname.toCaseFolded();
+        if (!m_nicknameIndex.contains(key, user))
+            m_nicknameIndex.insert(key, user);
+    }
 }
 
-ContactUser *ContactsManager::lookupUniqueID(int uniqueID) const
+QByteArray ContactsManager::secretIndexKey(const QByteArray &secret) const
 {
-    for (QList<ContactUser*>::ConstIterator it = pContacts.begin(); it != pContacts.end(); ++it)
-    {
-        if ((*it)->uniqueID == uniqueID)
-            return *it;
+    return QMessageAuthenticationCode::hash(secret, m_secretIndexKey, QCryptographicHash::Sha256).left(16);
+}
+
+void ContactsManager::updateSecretIndex(ContactUser *user, const QByteArray &oldSecret, const QByteArray &newSecret)
+{
+    if (!oldSecret.isEmpty()) {
+        QHash<QByteArray,ContactUser*>::Iterator it = m_secretIndex.find(secretIndexKey(oldSecret));
+        if (it != m_secretIndex.end() && *it == user)
+            m_secretIndex.erase(it);
     }
 
-    return 0;
+    if (!newSecret.isEmpty())
+        m_secretIndex.insert(secretIndexKey(newSecret), user);
 }
 
+ContactUser *ContactsManager::lookupSecret(const QByteArray &secret) const
+{
+    Q_ASSERT(secret.size() == 16);
+
+    ContactUser *user = m_secretIndex.value(secretIndexKey(secret));
+    if (!user || !secureCompare(user->localSecret(), secret))
+        return 0;
+
+    return user;
+}
+
+ContactUser *ContactsManager::lookupHostname(const QString &hostname) const
+{
+    return m_hostnameIndex.value(normalizedHostname(hostname));
+}
+
+ContactUser *ContactsManager::lookupNickname(const QString &nickname) const
+{
+    return m_nicknameIndex.value(nickname.toCaseFolded());
+}
+
+ContactUser *ContactsManager::lookupUniqueID(int uniqueID) const
+{
+    return m_idIndex.value(uniqueID);
+}
@@ -35,12 +35,15 @@
 
 #include <QObject>
 #include <QList>
+#include <QHash>
 #include "ContactUser.h"
 #include "IncomingRequestManager.h"
+#include "OutgoingContactRequest.h"
 
 class OutgoingContactRequest;
 class UserIdentity;
 class IncomingRequestManager;
+class QIODevice;
 
 class ContactsManager : public QObject
 {
@@ -50,6 +53,7 @@ class ContactsManager : public QObject
     Q_PROPERTY(IncomingRequestManager* incomingRequests READ incomingRequestManager CONSTANT)
 
     friend class OutgoingContactRequest;
+    friend class ContactUser;
 
 public:
     UserIdentity * const identity;
@@ -73,6 +77,25 @@ public:
     /* addContact will add the contact, but does not create a request. Use createContactRequest */
     ContactUser *addContact(const QString &nickname);
 
+    struct ImportResult
+    {
+        int added;
+        int duplicates;
+        int invalid;
+        /* False if writing the batch to disk failed; it's retried until it succeeds */
+        bool saved;
+    };
+
+    /* Creates contact requests for a list of contact IDs, one per line, each optionally
+     * followed by whitespace and a nickname. Blank lines and lines beginning with # are
+     * skipped. IDs may also be given as onion hostnames. Contacts are written to the
+     * database in one batch, and their requests are started gradually. A contact without
+     * a nickname, or with one already in use, is named by its ID. */
+    ImportResult importContacts(QIODevice *input, const QString &myNickname, const QString &message);
+    /* Writes each contact's ID and nickname as a line, as read by importContacts.
+     * Returns the number of contacts written, or -1 on error. */
+    int exportContacts(QIODevice *output) const;
+
     static QString hostnameFromID(const QString &ID);
 
     void loadFromSettings();
@@ -92,7 +115,30 @@ private:
     QList<ContactUser*> pContacts;
     int highestID;
 
+    /* Lookup indexes, kept current by ContactUser when the keys change.
+     * Hostnames are lowercase in .onion format, and nicknames are case folded. */
+    QHash<int,ContactUser*> m_idIndex;
+    QMultiHash<QString,ContactUser*> m_hostnameIndex;
+    QMultiHash<QString,ContactUser*> m_nicknameIndex;
+
+    /* Keyed by an HMAC of the local secret, with a random key per session; the
+     * index never holds secrets directly, and its layout reveals nothing about them. */
+    QByteArray m_secretIndexKey;
+    QHash<QByteArray,ContactUser*> m_secretIndex;
+
     void connectSignals(ContactUser *user);
+    ContactUser *addContactRequest(const QString &hostname, const QString &nickname,
+                                   const QString &myNickname, const QString &message,
+                                   OutgoingContactRequest::Priority priority);
+
+    static QString normalizedHostname(const QString &hostname);
+    void indexContact(ContactUser *user);
+    void unindexContact(ContactUser *user);
+    void updateHostnameIndex(ContactUser *user, const QString &oldHostname, const QString &newHostname);
+    void updateNicknameIndex(ContactUser *user, const QString &oldNickname, const QString &newNickname);
+
+    QByteArray secretIndexKey(const QByteArray &secret) const;
+    void updateSecretIndex(ContactUser *user, const QByteArray &oldSecret, const QByteArray &newSecret);
 };
 
 #endif // CONTACTSMANAGER_H
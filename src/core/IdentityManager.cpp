@@ -68,18 +68,10 @@ void IdentityManager::addIdentity(UserIdentity *identity)
 
 void IdentityManager::loadFromSettings()
 {
-    config->beginGroup(QLatin1String("identity"));
-    QStringList sections = config->childGroups();
-    config->endGroup();
-
-    for (QStringList::Iterator it = sections.begin(); it != sections.end(); ++it)
+    QList<int> records = database->records(StateDatabase::IdentityRecord);
+    for (QList<int>::ConstIterator it = records.begin(); it != records.end(); ++it)
     {
-        bool ok = false;
-        int id = it->toInt(&ok);
-        if (!ok)
-            continue;
-
-        UserIdentity *user = new UserIdentity(id, this);
+        UserIdentity *user = new UserIdentity(database->recordId(*it), this);
         addIdentity(user);
     }
 
@@ -47,16 +47,16 @@ IncomingRequestManager::IncomingRequestManager(ContactsManager *c)
 
 void IncomingRequestManager::loadRequests()
 {
-    config->beginGroup(QLatin1String("contactRequests"));
-    QStringList contacts = config->childGroups();
-    config->endGroup();
+    loadRejectedHosts();
 
-    for (QStringList::ConstIterator it = contacts.begin(); it != contacts.end(); ++it)
+    QList<int> records = database->records(StateDatabase::IncomingRequestRecord, contacts->identity->uniqueID);
+    for (QList<int>::ConstIterator it = records.begin(); it != records.end(); ++it)
     {
-        IncomingContactRequest *request = new IncomingContactRequest(this, it->toLatin1());
-        request->load();
+        IncomingContactRequest *request = new IncomingContactRequest(this, database->hostname(*it));
+        request->load(*it);
 
         m_requests.append(request);
+        m_requestIndex.insert(request->hostname(), request);
         emit requestAdded(request);
     }
 }
@@ -75,11 +75,7 @@ IncomingContactRequest *IncomingRequestManager::requestFromHostname(const QByteA
     Q_ASSERT(!hostname.endsWith(".onion"));
     Q_ASSERT(hostname == hostname.toLower());
 
-    for (QList<IncomingContactRequest*>::ConstIterator it = m_requests.begin(); it != m_requests.end(); ++it)
-        if ((*it)->hostname() == hostname)
-            return *it;
-
-    return 0;
+    return m_requestIndex.value(hostname);
 }
 
 void IncomingRequestManager::addRequest(const QByteArray &hostname, const QByteArray &connSecret, ContactRequestServer *connection,
@@ -143,6 +139,7 @@ void IncomingRequestManager::addRequest(const QByteArray &hostname, const QByteA
     if (newRequest)
     {
         m_requests.append(request);
+        m_requestIndex.insert(request->hostname(), request);
         emit requestAdded(request);
     }
 }
@@ -150,67 +147,117 @@ void IncomingRequestManager::addRequest(const QByteArray &hostname, const QByteA
 void IncomingRequestManager::removeRequest(IncomingContactRequest *request)
 {
     if (m_requests.removeOne(request))
+    {
+        m_requestIndex.remove(request->hostname());
         emit requestRemoved(request);
+    }
 
     request->deleteLater();
 }
 
-void IncomingRequestManager::addRejectedHost(const QByteArray &hostname)
+void IncomingRequestManager::loadRejectedHosts()
+{
+    m_rejectedHosts.clear();
+
+    int owner = contacts->identity->uniqueID;
+    QList<int> records = database->records(StateDatabase::RejectedHostRecord, owner);
+    m_rejectedHosts.reserve(records.size());
+    for (QList<int>::ConstIterator it = records.begin(); it != records.end(); ++it)
+        m_rejectedHosts.insert(database->hostname(*it));
+
+    /* The blacklist used to be kept in the settings, shared by all identities; like
+     * other settings, it moves to the first identity that loads. It's only removed from
+     * the settings once every host is on disk; until then, this is repeated at each start,
+     * and hosts that were already moved are skipped. */
+    QStringList oldHosts = config->value("core/hostnameBlacklist").value<QStringList>();
+    if (!oldHosts.isEmpty())
+    {
+        bool ok = true;
+        foreach (const QString &host, oldHosts)
+            ok &= addRejectedHost(host.toLatin1());
+
+        if (ok && database->sync())
+            config->remove("core/hostnameBlacklist");
+        else
+            qWarning() << "Failed to move the hostname blacklist to the database; keeping it in the settings";
+    }
+}
+
+bool IncomingRequestManager::addRejectedHost(const QByteArray &hostname)
 {
-    QStringList hosts = rejectedHosts();
-    hosts.append(QString::fromLatin1(hostname));
-    config->setValue("core/hostnameBlacklist", QVariant::fromValue(hosts));
+    if (m_rejectedHosts.contains(hostname))
+        return true;
+
+    m_rejectedHosts.insert(hostname);
+
+    int record = database->createRecord(StateDatabase::RejectedHostRecord, 0, contacts->identity->uniqueID);
+    if (record < 0 || !database->setHostname(record, hostname))
+    {
+        qWarning() << "Failed to save rejected host" << hostname;
+        if (record >= 0)
+            database->removeRecord(record);
+        return false;
+    }
+
+    return true;
 }
 
 bool IncomingRequestManager::isHostnameRejected(const QByteArray &hostname) const
 {
-    return rejectedHosts().contains(QString::fromLatin1(hostname));
+    return m_rejectedHosts.contains(hostname);
 }
 
 QStringList IncomingRequestManager::rejectedHosts() const
 {
-    return config->value("core/hostnameBlacklist").value<QStringList>();
+    QStringList re;
+    re.reserve(m_rejectedHosts.size());
+    foreach (const QByteArray &host, m_rejectedHosts)
+        re.append(QString::fromLatin1(host));
+    return re;
 }
 
 IncomingContactRequest::IncomingContactRequest(IncomingRequestManager *m, const QByteArray &h,
                                                     ContactRequestServer *c)
-    : QObject(m), manager(m), connection(c), m_hostname(h)
+    : QObject(m), manager(m), connection(c), m_record(-1), m_hostname(h)
 {
     Q_ASSERT(manager);
-    Q_ASSERT(m_hostname.size() == 16);
+    Q_ASSERT(m_hostname.size() == 16 || m_hostname.size() == 56);
 
     qDebug() << "Created contact request from" << m_hostname << (connection ? "with" : "without") << "connection";
 }
 
-void IncomingContactRequest::load()
+void IncomingContactRequest::load(int record)
 {
-    config->beginGroup(QLatin1String("contactRequests/") + QString::fromLatin1(m_hostname));
-
-    setRemoteSecret(config->value(QLatin1String("remoteSecret")).toByteArray());
-    setNickname(config->value(QLatin1String("nickname")).toString());
-    setMessage(config->value(QLatin1String("message")).toString());
+    m_record = record;
 
-    m_requestDate = config->value(QLatin1String("requestDate")).toDateTime();
-    m_lastRequestDate = config->value(QLatin1String("lastRequestDate")).toDateTime();
+    setRemoteSecret(database->remoteSecret(m_record));
+    setNickname(database->nickname(m_record));
+    setMessage(database->properties(m_record).value(QLatin1String("message")).toString());
 
-    config->endGroup();
+    m_requestDate = database->time(m_record, StateDatabase::CreatedTime);
+    m_lastRequestDate = database->time(m_record, StateDatabase::LastActiveTime);
 }
 
 void IncomingContactRequest::save()
 {
-    config->beginGroup(QLatin1String("contactRequests/") + QString::fromLatin1(m_hostname));
+    if (m_record < 0) {
+        m_record = database->createRecord(StateDatabase::IncomingRequestRecord, 0,
+                                          manager->contacts->identity->uniqueID);
+        database->setHostname(m_record, m_hostname);
+    }
+
+    database->setRemoteSecret(m_record, remoteSecret());
+    database->setNickname(m_record, nickname());
 
-    config->setValue(QLatin1String("remoteSecret"), remoteSecret());
-    config->setValue(QLatin1String("nickname"), nickname());
-    config->setValue(QLatin1String("message"), message());
+    QVariantMap properties;
+    properties.insert(QLatin1String("message"), message());
+    database->setProperties(m_record, properties);
 
     if (m_requestDate.isNull())
         m_requestDate = m_lastRequestDate = QDateTime::currentDateTime();
 
-    config->setValue(QLatin1String("requestDate"), m_requestDate);
-    config->setValue(QLatin1String("lastRequestDate"), m_lastRequestDate);
-
-    config->endGroup();
+    database->setTime(m_record, StateDatabase::CreatedTime, m_requestDate);
+    database->setTime(m_record, StateDatabase::LastActiveTime, m_lastRequestDate);
 }
 
 void IncomingContactRequest::renew()
@@ -220,10 +267,11 @@ void IncomingContactRequest::renew()
 
 void IncomingContactRequest::removeRequest()
 {
-    /* Remove from config */
-    config->beginGroup(QLatin1String("contactRequests/") + QString::fromLatin1(m_hostname));
-    config->remove("");
-    config->endGroup();
+    if (m_record < 0)
+        return;
+
+    database->removeRecord(m_record);
+    m_record = -1;
 }
 
 void IncomingContactRequest::setRemoteSecret(const QByteArray &remoteSecret)
@@ -269,7 +317,7 @@ void IncomingContactRequest::accept(ContactUser *user)
         user->setHostname(QString::fromLatin1(m_hostname));
     }
 
-    user->writeSetting("remoteSecret", remoteSecret());
+    user->setRemoteSecret(remoteSecret());
 
     /* If there is a connection, send the accept message and morph it to a primary connection */
     if (connection)
@@ -36,6 +36,8 @@
 #include <QObject>
 #include <QPointer>
 #include <QDateTime>
+#include <QHash>
+#include <QSet>
 #include "protocol/ContactRequestServer.h"
 
 class IncomingRequestManager;
@@ -78,7 +80,7 @@ public:
 
     void renew();
 
-    void load();
+    void load(int record);
     void save();
 
 public slots:
@@ -91,6 +93,8 @@ signals:
 
 private:
     QPointer<ContactRequestServer> connection;
+    /* Index in the StateDatabase, or -1 if not yet saved */
+    int m_record;
     QByteArray m_hostname;
     QByteArray m_remoteSecret;
     QString m_message, m_nickname;
@@ -123,8 +127,10 @@ public:
     void addRequest(const QByteArray &hostname, const QByteArray &connSecret, ContactRequestServer *connection,
                     const QString &nickname, const QString &message);
 
-    /* Blacklist a host for immediate rejection in the future */
-    void addRejectedHost(const QByteArray &hostname);
+    /* Blacklist a host for immediate rejection in the future. Each host is saved as
+     * its own database record, so the list is never rewritten. Returns false if it
+     * couldn't be saved; it's rejected until exit regardless. */
+    bool addRejectedHost(const QByteArray &hostname);
     bool isHostnameRejected(const QByteArray &hostname) const;
 
     QStringList rejectedHosts() const;
@@ -136,7 +142,11 @@ signals:
 
 private:
     QList<IncomingContactRequest*> m_requests;
+    /* m_requests by hostname */
+    QHash<QByteArray,IncomingContactRequest*> m_requestIndex;
+    QSet<QByteArray> m_rejectedHosts;
 
+    void loadRejectedHosts();
     void removeRequest(IncomingContactRequest *request);
 };
 
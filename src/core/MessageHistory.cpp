@@ -0,0 +1,844 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "MessageHistory.h"
+#include "MessageSearchIndex.h"
+#include <QDir>
+#include <QtConcurrentRun>
+#include <QStringList>
+#include <QtEndian>
+#include <QDebug>
+#include <string.h>
+#include <algorithm>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/* Each segment is a pair of files named by the segment's first sequence number,
+ * as 16 hexadecimal digits.
+ *
+ * <sequence>.log begins with a 16 byte header of "TSHL", quint32 version, and
+ * quint64 first sequence, followed by records:
+ *     0   quint32  record size, including this header
+ *     4   quint16  checksum of bytes 8 to the end
+ *     6   quint8   status (MessageHistory::Status), updated in place
+ *     7   quint8   reserved
+ *     8   quint64  sequence
+ *     16  qint64   message time, in milliseconds since the epoch
+ *     24  qint64   time the message was logged
+ *     32  quint16  protocol message identifier
+ *     34  quint16  reserved
+ *     36  UTF-8 text
+ *
+ * <sequence>.idx has the same header with "TSHI", followed by an entry for every
+ * IndexInterval'th record of the segment:
+ *     0   quint64  sequence
+ *     8   qint64   time logged
+ *     16  quint32  offset of the record in the log
+ *     20  quint32  reserved
+ *
+ * A record that fails validation ends the log; a torn write at the end of the
+ * last segment is truncated when opening. All integers are little-endian. */
+
+static const char logMagic[] = "TSHL";
+static const char indexMagic[] = "TSHI";
+static const quint32 historyVersion = 1;
+static const int FileHeaderSize = 16;
+static const int RecordHeaderSize = 36;
+static const int IndexEntrySize = 24;
+static const int StatusOffset = 6;
+static const quint32 MaxRecordSize = 1024 * 1024;
+static const qint64 MaxSegmentSize = 4 * 1024 * 1024;
+static const int IndexInterval = 64;
+
+static QString segmentFile(const QString &directory, quint64 firstSequence, const char *suffix)
+{
+    return directory + QLatin1Char('/') + QString::number(firstSequence, 16).rightJustified(16, QLatin1Char('0'))
+           + QLatin1String(suffix);
+}
+
+static QByteArray fileHeader(const char *magic, quint64 firstSequence)
+{
+    QByteArray header(FileHeaderSize, 0);
+    uchar *h = reinterpret_cast<uchar*>(header.data());
+    memcpy(h, magic, 4);
+    qToLittleEndian<quint32>(historyVersion, h + 4);
+    qToLittleEndian<quint64>(firstSequence, h + 8);
+    return header;
+}
+
+static bool checkFileHeader(QFile &file, const char *magic, quint64 firstSequence)
+{
+    QByteArray header = file.read(FileHeaderSize);
+    if (header.size() != FileHeaderSize)
+        return false;
+
+    const uchar *h = reinterpret_cast<const uchar*>(header.constData());
+    return memcmp(h, magic, 4) == 0 && qFromLittleEndian<quint32>(h + 4) <= historyVersion
+        && qFromLittleEndian<quint64>(h + 8) == firstSequence;
+}
+
+static QByteArray indexEntry(quint64 sequence, qint64 time, quint32 offset)
+{
+    QByteArray entry(IndexEntrySize, 0);
+    uchar *e = reinterpret_cast<uchar*>(entry.data());
+    qToLittleEndian<quint64>(sequence, e);
+    qToLittleEndian<qint64>(time, e + 8);
+    qToLittleEndian<quint32>(offset, e + 16);
+    return entry;
+}
+
+/* Reads the record at the current position of file, returning false if there isn't a valid one */
+static bool readRecord(QFile &file, MessageHistory::Message *message, qint64 *loggedTime, qint64 *size)
+{
+    QByteArray record = file.read(RecordHeaderSize);
+    if (record.size() != RecordHeaderSize)
+        return false;
+
+    quint32 recordSize = qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(record.constData()));
+    if (recordSize < quint32(RecordHeaderSize) || recordSize > MaxRecordSize)
+        return false;
+
+    record.append(file.read(recordSize - RecordHeaderSize));
+    if (record.size() != int(recordSize))
+        return false;
+
+    const uchar *r = reinterpret_cast<const uchar*>(record.constData());
+    if (qChecksum(record.constData() + 8, recordSize - 8) != qFromLittleEndian<quint16>(r + 4))
+        return false;
+
+    message->status = MessageHistory::Status(qMin(int(r[StatusOffset]), int(MessageHistory::Error)));
+    message->sequence = qFromLittleEndian<quint64>(r + 8);
+    message->time = QDateTime::fromMSecsSinceEpoch(qFromLittleEndian<qint64>(r + 16));
+    message->identifier = qFromLittleEndian<quint16>(r + 32);
+    message->text = QString::fromUtf8(record.constData() + RecordHeaderSize, recordSize - RecordHeaderSize);
+    *loggedTime = qFromLittleEndian<qint64>(r + 24);
+    *size = recordSize;
+    return true;
+}
+
+/* Reads records from offset, which must hold sequence, until the end of valid data. Returns
+ * the offset of the end, and the next sequence in *endSequence. Index entries that belong
+ * after afterSequence are added to *entries. */
+static qint64 scanRecords(QFile &file, qint64 offset, quint64 sequence, quint64 firstSequence,
+                          quint64 afterSequence, QVector<QByteArray> *entries, quint64 *endSequence)
+{
+    file.seek(offset);
+
+    MessageHistory::Message message;
+    qint64 loggedTime, size;
+    while (readRecord(file, &message, &loggedTime, &size) && message.sequence == sequence) {
+        if ((sequence - firstSequence) % IndexInterval == 0 && (sequence > afterSequence || afterSequence == quint64(-1)))
+            entries->append(indexEntry(sequence, loggedTime, quint32(offset)));
+        offset += size;
+        sequence++;
+    }
+
+    *endSequence = sequence;
+    return offset;
+}
+
+static void syncFile(QFile &file)
+{
+    if (!file.isOpen())
+        return;
+    file.flush();
+#ifdef Q_OS_WIN
+    _commit(file.handle());
+#else
+    fsync(file.handle());
+#endif
+}
+
+MessageHistory::MessageHistory(const QString &directory, QObject *parent)
+    : QObject(parent), m_directory(directory), m_writerSize(0), m_nextSequence(0), m_search(0), m_searchLoader(0)
+{
+    m_writeTimer.setSingleShot(true);
+    m_writeTimer.setInterval(0);
+    connect(&m_writeTimer, SIGNAL(timeout()), SLOT(writeBuffered()));
+
+    m_syncTimer.setSingleShot(true);
+    m_syncTimer.setInterval(500);
+    connect(&m_syncTimer, SIGNAL(timeout()), SLOT(sync()));
+}
+
+MessageHistory::~MessageHistory()
+{
+    close();
+}
+
+QString MessageHistory::segmentPath(quint64 firstSequence, const char *suffix) const
+{
+    return segmentFile(m_directory, firstSequence, suffix);
+}
+
+bool MessageHistory::open()
+{
+    close();
+
+    QDir dir(m_directory);
+    if (!dir.exists() && !dir.mkpath(QStringLiteral("."))) {
+        qWarning() << "MessageHistory: Cannot create directory" << m_directory;
+        return false;
+    }
+
+    /* Names are fixed-width hexadecimal, so they sort in sequence order */
+    QStringList files = dir.entryList(QStringList() << QStringLiteral("*.log"), QDir::Files, QDir::Name);
+    foreach (const QString &file, files) {
+        bool ok = false;
+        quint64 firstSequence = file.left(16).toULongLong(&ok, 16);
+        if (!ok || file.size() != 20)
+            continue;
+
+        Segment segment = { firstSequence, false, QVector<IndexEntry>() };
+        m_segments.append(segment);
+    }
+
+    if (m_segments.isEmpty()) {
+        if (!startSegment(0))
+            return false;
+    } else if (!recoverTail(m_segments.last()) || !openWriter()) {
+        return false;
+    }
+
+    return true;
+}
+
+/* Loads the search index, and indexes the messages up to endSequence that it's missing.
+ * Runs on a worker thread; meanwhile, the log is only appended to after endSequence. */
+static MessageSearchIndex *loadSearchIndex(const QString &directory, const QList<quint64> &segments,
+                                           quint64 endSequence)
+{
+    MessageSearchIndex *search = new MessageSearchIndex(directory + QLatin1String("/search.idx"));
+    if (!search->open(segments.first(), endSequence)) {
+        delete search;
+        return 0;
+    }
+
+    quint64 sequence = qMax(search->nextSequence(), segments.first());
+    if (sequence < endSequence)
+        qDebug() << "MessageHistory: Indexing" << (endSequence - sequence) << "messages for search in" << directory;
+
+    int s = segments.size() - 1;
+    while (s > 0 && segments[s] > sequence)
+        s--;
+
+    for (; s < segments.size() && sequence < endSequence; s++) {
+        QFile log(segmentFile(directory, segments[s], ".log"));
+        if (!log.open(QIODevice::ReadOnly) || !checkFileHeader(log, logMagic, segments[s]))
+            break;
+
+        MessageHistory::Message message;
+        qint64 loggedTime, size;
+        while (sequence < endSequence && readRecord(log, &message, &loggedTime, &size)) {
+            if (message.sequence < sequence)
+                continue;
+            search->add(message.sequence, message.text);
+            sequence = message.sequence + 1;
+        }
+    }
+
+    search->writeBuffered();
+    return search;
+}
+
+void MessageHistory::searchIndexLoaded()
+{
+    MessageSearchIndex *search = m_searchLoader->result();
+    m_searchLoader->deleteLater();
+    m_searchLoader = 0;
+    if (!search)
+        return;
+
+    /* Messages appended while it was loading are read back from the log */
+    m_search = search;
+    quint64 sequence = qMax(m_search->nextSequence(), firstSequence());
+    while (sequence < m_nextSequence) {
+        QList<Message> messages = read(sequence, int(qMin(m_nextSequence - sequence, quint64(256))));
+        if (messages.isEmpty())
+            break;
+        foreach (const Message &message, messages)
+            m_search->add(message.sequence, message.text);
+        sequence = messages.last().sequence + 1;
+    }
+    m_search->writeBuffered();
+
+    emit searchReady();
+}
+
+void MessageHistory::close()
+{
+    if (m_searchLoader) {
+        /* It reads the files that are closed or removed after this */
+        m_searchLoader->waitForFinished();
+        delete m_searchLoader->result();
+        delete m_searchLoader;
+        m_searchLoader = 0;
+    }
+
+    if (isOpen()) {
+        if (!writeBuffered())
+            qWarning() << "MessageHistory: Discarding" << m_writeBuffer.size() << "bytes of messages that couldn't be written";
+        sync();
+    }
+
+    m_writeTimer.stop();
+    m_syncTimer.stop();
+    m_writer.close();
+    m_indexWriter.close();
+    delete m_search;
+    m_search = 0;
+    m_segments.clear();
+    m_offsets.clear();
+    m_writeBuffer.clear();
+    m_indexBuffer.clear();
+    m_writerSize = 0;
+    m_nextSequence = 0;
+}
+
+void MessageHistory::removeAll()
+{
+    close();
+    if (!QDir(m_directory).removeRecursively())
+        qWarning() << "MessageHistory: Cannot remove" << m_directory;
+}
+
+quint64 MessageHistory::firstSequence() const
+{
+    return m_segments.isEmpty() ? 0 : m_segments.first().firstSequence;
+}
+
+int MessageHistory::segmentFor(quint64 sequence) const
+{
+    int lo = 0, hi = m_segments.size() - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (m_segments[mid].firstSequence <= sequence)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/* Reads the index of a segment, or rebuilds it from the log if it's missing or damaged */
+bool MessageHistory::loadIndex(int s)
+{
+    Segment &segment = m_segments[s];
+    if (segment.indexLoaded)
+        return true;
+
+    QFile log(segmentPath(segment.firstSequence, ".log"));
+    if (!log.open(QIODevice::ReadOnly) || !checkFileHeader(log, logMagic, segment.firstSequence)) {
+        qWarning() << "MessageHistory: Cannot read" << log.fileName();
+        return false;
+    }
+
+    segment.index.clear();
+
+    QFile index(segmentPath(segment.firstSequence, ".idx"));
+    bool valid = index.open(QIODevice::ReadOnly) && checkFileHeader(index, indexMagic, segment.firstSequence);
+    if (valid) {
+        QByteArray data = index.readAll();
+        for (int i = 0; i + IndexEntrySize <= data.size(); i += IndexEntrySize) {
+            const uchar *e = reinterpret_cast<const uchar*>(data.constData()) + i;
+            IndexEntry entry = { qFromLittleEndian<quint64>(e), qFromLittleEndian<qint64>(e + 8),
+                                 qFromLittleEndian<quint32>(e + 16) };
+            if (entry.offset < quint32(FileHeaderSize) || entry.offset >= log.size() ||
+                entry.sequence != segment.firstSequence + quint64(segment.index.size()) * IndexInterval)
+            {
+                break;
+            }
+            segment.index.append(entry);
+        }
+        index.close();
+    }
+
+    if (!valid && s < m_segments.size() - 1) {
+        qWarning() << "MessageHistory: Rebuilding index for" << log.fileName();
+
+        QVector<QByteArray> entries;
+        quint64 endSequence;
+        scanRecords(log, FileHeaderSize, segment.firstSequence, segment.firstSequence, quint64(-1), &entries,
+                    &endSequence);
+
+        if (index.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            index.write(fileHeader(indexMagic, segment.firstSequence));
+            foreach (const QByteArray &entry, entries)
+                index.write(entry);
+        }
+
+        foreach (const QByteArray &data, entries) {
+            const uchar *e = reinterpret_cast<const uchar*>(data.constData());
+            IndexEntry entry = { qFromLittleEndian<quint64>(e), qFromLittleEndian<qint64>(e + 8),
+                                 qFromLittleEndian<quint32>(e + 16) };
+            segment.index.append(entry);
+        }
+    }
+
+    segment.indexLoaded = true;
+    return true;
+}
+
+/* Finds the end of the last segment, truncating any incomplete record and completing its index */
+bool MessageHistory::recoverTail(Segment &segment)
+{
+    if (!loadIndex(m_segments.size() - 1))
+        return false;
+
+    QFile log(segmentPath(segment.firstSequence, ".log"));
+    if (!log.open(QIODevice::ReadWrite))
+        return false;
+
+    qint64 offset = FileHeaderSize;
+    quint64 sequence = segment.firstSequence;
+    quint64 lastIndexed = quint64(-1);
+    if (!segment.index.isEmpty()) {
+        offset = segment.index.last().offset;
+        sequence = segment.index.last().sequence;
+        lastIndexed = sequence;
+    }
+
+    QVector<QByteArray> entries;
+    qint64 end = scanRecords(log, offset, sequence, segment.firstSequence, lastIndexed, &entries, &m_nextSequence);
+
+    if (end < log.size()) {
+        qWarning() << "MessageHistory: Discarding" << (log.size() - end) << "bytes of incomplete data from"
+                   << log.fileName();
+        log.resize(end);
+    }
+    m_writerSize = end;
+
+    /* Index entries may be missing if the log was written but the index wasn't. Rewrite
+     * the index with the entries that were valid and any that were missing. */
+    foreach (const QByteArray &data, entries) {
+        const uchar *e = reinterpret_cast<const uchar*>(data.constData());
+        IndexEntry entry = { qFromLittleEndian<quint64>(e), qFromLittleEndian<qint64>(e + 8),
+                             qFromLittleEndian<quint32>(e + 16) };
+        segment.index.append(entry);
+    }
+
+    QFile index(segmentPath(segment.firstSequence, ".idx"));
+    if (!index.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    QByteArray data = fileHeader(indexMagic, segment.firstSequence);
+    foreach (const IndexEntry &entry, segment.index)
+        data.append(indexEntry(entry.sequence, entry.time, entry.offset));
+
+    return index.write(data) == data.size();
+}
+
+bool MessageHistory::openWriter()
+{
+    const Segment &segment = m_segments.last();
+
+    m_writer.setFileName(segmentPath(segment.firstSequence, ".log"));
+    m_indexWriter.setFileName(segmentPath(segment.firstSequence, ".idx"));
+    if (!m_writer.open(QIODevice::ReadWrite) || !m_indexWriter.open(QIODevice::ReadWrite)) {
+        qWarning() << "MessageHistory: Cannot open" << m_writer.fileName() << "for writing";
+        m_writer.close();
+        m_indexWriter.close();
+        return false;
+    }
+
+    return true;
+}
+
+/* Creates a segment and moves the writer to it. If that fails, the current segment,
+ * if any, stays open for writing. */
+bool MessageHistory::startSegment(quint64 firstSequence)
+{
+    bool wasOpen = isOpen();
+    if (wasOpen) {
+        /* Buffered records have offsets in the current segment */
+        if (!writeBuffered())
+            return false;
+        sync();
+    }
+
+    QFile log(segmentPath(firstSequence, ".log"));
+    QFile index(segmentPath(firstSequence, ".idx"));
+    if (!log.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+        !index.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+        log.write(fileHeader(logMagic, firstSequence)) != FileHeaderSize ||
+        index.write(fileHeader(indexMagic, firstSequence)) != FileHeaderSize ||
+        !log.flush() || !index.flush())
+    {
+        qWarning() << "MessageHistory: Cannot create" << log.fileName();
+        log.remove();
+        index.remove();
+        return false;
+    }
+    log.close();
+    index.close();
+
+    m_writer.close();
+    m_indexWriter.close();
+
+    Segment segment = { firstSequence, true, QVector<IndexEntry>() };
+    m_segments.append(segment);
+    if (!openWriter()) {
+        m_segments.removeLast();
+        log.remove();
+        index.remove();
+        if (wasOpen)
+            openWriter();
+        return false;
+    }
+
+    m_writerSize = FileHeaderSize;
+    m_nextSequence = firstSequence;
+    return true;
+}
+
+quint64 MessageHistory::append(const Message &message)
+{
+    Q_ASSERT(isOpen());
+
+    quint64 sequence = m_nextSequence;
+    QByteArray text = message.text.toUtf8();
+    qint64 loggedTime = QDateTime::currentMSecsSinceEpoch();
+
+    QByteArray record(RecordHeaderSize, 0);
+    uchar *r = reinterpret_cast<uchar*>(record.data());
+    qToLittleEndian<quint32>(quint32(RecordHeaderSize + text.size()), r);
+    r[StatusOffset] = quint8(message.status);
+    qToLittleEndian<quint64>(sequence, r + 8);
+    qToLittleEndian<qint64>(message.time.toMSecsSinceEpoch(), r + 16);
+    qToLittleEndian<qint64>(loggedTime, r + 24);
+    qToLittleEndian<quint16>(message.identifier, r + 32);
+    record.append(text);
+    qToLittleEndian<quint16>(qChecksum(record.constData() + 8, record.size() - 8),
+                             reinterpret_cast<uchar*>(record.data()) + 4);
+
+    if (m_writerSize + m_writeBuffer.size() + record.size() > MaxSegmentSize &&
+        sequence > m_segments.last().firstSequence && !startSegment(sequence))
+    {
+        /* Tried again at the next append; until then, the current segment grows past the limit */
+        qWarning() << "MessageHistory: Cannot start a new segment; continuing" << m_writer.fileName();
+    }
+
+    Segment &segment = m_segments.last();
+    qint64 offset = m_writerSize + m_writeBuffer.size();
+    if ((sequence - segment.firstSequence) % IndexInterval == 0) {
+        IndexEntry entry = { sequence, loggedTime, quint32(offset) };
+        segment.index.append(entry);
+        m_indexBuffer.append(indexEntry(sequence, loggedTime, quint32(offset)));
+    }
+
+    m_writeBuffer.append(record);
+    if (m_search)
+        m_search->add(sequence, message.text);
+    if (message.status == Sending)
+        m_offsets.insert(sequence, qMakePair(segment.firstSequence, offset));
+    m_nextSequence++;
+
+    if (!m_writeTimer.isActive())
+        m_writeTimer.start();
+    return sequence;
+}
+
+void MessageHistory::setStatus(quint64 sequence, Status status)
+{
+    QHash<quint64,QPair<quint64,qint64> >::Iterator it = m_offsets.find(sequence);
+    if (it == m_offsets.end())
+        return;
+
+    quint64 firstSequence = it->first;
+    qint64 offset = it->second + StatusOffset;
+    if (status != Sending)
+        m_offsets.erase(it);
+
+    if (!isOpen())
+        return;
+
+    if (firstSequence == m_segments.last().firstSequence) {
+        if (offset >= m_writerSize) {
+            m_writeBuffer[int(offset - m_writerSize)] = char(status);
+            return;
+        }
+
+        m_writer.seek(offset);
+        m_writer.putChar(char(status));
+        m_writer.flush();
+        if (!m_syncTimer.isActive())
+            m_syncTimer.start();
+    } else {
+        QFile log(segmentPath(firstSequence, ".log"));
+        if (log.open(QIODevice::ReadWrite) && log.seek(offset))
+            log.putChar(char(status));
+    }
+}
+
+bool MessageHistory::writeBuffered()
+{
+    m_writeTimer.stop();
+
+    bool ok = true;
+    if (!m_writeBuffer.isEmpty()) {
+        if (!m_writer.seek(m_writerSize) || m_writer.write(m_writeBuffer) != m_writeBuffer.size() ||
+            !m_writer.flush())
+        {
+            qWarning() << "MessageHistory: Writing" << m_writer.fileName() << "failed:" << m_writer.errorString();
+            /* Drop anything partially written, and keep the records to write at the same offset again */
+            m_writer.resize(m_writerSize);
+            ok = false;
+        } else {
+            m_writerSize += m_writeBuffer.size();
+            m_writeBuffer.clear();
+        }
+    }
+
+    /* The index is written after the log, so it never refers to records that aren't there */
+    if (ok && !m_indexBuffer.isEmpty()) {
+        m_indexWriter.seek(m_indexWriter.size());
+        m_indexWriter.write(m_indexBuffer);
+        m_indexWriter.flush();
+        m_indexBuffer.clear();
+    }
+
+    if (m_search)
+        m_search->writeBuffered();
+
+    if (!m_syncTimer.isActive())
+        m_syncTimer.start();
+    return ok;
+}
+
+void MessageHistory::sync()
+{
+    m_syncTimer.stop();
+    /* Records from a failed write are retried until they're written */
+    if (!m_writeBuffer.isEmpty() && !writeBuffered())
+        return;
+    syncFile(m_writer);
+    syncFile(m_indexWriter);
+    if (m_search)
+        m_search->sync();
+}
+
+QList<MessageHistory::Message> MessageHistory::read(quint64 sequence, int count)
+{
+    QList<Message> re;
+    if (!isOpen())
+        return re;
+
+    writeBuffered();
+
+    if (sequence < firstSequence()) {
+        quint64 skip = firstSequence() - sequence;
+        if (skip >= quint64(count))
+            return re;
+        count -= int(skip);
+        sequence = firstSequence();
+    }
+
+    for (int s = segmentFor(sequence); s < m_segments.size() && count > 0 && sequence < m_nextSequence; s++) {
+        if (!loadIndex(s))
+            continue;
+
+        const Segment &segment = m_segments[s];
+        if (sequence < segment.firstSequence)
+            sequence = segment.firstSequence;
+
+        QFile log(segmentPath(segment.firstSequence, ".log"));
+        if (!log.open(QIODevice::ReadOnly) || !log.seek(indexOffset(segment, sequence)))
+            continue;
+
+        Message message;
+        qint64 loggedTime, size;
+        while (count > 0 && readRecord(log, &message, &loggedTime, &size)) {
+            if (message.sequence < sequence)
+                continue;
+            if (message.sequence != sequence)
+                break;
+
+            /* Messages still sending when the history was last closed will never be delivered */
+            if (message.status == Sending && !m_offsets.contains(message.sequence))
+                message.status = Error;
+
+            re.append(message);
+            sequence++;
+            count--;
+        }
+    }
+
+    return re;
+}
+
+QList<MessageHistory::Message> MessageHistory::readSequences(const QVector<quint64> &sequences)
+{
+    QList<Message> re;
+    if (!isOpen() || sequences.isEmpty())
+        return re;
+
+    writeBuffered();
+
+    QVector<quint64> wanted = sequences;
+    std::sort(wanted.begin(), wanted.end());
+    wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+
+    int i = 0;
+    while (i < wanted.size()) {
+        if (wanted[i] < firstSequence() || wanted[i] >= m_nextSequence) {
+            i++;
+            continue;
+        }
+
+        int s = segmentFor(wanted[i]);
+        quint64 segmentEnd = (s + 1 < m_segments.size()) ? m_segments[s + 1].firstSequence : m_nextSequence;
+
+        QFile log(segmentPath(m_segments[s].firstSequence, ".log"));
+        if (loadIndex(s) && log.open(QIODevice::ReadOnly)) {
+            const Segment &segment = m_segments[s];
+            Message message;
+            qint64 loggedTime, size;
+            /* message was read, but is past the sequence it was read for */
+            bool pending = false;
+
+            for (; i < wanted.size() && wanted[i] < segmentEnd; i++) {
+                quint64 sequence = wanted[i];
+                if (!pending || message.sequence < sequence) {
+                    /* Seek only to skip ahead; nearby messages are read through */
+                    qint64 offset = indexOffset(segment, sequence);
+                    if (offset > log.pos() && !log.seek(offset))
+                        break;
+
+                    pending = false;
+                    while (readRecord(log, &message, &loggedTime, &size)) {
+                        if (message.sequence >= sequence) {
+                            pending = true;
+                            break;
+                        }
+                    }
+                }
+
+                if (!pending || message.sequence != sequence)
+                    continue;
+                pending = false;
+
+                /* Messages still sending when the history was last closed will never be delivered */
+                if (message.status == Sending && !m_offsets.contains(message.sequence))
+                    message.status = Error;
+                re.append(message);
+            }
+        }
+
+        while (i < wanted.size() && wanted[i] < segmentEnd)
+            i++;
+    }
+
+    return re;
+}
+
+/* Offset of the last index entry at or before sequence */
+qint64 MessageHistory::indexOffset(const Segment &segment, quint64 sequence)
+{
+    qint64 offset = FileHeaderSize;
+    int lo = 0, hi = segment.index.size() - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (segment.index[mid].sequence <= sequence) {
+            offset = segment.index[mid].offset;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return offset;
+}
+
+quint64 MessageHistory::sequenceAt(const QDateTime &time)
+{
+    qint64 msecs = time.toMSecsSinceEpoch();
+    writeBuffered();
+
+    for (int s = m_segments.size() - 1; s >= 0; s--) {
+        if (!loadIndex(s))
+            continue;
+
+        const Segment &segment = m_segments[s];
+        if (segment.index.isEmpty() || (segment.index.first().time > msecs && s > 0))
+            continue;
+
+        int entry = 0;
+        for (int lo = 0, hi = segment.index.size() - 1; lo <= hi; ) {
+            int mid = (lo + hi) / 2;
+            if (segment.index[mid].time <= msecs) {
+                entry = mid;
+                lo = mid + 1;
+            } else {
+                hi = mid - 1;
+            }
+        }
+
+        QFile log(segmentPath(segment.firstSequence, ".log"));
+        if (!log.open(QIODevice::ReadOnly) || !log.seek(segment.index[entry].offset))
+            return segment.index[entry].sequence;
+
+        Message message;
+        qint64 loggedTime, size;
+        while (readRecord(log, &message, &loggedTime, &size)) {
+            if (loggedTime >= msecs)
+                return message.sequence;
+        }
+
+        return (s + 1 < m_segments.size()) ? m_segments[s+1].firstSequence : m_nextSequence;
+    }
+
+    return firstSequence();
+}
+
+QVector<quint64> MessageHistory::search(const QString &query)
+{
+    if (m_search)
+        return m_search->search(query);
+    if (m_searchLoader || !isOpen())
+        return QVector<quint64>();
+
+    /* Everything up to endSequence must be in the log before the loader reads it */
+    if (!writeBuffered())
+        return QVector<quint64>();
+
+    QList<quint64> segments;
+    foreach (const Segment &segment, m_segments)
+        segments.append(segment.firstSequence);
+
+    m_searchLoader = new QFutureWatcher<MessageSearchIndex*>(this);
+    connect(m_searchLoader, SIGNAL(finished()), SLOT(searchIndexLoaded()));
+    m_searchLoader->setFuture(QtConcurrent::run(&loadSearchIndex, m_directory, segments, m_nextSequence));
+    return QVector<quint64>();
+}
@@ -0,0 +1,167 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MESSAGEHISTORY_H
+#define MESSAGEHISTORY_H
+
+#include <QObject>
+#include <QFile>
+#include <QList>
+#include <QVector>
+#include <QHash>
+#include <QTimer>
+#include <QDateTime>
+#include <QFutureWatcher>
+
+class MessageSearchIndex;
+
+/* Durable conversation history for one contact.
+ *
+ * Messages are appended to a log split into segments of at most a few MB, each
+ * with a sparse index of sequence numbers, times and file offsets. Sequence
+ * numbers start at 0 and increase by one per message. Appends are buffered and
+ * written once per event loop iteration; the files are synced to disk shortly
+ * after, and a failed write is rolled back and retried then. The only change made to a written message is its delivery status,
+ * which is a single byte updated in place. See MessageHistory.cpp for the
+ * file formats.
+ *
+ * Message text is also added to a MessageSearchIndex stored in the same
+ * directory. It's loaded and brought up to date with the log on a worker thread
+ * when first searched, and kept up to date from then on. */
+class MessageHistory : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(MessageHistory)
+
+public:
+    /* Same values as ConversationModel::MessageStatus */
+    enum Status
+    {
+        Received,
+        Sending,
+        Delivered,
+        Error
+    };
+
+    struct Message
+    {
+        quint64 sequence;
+        QDateTime time;
+        QString text;
+        quint16 identifier;
+        Status status;
+    };
+
+    explicit MessageHistory(const QString &directory, QObject *parent = 0);
+    virtual ~MessageHistory();
+
+    bool open();
+    void close();
+    bool isOpen() const { return m_writer.isOpen(); }
+
+    /* Messages have sequence numbers from firstSequence() to nextSequence() - 1 */
+    quint64 firstSequence() const;
+    quint64 nextSequence() const { return m_nextSequence; }
+    quint64 count() const { return m_nextSequence - firstSequence(); }
+
+    /* Returns the new message's sequence number; the sequence field of message is ignored */
+    quint64 append(const Message &message);
+    /* Only messages appended since the history was opened can be updated */
+    void setStatus(quint64 sequence, Status status);
+
+    /* Up to count messages, starting at sequence and in ascending order */
+    QList<Message> read(quint64 sequence, int count);
+    /* Messages with any of the given sequence numbers, in ascending order. Each segment
+     * is opened once, and read sequentially between nearby messages. */
+    QList<Message> readSequences(const QVector<quint64> &sequences);
+    /* Sequence number of the first message logged at or after time, or nextSequence() */
+    quint64 sequenceAt(const QDateTime &time);
+    /* Sequence numbers of messages with words matching every term of query, newest first.
+     * Until isSearchReady(), this is empty, and starts loading the search index. */
+    QVector<quint64> search(const QString &query);
+    bool isSearchReady() const { return m_search != 0; }
+
+    /* Deletes all history from disk */
+    void removeAll();
+
+signals:
+    /* The search index was loaded, and search() can find results */
+    void searchReady();
+
+public slots:
+    void sync();
+
+private slots:
+    void searchIndexLoaded();
+    /* Returns false if the buffered records couldn't be written; they're kept */
+    bool writeBuffered();
+
+private:
+    struct IndexEntry
+    {
+        quint64 sequence;
+        qint64 time;
+        quint32 offset;
+    };
+
+    struct Segment
+    {
+        quint64 firstSequence;
+        bool indexLoaded;
+        QVector<IndexEntry> index;
+    };
+
+    QString m_directory;
+    QList<Segment> m_segments;
+    QFile m_writer;
+    QFile m_indexWriter;
+    qint64 m_writerSize;
+    quint64 m_nextSequence;
+    QByteArray m_writeBuffer;
+    QByteArray m_indexBuffer;
+    /* Segment and offset of messages appended since opening, for setStatus */
+    QHash<quint64,QPair<quint64,qint64> > m_offsets;
+    QTimer m_writeTimer;
+    QTimer m_syncTimer;
+    MessageSearchIndex *m_search;
+    QFutureWatcher<MessageSearchIndex*> *m_searchLoader;
+
+    QString segmentPath(quint64 firstSequence, const char *suffix) const;
+    int segmentFor(quint64 sequence) const;
+    static qint64 indexOffset(const Segment &segment, quint64 sequence);
+    bool loadIndex(int segment);
+    bool openWriter();
+    bool recoverTail(Segment &segment);
+    bool startSegment(quint64 firstSequence);
+};
+
+#endif // MESSAGEHISTORY_H
@@ -0,0 +1,349 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "MessageSearchIndex.h"
+#include <QSet>
+#include <QtEndian>
+#include <QDebug>
+#include <algorithm>
+#include <string.h>
+
+#ifdef Q_OS_WIN
+#include <io.h>   // _commit(handle)
+#else
+#include <unistd.h>   // fsync(handle)
+#endif
+
+/* The index file begins with a 16 byte header of "TSSI", quint32 version, and
+ * the quint64 first sequence of the history it indexes. It's followed by a
+ * record for each message that contains any words:
+ *     0   quint32  record size, including this header
+ *     4   quint16  checksum of bytes 8 to the end
+ *     6   quint16  number of words
+ *     8   quint64  sequence
+ *     16  words, each as a quint8 length and case-folded UTF-8
+ *
+ * As with the history, a record that fails validation ends the file and is
+ * truncated when opening. All integers are little-endian. */
+
+static const char indexMagic[] = "TSSI";
+static const quint32 indexVersion = 1;
+static const int FileHeaderSize = 16;
+static const int RecordHeaderSize = 16;
+/* Longer words are indexed by their first MaxWordLength characters */
+static const int MaxWordLength = 32;
+
+static bool isWordChar(const QChar &c)
+{
+    return c.isLetterOrNumber() || c.isMark() || c.isSurrogate();
+}
+
+/* Returns the start of the next word in text at or after from, or -1 */
+static int nextWord(const QString &text, int from, int *length)
+{
+    int start = from;
+    while (start < text.size() && !isWordChar(text[start]))
+        start++;
+    if (start >= text.size())
+        return -1;
+
+    int end = start + 1;
+    while (end < text.size() && isWordChar(text[end]))
+        end++;
+    *length = end - start;
+    return start;
+}
+
+static QString foldWord(const QString &text, int start, int length)
+{
+    QString word = text.mid(start, length).toCaseFolded();
+    if (word.size() > MaxWordLength) {
+        word.truncate(MaxWordLength);
+        if (word.at(MaxWordLength - 1).isHighSurrogate())
+            word.chop(1);
+    }
+    return word;
+}
+
+/* Distinct case-folded words of text, in order of appearance */
+static QStringList uniqueWords(const QString &text)
+{
+    QStringList re;
+    QSet<QString> seen;
+    int length = 0;
+    for (int start = nextWord(text, 0, &length); start >= 0; start = nextWord(text, start + length, &length)) {
+        QString word = foldWord(text, start, length);
+        if (!seen.contains(word)) {
+            seen.insert(word);
+            re.append(word);
+        }
+    }
+    return re;
+}
+
+static bool sizeLessThan(const QVector<quint64> &a, const QVector<quint64> &b)
+{
+    return a.size() < b.size();
+}
+
+MessageSearchIndex::MessageSearchIndex(const QString &fileName)
+    : m_file(fileName), m_nextSequence(0)
+{
+}
+
+MessageSearchIndex::~MessageSearchIndex()
+{
+    close();
+}
+
+bool MessageSearchIndex::open(quint64 firstSequence, quint64 endSequence)
+{
+    close();
+    m_nextSequence = firstSequence;
+
+    if (!m_file.open(QIODevice::ReadWrite)) {
+        qWarning() << "MessageSearchIndex: Cannot open" << m_file.fileName() << ":" << m_file.errorString();
+        return false;
+    }
+
+    qint64 size = m_file.size();
+    qint64 offset = FileHeaderSize;
+    const uchar *data = size >= FileHeaderSize ? m_file.map(0, size) : 0;
+
+    if (!data || memcmp(data, indexMagic, 4) != 0 || qFromLittleEndian<quint32>(data + 4) != indexVersion ||
+        qFromLittleEndian<quint64>(data + 8) != firstSequence)
+    {
+        /* Missing, incompatible, or for an earlier history; rebuild from the start */
+        if (data)
+            m_file.unmap(const_cast<uchar*>(data));
+
+        QByteArray header(FileHeaderSize, 0);
+        uchar *h = reinterpret_cast<uchar*>(header.data());
+        memcpy(h, indexMagic, 4);
+        qToLittleEndian<quint32>(indexVersion, h + 4);
+        qToLittleEndian<quint64>(firstSequence, h + 8);
+
+        if (!m_file.resize(0) || m_file.write(header) != header.size() || !m_file.flush()) {
+            qWarning() << "MessageSearchIndex: Cannot write" << m_file.fileName() << ":" << m_file.errorString();
+            m_file.close();
+            return false;
+        }
+        return true;
+    }
+
+    QStringList words;
+    while (offset + RecordHeaderSize <= size) {
+        const uchar *r = data + offset;
+        quint32 recordSize = qFromLittleEndian<quint32>(r);
+        if (recordSize < quint32(RecordHeaderSize) || recordSize > size - offset)
+            break;
+        if (qFromLittleEndian<quint16>(r + 4) != qChecksum(reinterpret_cast<const char*>(r) + 8, recordSize - 8))
+            break;
+
+        int count = qFromLittleEndian<quint16>(r + 6);
+        quint64 sequence = qFromLittleEndian<quint64>(r + 8);
+        /* Messages past endSequence were lost from the log, and their sequences will be reused */
+        if (sequence < m_nextSequence || sequence >= endSequence)
+            break;
+
+        words.clear();
+        quint32 p = RecordHeaderSize;
+        for (int i = 0; i < count && p < recordSize; i++) {
+            int length = r[p];
+            if (p + 1 + length > recordSize)
+                break;
+            words.append(QString::fromUtf8(reinterpret_cast<const char*>(r) + p + 1, length));
+            p += 1 + length;
+        }
+        if (words.size() != count)
+            break;
+
+        insert(sequence, words);
+        m_nextSequence = sequence + 1;
+        offset += recordSize;
+    }
+
+    m_file.unmap(const_cast<uchar*>(data));
+
+    if (offset < size) {
+        qWarning() << "MessageSearchIndex: Discarding" << (size - offset) << "bytes of invalid data from" << m_file.fileName();
+        m_file.resize(offset);
+    }
+
+    return true;
+}
+
+void MessageSearchIndex::close()
+{
+    if (isOpen()) {
+        writeBuffered();
+        sync();
+    }
+
+    m_file.close();
+    m_words.clear();
+    m_writeBuffer.clear();
+    m_nextSequence = 0;
+}
+
+void MessageSearchIndex::insert(quint64 sequence, const QStringList &words)
+{
+    foreach (const QString &word, words)
+        m_words[word].append(sequence);
+}
+
+void MessageSearchIndex::add(quint64 sequence, const QString &text)
+{
+    if (!isOpen() || sequence < m_nextSequence)
+        return;
+
+    m_nextSequence = sequence + 1;
+    QStringList words = uniqueWords(text);
+    if (words.isEmpty())
+        return;
+
+    insert(sequence, words);
+
+    QByteArray record(RecordHeaderSize, 0);
+    int count = 0;
+    foreach (const QString &word, words) {
+        QByteArray utf8 = word.toUtf8();
+        if (utf8.size() > 255 || count == 0xffff)
+            continue;
+        record.append(char(utf8.size()));
+        record.append(utf8);
+        count++;
+    }
+
+    uchar *r = reinterpret_cast<uchar*>(record.data());
+    qToLittleEndian<quint32>(quint32(record.size()), r);
+    qToLittleEndian<quint16>(quint16(count), r + 6);
+    qToLittleEndian<quint64>(sequence, r + 8);
+    qToLittleEndian<quint16>(qChecksum(record.constData() + 8, record.size() - 8), r + 4);
+    m_writeBuffer.append(record);
+}
+
+void MessageSearchIndex::writeBuffered()
+{
+    if (m_writeBuffer.isEmpty() || !isOpen())
+        return;
+
+    m_file.seek(m_file.size());
+    if (m_file.write(m_writeBuffer) != m_writeBuffer.size() || !m_file.flush())
+        qWarning() << "MessageSearchIndex: Writing" << m_file.fileName() << "failed:" << m_file.errorString();
+    m_writeBuffer.clear();
+}
+
+void MessageSearchIndex::sync()
+{
+    if (!isOpen())
+        return;
+    m_file.flush();
+#ifdef Q_OS_WIN
+    _commit(m_file.handle());
+#else
+    fsync(m_file.handle());
+#endif
+}
+
+QStringList MessageSearchIndex::terms(const QString &query)
+{
+    return uniqueWords(query);
+}
+
+QVector<quint64> MessageSearchIndex::matches(const QString &prefix) const
+{
+    QMap<QString,QVector<quint64> >::ConstIterator it = m_words.lowerBound(prefix);
+    QMap<QString,QVector<quint64> >::ConstIterator end = m_words.constEnd();
+    if (it == end || !it.key().startsWith(prefix))
+        return QVector<quint64>();
+
+    QMap<QString,QVector<quint64> >::ConstIterator next = it + 1;
+    if (next == end || !next.key().startsWith(prefix))
+        return it.value();
+
+    /* Merge the messages of every word with this prefix */
+    QVector<quint64> re;
+    for (; it != end && it.key().startsWith(prefix); ++it)
+        re += it.value();
+    std::sort(re.begin(), re.end());
+    re.erase(std::unique(re.begin(), re.end()), re.end());
+    return re;
+}
+
+QVector<quint64> MessageSearchIndex::search(const QString &query) const
+{
+    QStringList queryTerms = terms(query);
+    if (queryTerms.isEmpty())
+        return QVector<quint64>();
+
+    QList<QVector<quint64> > sets;
+    foreach (const QString &term, queryTerms) {
+        sets.append(matches(term));
+        if (sets.last().isEmpty())
+            return QVector<quint64>();
+    }
+
+    /* Intersect starting from the rarest term */
+    std::sort(sets.begin(), sets.end(), sizeLessThan);
+    QVector<quint64> re = sets.first();
+    for (int i = 1; i < sets.size() && !re.isEmpty(); i++) {
+        const QVector<quint64> &set = sets[i];
+        QVector<quint64> common;
+        common.reserve(re.size());
+        foreach (quint64 sequence, re) {
+            if (std::binary_search(set.begin(), set.end(), sequence))
+                common.append(sequence);
+        }
+        re = common;
+    }
+
+    std::reverse(re.begin(), re.end());
+    return re;
+}
+
+QList<MessageSearchIndex::Highlight> MessageSearchIndex::highlights(const QString &text, const QStringList &terms)
+{
+    QList<Highlight> re;
+    int length = 0;
+    for (int start = nextWord(text, 0, &length); start >= 0; start = nextWord(text, start + length, &length)) {
+        QString word = foldWord(text, start, length);
+        foreach (const QString &term, terms) {
+            if (word.startsWith(term)) {
+                Highlight highlight = { start, length };
+                re.append(highlight);
+                break;
+            }
+        }
+    }
+    return re;
+}
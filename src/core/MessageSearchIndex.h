@@ -0,0 +1,93 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MESSAGESEARCHINDEX_H
+#define MESSAGESEARCHINDEX_H
+
+#include <QFile>
+#include <QMap>
+#include <QVector>
+#include <QStringList>
+
+/* Inverted index of the words in a contact's message history.
+ *
+ * Text is split into words of letters and numbers, which are case-folded. Each
+ * word maps to the ascending sequence numbers of the messages containing it,
+ * and queries match every term as a word prefix. The index is held in memory
+ * and persisted as an append-only file next to the history, which
+ * MessageHistory keeps up to date as messages are appended. */
+class MessageSearchIndex
+{
+    Q_DISABLE_COPY(MessageSearchIndex)
+
+public:
+    struct Highlight
+    {
+        int start;
+        int length;
+    };
+
+    explicit MessageSearchIndex(const QString &fileName);
+    ~MessageSearchIndex();
+
+    /* Loads the index of messages from firstSequence to endSequence - 1; messages
+     * from nextSequence() on must then be added */
+    bool open(quint64 firstSequence, quint64 endSequence);
+    void close();
+    bool isOpen() const { return m_file.isOpen(); }
+
+    quint64 nextSequence() const { return m_nextSequence; }
+
+    /* Sequences must be added in ascending order */
+    void add(quint64 sequence, const QString &text);
+    void writeBuffered();
+    void sync();
+
+    /* Sequences of messages matching all terms of query, newest first */
+    QVector<quint64> search(const QString &query) const;
+
+    /* Case-folded search terms of query */
+    static QStringList terms(const QString &query);
+    /* Positions in text of the words matched by terms */
+    static QList<Highlight> highlights(const QString &text, const QStringList &terms);
+
+private:
+    QFile m_file;
+    QMap<QString,QVector<quint64> > m_words;
+    quint64 m_nextSequence;
+    QByteArray m_writeBuffer;
+
+    void insert(quint64 sequence, const QStringList &words);
+    QVector<quint64> matches(const QString &prefix) const;
+};
+
+#endif // MESSAGESEARCHINDEX_H
@@ -36,11 +36,12 @@
 #include "ContactUser.h"
 #include "UserIdentity.h"
 #include "IncomingRequestManager.h"
+#include "ContactRequestDispatcher.h"
 #include "protocol/ContactRequestClient.h"
 #include <QDebug>
 
 OutgoingContactRequest *OutgoingContactRequest::createNewRequest(ContactUser *user, const QString &myNickname,
-                                                                 const QString &message)
+                                                                 const QString &message, Priority priority)
 {
     Q_ASSERT(!user->contactRequest());
 
@@ -50,11 +51,12 @@ OutgoingContactRequest *OutgoingContactRequest::createNewRequest(ContactUser *us
 
     user->loadContactRequest();
     Q_ASSERT(user->contactRequest());
+    user->contactRequest()->setPriority(priority);
     return user->contactRequest();
 }
 
 OutgoingContactRequest::OutgoingContactRequest(ContactUser *u)
-    : QObject(u), user(u), m_client(0)
+    : QObject(u), user(u), m_client(0), m_priority(Background)
 {
     emit user->identity->contacts.outgoingRequestAdded(this);
 
@@ -69,6 +71,7 @@ OutgoingContactRequest::OutgoingContactRequest(ContactUser *u)
 OutgoingContactRequest::~OutgoingContactRequest()
 {
     Q_ASSERT(!m_client);
+    ContactRequestDispatcher::instance()->finish(this, false);
     user->setProperty("contactRequest", QVariant());
 }
 
@@ -92,6 +95,15 @@ QString OutgoingContactRequest::rejectMessage() const
     return user->readSetting("request/rejectMessage").toString();
 }
 
+void OutgoingContactRequest::setPriority(Priority priority)
+{
+    if (priority == m_priority)
+        return;
+
+    m_priority = priority;
+    ContactRequestDispatcher::instance()->reprioritize(this);
+}
+
 void OutgoingContactRequest::setStatus(Status newStatus)
 {
     Status oldStatus = status();
@@ -106,7 +118,8 @@ void OutgoingContactRequest::attemptAutoAccept()
 {
     /* Check if there is an existing incoming request that matches this one; if so, treat this as accepted
      * automatically and accept that incoming request for this user */
-    QByteArray hostname = user->hostname().left(16).toLatin1();
+    QByteArray hostname = user->hostname().toLatin1();
+    hostname.chop(6); /* ".onion" */
 
     IncomingContactRequest *incomingReq = user->identity->contacts.incomingRequests.requestFromHostname(hostname);
     if (incomingReq)
@@ -120,9 +133,20 @@ void OutgoingContactRequest::attemptAutoAccept()
 
 void OutgoingContactRequest::startConnection()
 {
-    if (m_client)
+    if (m_client || status() >= FirstResult)
         return;
 
+    ContactRequestDispatcher::instance()->submit(this);
+}
+
+void OutgoingContactRequest::startAttempt()
+{
+    if (m_client || status() >= FirstResult)
+    {
+        ContactRequestDispatcher::instance()->finish(this, false);
+        return;
+    }
+
     qDebug() << "Starting outgoing contact request for" << user->uniqueID;
 
     m_client = new ContactRequestClient(user);
@@ -137,6 +161,18 @@ void OutgoingContactRequest::startConnection()
     m_client->sendRequest();
 }
 
+void OutgoingContactRequest::stopAttempt()
+{
+    if (!m_client)
+        return;
+
+    m_client->disconnect(this);
+    m_client->close();
+    m_client->deleteLater();
+    m_client = 0;
+    emit connectedChanged();
+}
+
 bool OutgoingContactRequest::isConnected() const
 {
     return m_client && m_client->response() == ContactRequestClient::Acknowledged;
@@ -144,6 +180,8 @@ bool OutgoingContactRequest::isConnected() const
 
 void OutgoingContactRequest::removeRequest()
 {
+    ContactRequestDispatcher::instance()->finish(this, false);
+
     if (m_client)
     {
         m_client->disconnect(this);
@@ -163,6 +201,7 @@ void OutgoingContactRequest::removeRequest()
 
 void OutgoingContactRequest::accept()
 {
+    ContactRequestDispatcher::instance()->finish(this, true);
     setStatus(Accepted);
     removeRequest();
     emit accepted();
@@ -173,13 +212,8 @@ void OutgoingContactRequest::reject(bool error, const QString &reason)
     user->writeSetting("request/rejectMessage", reason);
     setStatus(error ? Error : Rejected);
 
-    if (m_client)
-    {
-        m_client->disconnect(this);
-        m_client->close();
-        m_client->deleteLater();
-        m_client = 0;
-    }
+    ContactRequestDispatcher::instance()->finish(this, false);
+    stopAttempt();
 
     emit rejected(reason);
 }
@@ -191,6 +225,7 @@ void OutgoingContactRequest::cancel()
 
 void OutgoingContactRequest::requestAcknowledged()
 {
+    ContactRequestDispatcher::instance()->finish(this, true);
     setStatus(Acknowledged);
 }
 
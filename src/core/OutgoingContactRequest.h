@@ -42,7 +42,7 @@ class OutgoingContactRequest : public QObject
 {
     Q_OBJECT
     Q_DISABLE_COPY(OutgoingContactRequest)
-    Q_ENUMS(Status)
+    Q_ENUMS(Status Priority)
 
     Q_PROPERTY(Status status READ status NOTIFY statusChanged)
     Q_PROPERTY(QString myNickname READ myNickname CONSTANT)
@@ -61,7 +61,15 @@ public:
         FirstResult = Accepted
     };
 
-    static OutgoingContactRequest *createNewRequest(ContactUser *user, const QString &myNickname, const QString &message);
+    /* Order in which requests connect; see ContactRequestDispatcher */
+    enum Priority
+    {
+        Background,
+        Interactive
+    };
+
+    static OutgoingContactRequest *createNewRequest(ContactUser *user, const QString &myNickname, const QString &message,
+                                                    Priority priority = Interactive);
 
     ContactUser * const user;
 
@@ -74,6 +82,10 @@ public:
     QString rejectMessage() const;
     bool isConnected() const;
 
+    /* Requests loaded at startup are Background */
+    Priority priority() const { return m_priority; }
+    void setPriority(Priority priority);
+
     ContactRequestClient *client() const { return m_client; }
 
 public slots:
@@ -95,11 +107,18 @@ private slots:
     void startConnection();
 
 private:
+    friend class ContactRequestDispatcher;
+
     ContactRequestClient *m_client;
+    Priority m_priority;
 
     void setStatus(Status newStatus);
     void removeRequest();
     void attemptAutoAccept();
+
+    /* Called by the dispatcher to connect, or to give up on a connection that timed out */
+    void startAttempt();
+    void stopAttempt();
 };
 
 #endif // OUTGOINGCONTACTREQUEST_H
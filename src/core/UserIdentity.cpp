@@ -36,19 +36,24 @@
 #include "tor/HiddenService.h"
 #include "protocol/IncomingSocket.h"
 #include "core/ContactIDValidator.h"
+#include "core/AvatarEncoder.h"
 #include <QImage>
 #include <QPixmap>
 #include <QPixmapCache>
-#include <QBuffer>
 #include <QDir>
 
 UserIdentity::UserIdentity(int id, QObject *parent)
     : QObject(parent)
     , uniqueID(id)
     , contacts(this)
+    , m_record(-1)
     , m_hiddenService(0)
     , incomingSocket(0)
 {
+    m_record = database->findRecord(StateDatabase::IdentityRecord, uniqueID);
+    if (m_record < 0)
+        m_record = database->createRecord(StateDatabase::IdentityRecord, uniqueID, uniqueID);
+
     m_nickname = readSetting("nickname", tr("Me")).toString();
 
     QString dir = readSetting("dataDirectory", QLatin1String("data-") + QString::number(uniqueID)).toString();
@@ -82,31 +87,65 @@ UserIdentity::UserIdentity(int id, QObject *parent)
 
 UserIdentity *UserIdentity::createIdentity(int uniqueID, const QString &dataDirectory)
 {
-    config->beginGroup(QString::fromLatin1("identity/%1").arg(uniqueID));
-    config->setValue("createNewService", true);
+    QVariantMap properties;
+    properties.insert(QLatin1String("createNewService"), true);
     if (dataDirectory.isEmpty())
-        config->setValue("dataDirectory", QLatin1String("data-") + QString::number(uniqueID));
+        properties.insert(QLatin1String("dataDirectory"), QString(QLatin1String("data-") + QString::number(uniqueID)));
     else
-        config->setValue("dataDirectory", dataDirectory);
-    config->endGroup();
+        properties.insert(QLatin1String("dataDirectory"), dataDirectory);
+
+    int record = database->createRecord(StateDatabase::IdentityRecord, uniqueID, uniqueID);
+    database->setProperties(record, properties);
 
     return new UserIdentity(uniqueID);
 }
 
 QVariant UserIdentity::readSetting(const QString &key, const QVariant &defaultValue) const
 {
-    return config->value(QString::fromLatin1("identity/%1/%2").arg(uniqueID).arg(key), defaultValue);
+    QVariant value;
+
+    if (key == QLatin1String("nickname")) {
+        QString nickname = database->nickname(m_record);
+        if (!nickname.isEmpty())
+            value = nickname;
+    } else if (key == QLatin1String("avatar")) {
+        QByteArray avatar = database->blob(m_record, StateDatabase::AvatarBlob);
+        if (!avatar.isEmpty())
+            value = avatar;
+    } else {
+        value = database->properties(m_record).value(key);
+    }
+
+    return value.isNull() ? defaultValue : value;
 }
 
 void UserIdentity::writeSetting(const QString &key, const QVariant &value)
 {
-    config->setValue(QString::fromLatin1("identity/%1/%2").arg(uniqueID).arg(key), value);
+    if (key == QLatin1String("nickname")) {
+        database->setNickname(m_record, value.toString());
+    } else if (key == QLatin1String("avatar")) {
+        database->setBlob(m_record, StateDatabase::AvatarBlob, value.toByteArray());
+    } else {
+        QVariantMap properties = database->properties(m_record);
+        properties.insert(key, value);
+        database->setProperties(m_record, properties);
+    }
+
     emit settingsChanged(key);
 }
 
 void UserIdentity::removeSetting(const QString &key)
 {
-    config->remove(QString::fromLatin1("identity/%1/%2").arg(uniqueID).arg(key));
+    if (key == QLatin1String("nickname")) {
+        database->setNickname(m_record, QString());
+    } else if (key == QLatin1String("avatar")) {
+        database->setBlob(m_record, StateDatabase::AvatarBlob, QByteArray());
+    } else {
+        QVariantMap properties = database->properties(m_record);
+        if (properties.remove(key))
+            database->setProperties(m_record, properties);
+    }
+
     emit settingsChanged(key);
 }
 
@@ -132,21 +171,18 @@ void UserIdentity::setNickname(const QString &nick)
 
 void UserIdentity::setAvatar(QImage image)
 {
-    if (image.width() > 160 || image.height() > 160)
-        image = image.scaled(QSize(160, 160), Qt::KeepAspectRatio, Qt::SmoothTransformation);
-
-    if (!image.isNull())
-    {
-        QBuffer buffer;
-        buffer.open(QBuffer::ReadWrite);
-        if (image.save(&buffer, "jpeg", 90))
-            writeSetting("avatar", buffer.buffer());
-        else
-            image = QImage();
-    }
+    /* Scaling and encoding happen on a worker thread, which calls setAvatarData */
+    AvatarEncoder::instance()->encode(this, image);
+}
 
-    if (image.isNull())
+void UserIdentity::setAvatarData(const QByteArray &data)
+{
+    if (data.isEmpty())
         removeSetting("avatar");
+    else
+        writeSetting("avatar", data);
+
+    emit avatarChanged();
 }
 
 void UserIdentity::onStatusChanged(int newStatus, int oldStatus)
@@ -79,14 +79,17 @@ public:
     ContactsManager *getContacts() { return &contacts; }
 
     void setNickname(const QString &nickname);
+    /* Encodes image asynchronously; the avatar changes when it's done */
     void setAvatar(QImage image);
+    /* Encoded avatar image, or empty to remove it */
+    Q_INVOKABLE void setAvatarData(const QByteArray &data);
 
     /* State */
     bool isServiceOnline() const;
     bool isServicePublished() const;
     Tor::HiddenService *hiddenService() const { return m_hiddenService; }
 
-    /* Settings API */
+    /* Settings API; stored in the identity's StateDatabase record */
     QVariant readSetting(const QString &key, const QVariant &defaultValue = QVariant()) const;
     QVariant readSetting(const char *key, const QVariant &defaultValue = QVariant()) const
     {
@@ -109,12 +112,14 @@ signals:
     void statusChanged();
     void contactIDChanged(); // only possible during creation
     void nicknameChanged();
+    void avatarChanged();
     void settingsChanged(const QString &key);
 
 private slots:
     void onStatusChanged(int newStatus, int oldStatus);
 
 private:
+    int m_record;
     QString m_nickname;
     Tor::HiddenService *m_hiddenService;
     IncomingSocket *incomingSocket;
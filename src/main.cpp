@@ -33,6 +33,8 @@
 #include "main.h"
 #include "ui/MainWindow.h"
 #include "core/IdentityManager.h"
+#include "core/AvatarEncoder.h"
+#include "core/UserIdentity.h"
 #include "tor/TorManager.h"
 #include "tor/TorControl.h"
 #include "utils/CryptoKey.h"
@@ -46,19 +48,27 @@
 #include <QLocale>
 #include <QLockFile>
 #include <QStandardPaths>
+#include <QFile>
 #include <openssl/crypto.h>
 
 AppSettings *config = 0;
 static QLockFile *configLock = 0;
 
+/* Command line options; the configuration path is the first other argument */
+static QString importContactsPath, exportContactsPath;
+static QStringList arguments;
+
+static void parseArguments();
 static bool initSettings(QString &errorMessage);
 static void initTranslation();
+static bool importExportContacts(int *exitCode);
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
 
     a.setApplicationVersion(QLatin1String("1.0.0"));
+    parseArguments();
 
     {
         QString error;
@@ -72,6 +82,11 @@ int main(int argc, char *argv[])
 
     /* Initialize OpenSSL's allocator */
     CRYPTO_malloc_init();
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    /* Private key numbers are allocated from a locked heap that is wiped when freed */
+    if (!CRYPTO_secure_malloc_init(65536, 32))
+        qWarning() << "Failed to initialize OpenSSL secure heap";
+#endif
 
     /* Seed the OpenSSL RNG */
     if (!SecureRNG::seed())
@@ -85,10 +100,22 @@ int main(int argc, char *argv[])
     /* Identities */
     identityManager = new IdentityManager;
 
+    {
+        int exitCode = 0;
+        if (!importExportContacts(&exitCode)) {
+            database->close();
+            delete configLock;
+            return exitCode;
+        }
+    }
+
     /* Window */
     MainWindow w;
 
     int r = a.exec();
+    AvatarEncoder::instance()->waitForDone();
+    database->close();
+    config->flush();
     delete configLock;
     return r;
 }
@@ -130,9 +157,8 @@ static bool initSettings(QString &errorMessage)
     qApp->setOrganizationName(QStringLiteral("Torsion"));
 
     QString configPath;
-    QStringList args = qApp->arguments();
-    if (args.size() > 1) {
-        configPath = args[1];
+    if (!arguments.isEmpty()) {
+        configPath = arguments[0];
     } else {
 #ifndef TORSION_NO_PORTABLE
 # ifdef Q_OS_MAC
@@ -177,10 +203,85 @@ static bool initSettings(QString &errorMessage)
         return false;
     }
 
+    database = new StateDatabase(dir.filePath(QStringLiteral("Torsion.db")));
+    if (!database->open()) {
+        errorMessage = QStringLiteral("Cannot open contact database: ") + database->errorString();
+        return false;
+    }
+
+    if (database->damagedRecordCount()) {
+        QMessageBox::warning(0, QStringLiteral("Torsion"),
+                             QStringLiteral("%1 damaged entries in the contact database were set aside in %2. "
+                                            "Some contacts or contact requests may be missing.")
+                             .arg(database->damagedRecordCount()).arg(database->damagedRecordsPath()));
+    }
+
+    if (!database->hasImportedSettings() && !database->importSettings(config)) {
+        errorMessage = QStringLiteral("Cannot import contacts into the database");
+        return false;
+    }
+
     QDir::setCurrent(dir.absolutePath());
     return true;
 }
 
+static void parseArguments()
+{
+    QStringList args = qApp->arguments();
+    for (int i = 1; i < args.size(); i++) {
+        if (args[i] == QLatin1String("--import-contacts") && i + 1 < args.size())
+            importContactsPath = args[++i];
+        else if (args[i] == QLatin1String("--export-contacts") && i + 1 < args.size())
+            exportContactsPath = args[++i];
+        else
+            arguments.append(args[i]);
+    }
+}
+
+/* Handles --export-contacts, which exits afterwards, and --import-contacts, which continues
+ * into the UI so the requests can be sent. Returns false if the application should exit. */
+static bool importExportContacts(int *exitCode)
+{
+    if (importContactsPath.isEmpty() && exportContactsPath.isEmpty())
+        return true;
+
+    if (identityManager->identities().isEmpty()) {
+        qWarning() << "No identity to import or export contacts";
+        *exitCode = 1;
+        return false;
+    }
+
+    UserIdentity *identity = identityManager->identities().first();
+
+    if (!exportContactsPath.isEmpty()) {
+        QFile file(exportContactsPath);
+        int count = -1;
+        if (file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+            count = identity->contacts.exportContacts(&file);
+        if (count < 0 || !file.flush()) {
+            qWarning() << "Exporting contacts to" << exportContactsPath << "failed:" << file.errorString();
+            *exitCode = 1;
+        } else {
+            qDebug() << "Exported" << count << "contacts to" << exportContactsPath;
+        }
+        return false;
+    }
+
+    QFile file(importContactsPath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Cannot open" << importContactsPath << "to import contacts:" << file.errorString();
+        *exitCode = 1;
+        return false;
+    }
+
+    ContactsManager::ImportResult result = identity->contacts.importContacts(&file, identity->nickname(), QString());
+    if (!result.saved) {
+        qWarning() << "Contacts imported from" << importContactsPath
+                   << "could not be written to the database, and may be lost on exit";
+    }
+    return true;
+}
+
 static void initTranslation()
 {
     QTranslator *translator = new QTranslator;
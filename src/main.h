@@ -34,5 +34,6 @@
 #define MAIN_H
 
 #include "utils/AppSettings.h"
+#include "utils/StateDatabase.h"
 
 #endif // MAIN_H
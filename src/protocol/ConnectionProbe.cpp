@@ -0,0 +1,153 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ConnectionProbe.h"
+#include "ProbeCommand.h"
+#include "core/ContactUser.h"
+#include <algorithm>
+#include <QDebug>
+
+ConnectionProbe::ConnectionProbe(ContactUser *u, QObject *parent)
+    : QObject(parent)
+    , user(u)
+    , m_burstsLeft(0)
+    , m_probesPerBurst(0)
+    , m_requestSize(0)
+    , m_replySize(0)
+    , m_hasResult(false)
+{
+    m_result = Result();
+}
+
+bool ConnectionProbe::start(int bursts, int probesPerBurst, int requestSize, int replySize)
+{
+    if (isRunning() || !user->isConnected() || bursts < 1 || probesPerBurst < 1)
+        return false;
+
+    m_result = Result();
+    m_hasResult = false;
+    m_samples.clear();
+    m_burstsLeft = bursts;
+    m_probesPerBurst = probesPerBurst;
+    m_requestSize = requestSize;
+    m_replySize = replySize;
+
+    qDebug() << "Probing connection to contact" << user->uniqueID << "with" << bursts << "bursts of"
+             << probesPerBurst;
+
+    m_time.start();
+    sendBurst();
+    return true;
+}
+
+void ConnectionProbe::cancel()
+{
+    /* Outstanding commands still belong to the socket; ignore their replies */
+    foreach (const QPointer<ProbeCommand> &command, m_pending) {
+        if (command)
+            command->disconnect(this);
+    }
+
+    m_pending.clear();
+    m_burstsLeft = 0;
+}
+
+void ConnectionProbe::sendBurst()
+{
+    m_burstsLeft--;
+
+    for (int i = 0; i < m_probesPerBurst; ++i) {
+        ProbeCommand *command = new ProbeCommand;
+        connect(command, SIGNAL(commandFinished()), SLOT(probeFinished()));
+        command->send(user->conn(), quint32(m_time.elapsed()), m_requestSize, m_replySize);
+
+        m_result.probesSent++;
+        m_result.bytesSent += command->requestSize();
+        m_pending.append(command);
+    }
+}
+
+void ConnectionProbe::probeFinished()
+{
+    ProbeCommand *command = qobject_cast<ProbeCommand*>(sender());
+    if (!command || !m_pending.removeOne(command))
+        return;
+
+    if (command->isSuccess()) {
+        m_result.probesReceived++;
+        m_result.bytesReceived += command->replySize();
+        m_samples.append(command->roundTripTime());
+    } else if (command->isRateLimited()) {
+        m_result.probesRejected++;
+    }
+
+    if (!m_pending.isEmpty())
+        return;
+
+    if (m_burstsLeft > 0 && user->isConnected()) {
+        sendBurst();
+        return;
+    }
+
+    m_result.elapsed = m_time.nsecsElapsed() / 1000;
+    computeResult();
+    m_hasResult = true;
+    emit finished();
+}
+
+void ConnectionProbe::computeResult()
+{
+    if (m_result.elapsed > 0) {
+        m_result.uploadRate = double(m_result.bytesSent) * 1000000 / m_result.elapsed;
+        m_result.downloadRate = double(m_result.bytesReceived) * 1000000 / m_result.elapsed;
+    }
+
+    if (m_samples.isEmpty())
+        return;
+
+    qint64 deltas = 0;
+    for (int i = 1; i < m_samples.size(); ++i)
+        deltas += qAbs(m_samples[i] - m_samples[i-1]);
+    if (m_samples.size() > 1)
+        m_result.jitter = double(deltas) / (m_samples.size() - 1);
+
+    QList<qint64> sorted = m_samples;
+    std::sort(sorted.begin(), sorted.end());
+    m_result.rttMin = sorted.first();
+    m_result.rttMax = sorted.last();
+    m_result.rttMedian = sorted[sorted.size() / 2];
+    m_result.rttP90 = sorted[qMin(sorted.size() - 1, (sorted.size() * 9) / 10)];
+
+    qDebug() << "Probe of contact" << user->uniqueID << "finished:" << m_result.probesReceived << "of"
+             << m_result.probesSent << "replies, rtt median" << m_result.rttMedian << "us, jitter"
+             << m_result.jitter << "us, down" << qint64(m_result.downloadRate) << "B/s";
+}
@@ -0,0 +1,110 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CONNECTIONPROBE_H
+#define CONNECTIONPROBE_H
+
+#include <QObject>
+#include <QList>
+#include <QElapsedTimer>
+#include <QPointer>
+
+class ContactUser;
+class ProbeCommand;
+
+/* Measures throughput, round-trip time and jitter on the connection to a
+ * contact, using bursts of ProbeCommand in the style of iperf. Each burst
+ * sends probesPerBurst commands at once and waits for every reply before
+ * the next burst begins.
+ *
+ * The peer rate-limits probes; rejected probes are counted separately and
+ * excluded from the RTT samples. */
+class ConnectionProbe : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ConnectionProbe)
+
+public:
+    struct Result
+    {
+        int probesSent;
+        int probesReceived;
+        int probesRejected;
+        qint64 bytesSent;
+        qint64 bytesReceived;
+        /* Microseconds from the first send to the last reply */
+        qint64 elapsed;
+        /* Octets per second */
+        double uploadRate;
+        double downloadRate;
+        /* Round-trip times in microseconds */
+        qint64 rttMin, rttMedian, rttP90, rttMax;
+        /* Mean difference between consecutive RTT samples, in microseconds */
+        double jitter;
+    };
+
+    ContactUser * const user;
+
+    explicit ConnectionProbe(ContactUser *user, QObject *parent = 0);
+
+    bool isRunning() const { return !m_pending.isEmpty(); }
+    /* True once a probe has finished; result() is of the last one */
+    bool hasResult() const { return m_hasResult; }
+
+    /* Returns false if the contact is not connected or a probe is already running */
+    bool start(int bursts = 4, int probesPerBurst = 8, int requestSize = 1024, int replySize = 16384);
+    void cancel();
+
+    Result result() const { return m_result; }
+    /* Round-trip times of successful probes in microseconds, in order of arrival */
+    QList<qint64> samples() const { return m_samples; }
+
+signals:
+    void finished();
+
+private slots:
+    void probeFinished();
+
+private:
+    QElapsedTimer m_time;
+    QList<qint64> m_samples;
+    QList<QPointer<ProbeCommand> > m_pending;
+    Result m_result;
+    bool m_hasResult;
+    int m_burstsLeft, m_probesPerBurst;
+    int m_requestSize, m_replySize;
+
+    void sendBurst();
+    void computeResult();
+};
+
+#endif // CONNECTIONPROBE_H
@@ -36,16 +36,19 @@
 #include "IncomingSocket.h"
 #include "CommandDataParser.h"
 #include "ProtocolConstants.h"
+#include "RequestPuzzle.h"
 #include "tor/HiddenService.h"
 #include "tor/TorSocket.h"
 #include "utils/CryptoKey.h"
+#include "utils/CryptoService.h"
 #include <QNetworkProxy>
 #include <QtEndian>
 #include <QTimer>
+#include <QtConcurrentRun>
 #include <QDebug>
 
 ContactRequestClient::ContactRequestClient(ContactUser *u)
-    : QObject(u), user(u), socket(0), m_response(NoResponse), state(NotConnected)
+    : QObject(u), user(u), socket(0), m_puzzle(0), m_cryptoJob(0), m_response(NoResponse), state(NotConnected)
 {
 }
 
@@ -69,6 +72,22 @@ void ContactRequestClient::close()
         socket = 0;
     }
 
+    if (m_puzzle)
+    {
+        /* The solver can't be interrupted; it finishes and is thrown away */
+        m_puzzle->disconnect(this);
+        connect(m_puzzle, SIGNAL(finished()), m_puzzle, SLOT(deleteLater()));
+        if (m_puzzle->isFinished())
+            m_puzzle->deleteLater();
+        m_puzzle = 0;
+    }
+
+    delete m_cryptoJob;
+    m_cryptoJob = 0;
+
+    m_cookie.clear();
+    m_nonce.clear();
+    m_requestData.clear();
     state = NotConnected;
 }
 
@@ -119,13 +138,24 @@ void ContactRequestClient::socketReadable()
         if (socket->bytesAvailable() < Protocol::RequestCookieSize)
             return;
 
-        if (!buildRequestData(socket->read(Protocol::RequestCookieSize)))
+        m_cookie = socket->read(Protocol::RequestCookieSize);
+        if (RequestPuzzle::difficulty(m_cookie))
+        {
+            qDebug() << "Contact request for" << user->uniqueID << "solving puzzle of difficulty"
+                     << RequestPuzzle::difficulty(m_cookie);
+            m_puzzle = new QFutureWatcher<QByteArray>(this);
+            connect(m_puzzle, SIGNAL(finished()), SLOT(puzzleSolved()));
+            m_puzzle->setFuture(QtConcurrent::run(&RequestPuzzle::solve, m_cookie, user->localSecret()));
+            state = SolvingPuzzle;
+            return;
+        }
+
+        if (!loadServiceKey())
         {
             socket->close();
             return;
         }
 
-        state = WaitAck;
         break;
 
     case WaitAck:
@@ -143,23 +173,51 @@ void ContactRequestClient::socketReadable()
     }
 }
 
-bool ContactRequestClient::buildRequestData(QByteArray cookie)
+void ContactRequestClient::puzzleSolved()
+{
+    m_nonce = m_puzzle->result();
+    m_puzzle->deleteLater();
+    m_puzzle = 0;
+
+    if (state != SolvingPuzzle || !socket)
+        return;
+
+    if (m_nonce.isEmpty() || !loadServiceKey())
+        socket->close();
+}
+
+bool ContactRequestClient::loadServiceKey()
 {
-    /* [2*length][16*hostname][16*serverCookie][16*connSecret][data:pubkey][str:nick][str:message][data:signature] */
-    QByteArray requestData;
-    CommandDataParser request(&requestData);
+    /* The service keeps its key loaded; signing runs on the crypto workers */
+    Tor::HiddenService *service = user->identity->hiddenService();
+    CryptoKey serviceKey;
+    if (!service || !(serviceKey = service->cryptoKey()).isLoaded())
+    {
+        qWarning() << "Cannot send contact request: failed to load service key";
+        return false;
+    }
+
+    return buildRequestData(serviceKey);
+}
+
+bool ContactRequestClient::buildRequestData(const CryptoKey &serviceKey)
+{
+    /* [2*length][16 or 56*hostname][16*serverCookie][16*connSecret][data:pubkey][str:nick][str:message][data:signature]
+     * followed by [8*nonce] if the cookie has a puzzle */
+    m_requestData.clear();
+    CommandDataParser request(&m_requestData);
 
     /* Hostname */
     QString hostname = user->hostname();
     hostname.truncate(hostname.lastIndexOf(QLatin1Char('.')));
-    if (hostname.size() != 16)
+    if (hostname.size() != 16 && hostname.size() != 56)
     {
         qWarning() << "Cannot send contact request: unable to determine the remote service hostname";
         return false;
     }
 
     /* Connection secret */
-    QByteArray connSecret = user->readSetting("localSecret").toByteArray();
+    QByteArray connSecret = user->localSecret();
     if (connSecret.size() != 16)
     {
         qWarning() << "Cannot send contact request: invalid local secret";
@@ -167,14 +225,6 @@ bool ContactRequestClient::buildRequestData(QByteArray cookie)
     }
 
     /* Public service key */
-    Tor::HiddenService *service = user->identity->hiddenService();
-    CryptoKey serviceKey;
-    if (!service || !(serviceKey = service->cryptoKey()).isLoaded())
-    {
-        qWarning() << "Cannot send contact request: failed to load service key";
-        return false;
-    }
-
     QByteArray publicKeyData = serviceKey.encodedPublicKey();
     if (publicKeyData.isNull())
     {
@@ -185,7 +235,7 @@ bool ContactRequestClient::buildRequestData(QByteArray cookie)
     /* Build request */
     request << (quint16)0; /* placeholder for length */
     request.writeFixedData(hostname.toLatin1());
-    request.writeFixedData(cookie);
+    request.writeFixedData(m_cookie);
     request.writeFixedData(connSecret);
     request.writeVariableData(publicKeyData);
     request << myNickname() << message();
@@ -197,30 +247,53 @@ bool ContactRequestClient::buildRequestData(QByteArray cookie)
     }
 
     /* Sign request, excluding the length field */
-    QByteArray signature = serviceKey.signData(requestData.mid(2));
+    m_cryptoJob = CryptoService::instance()->sign(serviceKey, m_requestData.mid(2), this);
+    if (!m_cryptoJob)
+        return false;
+
+    connect(m_cryptoJob, SIGNAL(finished()), SLOT(requestSigned()));
+    state = Signing;
+    return true;
+}
+
+void ContactRequestClient::requestSigned()
+{
+    QByteArray signature = m_cryptoJob->signature();
+    m_cryptoJob->deleteLater();
+    m_cryptoJob = 0;
+
+    if (state != Signing || !socket)
+        return;
+
     if (signature.isNull())
     {
         qWarning() << "Cannot send contact request: failed to sign request";
-        return false;
+        socket->close();
+        return;
     }
 
+    CommandDataParser request(&m_requestData);
     request.writeVariableData(signature);
+    if (!m_nonce.isEmpty())
+        request.writeFixedData(m_nonce);
     if (request.hasError())
     {
         qWarning() << "Cannot send contact request: command building failed";
-        return false;
+        socket->close();
+        return;
     }
 
     /* Set length */
-    qToBigEndian((quint16)requestData.size(), reinterpret_cast<uchar*>(requestData.data()));
+    qToBigEndian((quint16)m_requestData.size(), reinterpret_cast<uchar*>(m_requestData.data()));
 
     /* Send */
-    qint64 re = socket->write(requestData);
-    Q_ASSERT(re == requestData.size());
+    qint64 re = socket->write(m_requestData);
+    Q_ASSERT(re == m_requestData.size());
     Q_UNUSED(re);
+    m_requestData.clear();
 
     qDebug() << "Contact request for" << user->uniqueID << "sent request data";
-    return true;
+    state = WaitAck;
 }
 
 bool ContactRequestClient::handleResponse()
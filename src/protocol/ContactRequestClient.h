@@ -34,8 +34,11 @@
 #define CONTACTREQUESTCLIENT_H
 
 #include <QObject>
+#include <QFutureWatcher>
 
 class ContactUser;
+class CryptoJob;
+class CryptoKey;
 
 namespace Tor {
     class TorSocket;
@@ -83,9 +86,18 @@ signals:
 private slots:
     void socketConnected();
     void socketReadable();
+    void puzzleSolved();
+    void requestSigned();
 
 private:
     Tor::TorSocket *socket;
+    /* Solving the server's puzzle in the background; see RequestPuzzle */
+    QFutureWatcher<QByteArray> *m_puzzle;
+    QByteArray m_cookie, m_nonce;
+    /* Signing the request; see CryptoService */
+    CryptoJob *m_cryptoJob;
+    /* Unsigned request while it's being signed */
+    QByteArray m_requestData;
     QString m_message, m_mynick;
     Response m_response;
 
@@ -94,11 +106,14 @@ private:
         NotConnected,
         WaitConnect,
         WaitCookie,
+        SolvingPuzzle,
+        Signing,
         WaitAck,
         WaitResponse
     } state;
 
-    bool buildRequestData(QByteArray cookie);
+    bool loadServiceKey();
+    bool buildRequestData(const CryptoKey &serviceKey);
     bool handleResponse();
 };
 
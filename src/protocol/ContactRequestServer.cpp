@@ -32,35 +32,28 @@
 
 #include "ContactRequestServer.h"
 #include "CommandDataParser.h"
+#include "RequestPuzzle.h"
 #include "utils/CryptoKey.h"
-#include "utils/SecureRNG.h"
+#include "utils/CryptoService.h"
 #include "core/UserIdentity.h"
 #include "core/ContactsManager.h"
 #include "core/IncomingRequestManager.h"
-#include <QElapsedTimer>
 #include <QTcpSocket>
 #include <QtEndian>
 #include <QDebug>
 
-ContactRequestServer::ContactRequestServer(UserIdentity *id, QTcpSocket *s)
-    : identity(id), socket(s), state(WaitRequest)
+/* Seconds an acknowledged request stays connected for the user's response; the
+ * request is kept either way, and can be answered by connecting to the contact */
+static const int ResponseTimeout = 10 * 60;
+
+ContactRequestServer::ContactRequestServer(UserIdentity *id, QTcpSocket *s, qint64 elapsed, bool puzzle)
+    : identity(id), socket(s), timeout(this, "close()"), requirePuzzle(puzzle), verifyJob(0), state(WaitRequest)
 {
     socket->setParent(this);
     connect(socket, SIGNAL(readyRead()), this, SLOT(socketReadable()));
     connect(socket, SIGNAL(disconnected()), this, SLOT(socketDisconnected()));
 
-    QElapsedTimer now;
-    now.start();
-    qint64 elapsed = socket->property("startTime").toLongLong();
-    if (!elapsed)
-        elapsed = 0;
-    else
-        elapsed = now.msecsSinceReference() - elapsed;
-
-    timeout = new QTimer(this);
-    timeout->setSingleShot(true);
-    timeout->start(15000 - elapsed);
-    connect(timeout, SIGNAL(timeout()), SLOT(close()));
+    timeout.start(int(qMax(Q_INT64_C(0), 15000 - elapsed)));
 
     qDebug() << "Contact request connection created; sending cookie";
     sendCookie();
@@ -79,8 +72,11 @@ void ContactRequestServer::socketDisconnected()
 
 void ContactRequestServer::sendCookie()
 {
-    cookie = SecureRNG::random(16);
-    if (cookie.size() != 16) {
+    int difficulty = RequestPuzzle::currentDifficulty();
+    if (requirePuzzle)
+        difficulty = qMax(difficulty, int(RequestPuzzle::MinDifficulty));
+    cookie = RequestPuzzle::createCookie(difficulty);
+    if (cookie.size() != Protocol::RequestCookieSize) {
         close();
         return;
     }
@@ -172,20 +168,26 @@ void ContactRequestServer::handleRequest(const QByteArray &data)
         return;
     }
 
-    /* [2*length][16*hostname][16*serverCookie][16*connSecret][data:pubkey][str:nick][str:message][data:signature] */
+    /* [2*length][16 or 56*hostname][16*serverCookie][16*connSecret][data:pubkey][str:nick][str:message][data:signature]
+     * followed by [8*nonce] if the cookie has a puzzle */
     CommandDataParser request(&data);
     request.setPos(2);
 
-    QByteArray hostname, receivedCookie, connSecret, encodedPublicKey, signature;
-    QString nickname, message;
+    QByteArray hostname, receivedCookie, encodedPublicKey, signature, nonce;
+
+    /* The hostname field is as long as our own, which depends on the service version */
+    QByteArray ownHostname = identity->hostname().toLatin1();
+    ownHostname.chop(6);
 
-    request.readFixedData(&hostname, 16);
+    request.readFixedData(&hostname, ownHostname.size());
     request.readFixedData(&receivedCookie, 16);
     request.readFixedData(&connSecret, 16);
     request.readVariableData(&encodedPublicKey);
     request >> nickname >> message;
     int signaturePos = request.pos();
     request.readVariableData(&signature);
+    if (RequestPuzzle::difficulty(cookie))
+        request.readFixedData(&nonce, RequestPuzzle::NonceSize);
 
     if (request.hasError()) {
         qDebug() << "Incoming contact request syntax error; rejecting";
@@ -194,22 +196,48 @@ void ContactRequestServer::handleRequest(const QByteArray &data)
     }
 
     /* Verify serverHostname and serverCookie */
-    if (hostname != identity->hostname().mid(0, 16).toLatin1() || receivedCookie != cookie) {
+    if (ownHostname.isEmpty() || hostname != ownHostname || receivedCookie != cookie) {
         qDebug() << "Incoming contact request has invalid hostname/cookie; rejecting";
         sendResponse(0x81);
         return;
     }
 
-    /* Load the public key */
-    CryptoKey key;
-    if (!key.loadFromData(encodedPublicKey)) {
+    /* Check the proof of work, which is cheap for us, before any public key operations */
+    if (!RequestPuzzle::verify(cookie, connSecret, nonce)) {
+        qDebug() << "Incoming contact request has an invalid puzzle solution; rejecting";
+        sendResponse(0x81);
+        return;
+    }
+
+    /* Load the public key and verify the signature on the crypto workers */
+    verifyJob = CryptoService::instance()->verify(encodedPublicKey, data.mid(2, signaturePos - 2), signature, this);
+    if (!verifyJob) {
+        qDebug() << "Too many contact requests waiting for verification; rejecting";
+        sendResponse(0x81);
+        return;
+    }
+
+    connect(verifyJob, SIGNAL(finished()), SLOT(requestVerified()));
+    state = Verifying;
+}
+
+void ContactRequestServer::requestVerified()
+{
+    CryptoKey key = verifyJob->key();
+    bool ok = verifyJob->isOk();
+    verifyJob->deleteLater();
+    verifyJob = 0;
+
+    if (state != Verifying)
+        return;
+
+    if (!key.isLoaded()) {
         qDebug() << "Incoming contact request has an unparsable public key; rejecting";
         sendResponse(0x81);
         return;
     }
 
-    /* Verify the signature */
-    if (!key.verifySignature(data.mid(2, signaturePos - 2), signature)) {
+    if (!ok) {
         qDebug() << "Incoming contact request has an invalid signature; rejecting";
         sendResponse(0x81);
         return;
@@ -233,9 +261,9 @@ void ContactRequestServer::handleRequest(const QByteArray &data)
     /* Acknowledgement */
     sendResponse(0x00);
 
-    /* We are now waiting for acceptance from the user; connection is held open. */
-    timeout->stop();
+    /* We are now waiting for acceptance from the user; connection is held open for a while. */
+    timeout.start(ResponseTimeout * 1000);
     state = WaitResponse;
-    return;
+    emit acknowledged();
 }
 
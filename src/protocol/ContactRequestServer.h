@@ -34,11 +34,12 @@
 #define CONTACTREQUESTSERVER_H
 
 #include <QObject>
-#include <QTimer>
+#include "utils/TimerWheel.h"
 
 class QTcpSocket;
 class ContactUser;
 class UserIdentity;
+class CryptoJob;
 
 /* Incoming connection with a purpose of 0x80 (contact request) */
 class ContactRequestServer : public QObject
@@ -49,7 +50,14 @@ class ContactRequestServer : public QObject
 public:
     UserIdentity * const identity;
 
-    explicit ContactRequestServer(UserIdentity *identity, QTcpSocket *socket);
+    /* elapsed is the milliseconds since the connection was accepted; with requirePuzzle,
+     * the cookie has a puzzle regardless of the current load */
+    explicit ContactRequestServer(UserIdentity *identity, QTcpSocket *socket, qint64 elapsed = 0,
+                                  bool requirePuzzle = false);
+
+signals:
+    /* The request was verified and acknowledged, and waits for the user's response */
+    void acknowledged();
 
 public slots:
     void sendAccept(ContactUser *user);
@@ -59,15 +67,22 @@ public slots:
 private slots:
     void socketReadable();
     void socketDisconnected();
+    void requestVerified();
 
 private:
     QTcpSocket * const socket;
-    QTimer *timeout;
+    WheelSlotTimer timeout;
     QByteArray cookie;
+    bool requirePuzzle;
+    /* Signature check of the received request, and the fields needed once it's done */
+    CryptoJob *verifyJob;
+    QByteArray connSecret;
+    QString nickname, message;
 
     enum
     {
         WaitRequest,
+        Verifying,
         WaitResponse,
         SentResponse
     } state;
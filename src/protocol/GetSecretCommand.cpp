@@ -52,7 +52,7 @@ void GetSecretCommand::send(ProtocolSocket *to)
 
 void GetSecretCommand::process(CommandHandler &command)
 {
-    QByteArray secret = command.user->readSetting("localSecret").toByteArray();
+    QByteArray secret = command.user->localSecret();
     if (secret.size() != 16)
     {
         command.sendReply(Protocol::InternalError);
@@ -71,5 +71,5 @@ void GetSecretCommand::processReply(quint8 state, const uchar *data, unsigned da
 
     qDebug() << "Setting remote secret for user" << user->uniqueID << "from command response";
 
-    user->writeSetting("remoteSecret", QByteArray((const char*)data, dataSize));
+    user->setRemoteSecret(QByteArray((const char*)data, dataSize));
 }
@@ -34,17 +34,56 @@
 #include "core/UserIdentity.h"
 #include "core/ContactsManager.h"
 #include "ContactRequestServer.h"
+#include "RequestPuzzle.h"
+#include "utils/TimerWheel.h"
 #include <QTcpServer>
 #include <QTcpSocket>
 #include <QElapsedTimer>
 #include <QtDebug>
 
+/* Seconds a connection may take to complete the introduction */
+static const int IntroTimeout = 10;
+/* Beyond this many connections in the introduction, one is closed for each new one */
+static const int MaxPendingSockets = 256;
+/* Contact request connections are admitted at this rate per second, with bursts of the
+ * capacity, and only up to a limit at once until they're verified; beyond the rate, they
+ * must solve a puzzle. Contacts authenticating aren't limited. All connections come from
+ * the local Tor instance, so there is no source address to limit by. */
+static const double RequestRate = 0.5;
+static const double RequestBurst = 10;
+static const int MaxRequestConnections = 64;
+/* Longest possible intro: identifier, version count, 255 versions, purpose, and secret */
+static const int MaxIntroSize = 3 + 255 + 1 + 16;
+
+/* Handshake state of a connection that hasn't finished the introduction */
+struct IncomingSocket::PendingSocket : public WheelTimer
+{
+    IncomingSocket *owner;
+    QTcpSocket *socket;
+    QElapsedTimer started;
+    PendingKey order;
+    /* Negotiated protocol version, or 0 until negotiated */
+    uchar version;
+
+    virtual void timeout()
+    {
+        /* time is up. */
+        owner->removeSocket(socket);
+    }
+};
+
 IncomingSocket::IncomingSocket(UserIdentity *id, QObject *parent)
-    : QObject(parent), identity(id), server(new QTcpServer(this))
+    : QObject(parent), identity(id), server(new QTcpServer(this)), pendingSerial(0)
+    , requestBucket(RequestRate, RequestBurst), requestConnections(0)
 {
     connect(server, SIGNAL(newConnection()), this, SLOT(incomingConnection()));
 }
 
+IncomingSocket::~IncomingSocket()
+{
+    qDeleteAll(pendingSockets);
+}
+
 bool IncomingSocket::listen(const QHostAddress &address, quint16 port)
 {
     if (server->isListening())
@@ -73,20 +112,45 @@ void IncomingSocket::incomingConnection()
     while (server->hasPendingConnections())
     {
         QTcpSocket *conn = server->nextPendingConnection();
+        if (pendingSockets.size() >= MaxPendingSockets)
+            removeOldestPending();
+
         conn->setParent(this);
         connect(conn, SIGNAL(readyRead()), this, SLOT(readSocket()));
         connect(conn, SIGNAL(disconnected()), this, SLOT(removeSocket()));
 
-        QElapsedTimer time;
-        time.start();
-        conn->setProperty("startTime", time.msecsSinceReference());
-        pendingSockets.append(conn);
-
-        if (!expireTimer.isActive())
-            expireTimer.start(11000, this);
+        PendingSocket *pending = new PendingSocket;
+        pending->owner = this;
+        pending->socket = conn;
+        pending->started.start();
+        pending->order = PendingKey(false, pendingSerial++);
+        pending->version = 0;
+        pending->start(IntroTimeout * 1000);
+        pendingSockets.insert(conn, pending);
+        pendingOrder.insert(pending->order, pending);
     }
 }
 
+/* Accepting continues under load, so contacts can always get through; a stalled
+ * connection makes room for a new one instead of holding its place until timeout.
+ * Connections that haven't identified themselves as a contact authenticating go
+ * first, oldest first, so a flood of connections can't push out contacts. */
+void IncomingSocket::removeOldestPending()
+{
+    if (!pendingOrder.isEmpty())
+        removeSocket(pendingOrder.begin().value()->socket);
+}
+
+void IncomingSocket::forgetPending(QTcpSocket *socket)
+{
+    PendingSocket *pending = pendingSockets.take(socket);
+    if (!pending)
+        return;
+
+    pendingOrder.remove(pending->order);
+    delete pending;
+}
+
 void IncomingSocket::removeSocket(QTcpSocket *socket)
 {
     if (!socket)
@@ -98,96 +162,84 @@ void IncomingSocket::removeSocket(QTcpSocket *socket)
 
     qDebug() << "Disconnecting pending socket";
 
-    pendingSockets.removeOne(socket);
+    forgetPending(socket);
 
     socket->disconnect(this);
     socket->close();
     socket->deleteLater();
 }
 
-void IncomingSocket::timerEvent(QTimerEvent *)
+/* Acknowledged requests wait on their own timeout, and no longer count */
+void IncomingSocket::requestAcknowledged()
 {
-    QElapsedTimer now;
-    now.start();
-
-    for (int i = 0; i < pendingSockets.size(); ++i)
-    {
-        qint64 started = pendingSockets[i]->property("startTime").toLongLong();
-        if (now.msecsSinceReference() - started >= 10000)
-        {
-            /* time is up. */
-            removeSocket(pendingSockets[i]);
-            --i;
-        }
-    }
+    requestConnections--;
+    disconnect(sender(), SIGNAL(destroyed()), this, SLOT(requestConnectionClosed()));
+}
 
-    if (pendingSockets.isEmpty())
-        expireTimer.stop();
+void IncomingSocket::requestConnectionClosed()
+{
+    requestConnections--;
 }
 
 void IncomingSocket::readSocket()
 {
     QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
-    if (!socket)
+    PendingSocket *pending = pendingSockets.value(socket);
+    if (!pending)
         return;
 
-    QVariant versionProp = socket->property("protocolVersion");
+    /* Version and intro are parsed in one pass over a peek of the buffered data,
+     * and only consumed from the socket once each is complete. */
+    uchar buffer[MaxIntroSize];
+    qint64 available = socket->peek(reinterpret_cast<char*>(buffer), sizeof(buffer));
+    if (available <= 0)
+        return;
 
-    if (versionProp.isNull())
+    int offset = 0;
+    if (!pending->version)
     {
-        if (!handleVersion(socket))
+        offset = handleVersion(pending, buffer, int(available));
+        if (offset <= 0)
             return;
-        versionProp = socket->property("protocolVersion");
-
-        if (versionProp.isNull())
-        {
-            Q_ASSERT_X(false, "IncomingConnection::handleVersion", "version property not properly set");
-            return;
-        }
     }
 
-    handleIntro(socket, (uchar)versionProp.toUInt());
+    handleIntro(pending, buffer + offset, int(available) - offset);
 }
 
-bool IncomingSocket::handleVersion(QTcpSocket *socket)
+/* Returns the length of the version negotiation, 0 if incomplete, or -1 if the socket was rejected */
+int IncomingSocket::handleVersion(PendingSocket *pending, const uchar *data, int size)
 {
     /* 0x49 0x4D [numversions] (numversions * version) */
-    qint64 available = socket->bytesAvailable();
-
-    if (available < 3)
-        return false;
+    if (size < 3)
+        return 0;
 
-    /* Peek for the identifier and version count */
-    uchar intro[3];
-    qint64 re = socket->peek(reinterpret_cast<char*>(intro), 3);
-    if (re < 3)
-        return false;
-
-    if (intro[0] != 0x49 || intro[1] != 0x4D || intro[2] == 0)
+    if (data[0] != 0x49 || data[1] != 0x4D || data[2] == 0)
     {
         qDebug() << "Connection rejected: incorrect introduction sequence";
-        removeSocket(socket);
-        return false;
+        removeSocket(pending->socket);
+        return -1;
     }
 
     /* Stop and wait if the full list of supported versions is not here */
-    if (available < (intro[2] + 3))
-        return false;
-
-    QByteArray versions = socket->read(intro[2] + 3);
-    Q_ASSERT(versions.size() == intro[2] + 3);
+    int length = data[2] + 3;
+    if (size < length)
+        return 0;
 
     /* Only one version is supported right now (protocolVersion). 0xff is the reserved failure code. */
     uchar version = 0xff;
-    for (int i = 3; i < versions.size(); ++i)
+    for (int i = 3; i < length; ++i)
     {
-        if ((uchar)versions[i] == Protocol::ProtocolVersion)
+        if (data[i] == Protocol::ProtocolVersion)
         {
             version = Protocol::ProtocolVersion;
             break;
         }
     }
 
+    QTcpSocket *socket = pending->socket;
+    char discard[3 + 255];
+    socket->read(discard, length);
+
     /* Send the version response */
     socket->write(reinterpret_cast<char*>(&version), 1);
 
@@ -195,36 +247,41 @@ bool IncomingSocket::handleVersion(QTcpSocket *socket)
     {
         qDebug() << "Connection rejected: no mutually supported protocol version";
         removeSocket(socket);
-        return false;
+        return -1;
     }
 
-    /* Set the version property (used for the rest of the intro) */
-    socket->setProperty("protocolVersion", QVariant((unsigned)version));
-
-    return true;
+    pending->version = version;
+    return length;
 }
 
-void IncomingSocket::handleIntro(QTcpSocket *socket, uchar version)
+void IncomingSocket::handleIntro(PendingSocket *pending, const uchar *data, int size)
 {
-    Q_ASSERT(version == Protocol::ProtocolVersion);
-    Q_UNUSED(version);
+    Q_ASSERT(pending->version == Protocol::ProtocolVersion);
 
-    /* Peek at the purpose; can't be a read as this may be called repeatedly until it's ready */
-    uchar purpose;
-    if (socket->peek(reinterpret_cast<char*>(&purpose), 1) < 1)
+    /* The purpose is only consumed with the rest of the intro, as this may be called repeatedly until it's ready */
+    if (size < 1)
         return;
 
+    QTcpSocket *socket = pending->socket;
+    uchar purpose = data[0];
+    char discard[1 + 16];
+
     if (purpose == Protocol::PurposePrimary)
     {
-        /* Wait until the auth data is available */
-        quint64 available = socket->bytesAvailable();
-        if (available < 16)
+        /* Wait until the auth data is available, ahead of unidentified connections for eviction */
+        if (size < 17)
+        {
+            if (!pending->order.first)
+            {
+                pendingOrder.remove(pending->order);
+                pending->order.first = true;
+                pendingOrder.insert(pending->order, pending);
+            }
             return;
+        }
 
-        QByteArray secret = socket->read(17);
-        /* Remove purpose */
-        secret.remove(0, 1);
-        Q_ASSERT(secret.size() == 16);
+        QByteArray secret(reinterpret_cast<const char*>(data) + 1, 16);
+        socket->read(discard, 17);
 
         ContactUser *user = identity->contacts.lookupSecret(secret);
 
@@ -247,7 +304,7 @@ void IncomingSocket::handleIntro(QTcpSocket *socket, uchar version)
         response = 0x00;
         socket->write(&response, 1);
 
-        pendingSockets.removeOne(socket);
+        forgetPending(socket);
         socket->disconnect(this);
 
         /* The protocolmanager also takes ownership */
@@ -256,18 +313,29 @@ void IncomingSocket::handleIntro(QTcpSocket *socket, uchar version)
     }
     else if (purpose == Protocol::PurposeContactReq)
     {
-        /* Incoming contact request connection */
+        /* Incoming contact request connection; every attempt counts toward the load,
+         * and without a token, only a puzzle solution earns admission */
+        RequestPuzzle::recordRequest();
+        if (requestConnections >= MaxRequestConnections)
+        {
+            qDebug() << "Connection rejected: too many contact requests";
+            removeSocket(socket);
+            return;
+        }
+        bool requirePuzzle = !requestBucket.take();
 
         /* Read purpose */
-        int ok = socket->read(1).size();
-        Q_ASSERT(ok);
-        Q_UNUSED(ok);
+        socket->read(discard, 1);
 
-        /* Pass to ContactRequestServer */
-        pendingSockets.removeOne(socket);
+        /* Pass to ContactRequestServer, with the time left of the introduction's */
+        qint64 elapsed = pending->started.elapsed();
+        forgetPending(socket);
         socket->disconnect(this);
 
-        new ContactRequestServer(identity, socket);
+        ContactRequestServer *request = new ContactRequestServer(identity, socket, elapsed, requirePuzzle);
+        requestConnections++;
+        connect(request, SIGNAL(destroyed()), SLOT(requestConnectionClosed()));
+        connect(request, SIGNAL(acknowledged()), SLOT(requestAcknowledged()));
         Q_ASSERT(socket->parent() != this);
     }
     else
@@ -35,9 +35,11 @@
 
 #include <QObject>
 #include <QHostAddress>
-#include <QList>
-#include <QBasicTimer>
+#include <QHash>
+#include <QMap>
+#include <QPair>
 #include "ProtocolConstants.h"
+#include "utils/TokenBucket.h"
 
 class QTcpServer;
 class QTcpSocket;
@@ -52,6 +54,7 @@ public:
     UserIdentity * const identity;
 
     explicit IncomingSocket(UserIdentity *identity, QObject *parent = 0);
+    virtual ~IncomingSocket();
 
     bool listen(const QHostAddress &address, quint16 port);
     QString errorString() const;
@@ -67,17 +70,29 @@ private slots:
 
     void readSocket();
     void removeSocket(QTcpSocket *socket = 0);
-
-protected:
-    virtual void timerEvent(QTimerEvent *);
+    void requestAcknowledged();
+    void requestConnectionClosed();
 
 private:
+    struct PendingSocket;
+    /* Whether the connection is a contact authenticating, then arrival order; see removeOldestPending */
+    typedef QPair<bool,quint64> PendingKey;
+
     QTcpServer *server;
-    QList<QTcpSocket*> pendingSockets;
-    QBasicTimer expireTimer;
+    /* Connections that haven't finished the introduction, each with a timeout */
+    QHash<QTcpSocket*,PendingSocket*> pendingSockets;
+    QMap<PendingKey,PendingSocket*> pendingOrder;
+    quint64 pendingSerial;
+    /* Admission of contact request connections, which are costly and open to anyone */
+    TokenBucket requestBucket;
+    /* Contact request connections that haven't been verified and acknowledged */
+    int requestConnections;
+
+    void removeOldestPending();
+    void forgetPending(QTcpSocket *socket);
 
-    bool handleVersion(QTcpSocket *socket);
-    void handleIntro(QTcpSocket *socket, uchar version);
+    int handleVersion(PendingSocket *pending, const uchar *data, int size);
+    void handleIntro(PendingSocket *pending, const uchar *data, int size);
 };
 
 #endif // INCOMINGSOCKET_H
@@ -36,11 +36,10 @@
 OutgoingContactSocket::OutgoingContactSocket(QObject *parent)
     : QObject(parent)
     , m_socket(0)
+    , m_authTimeout(this, "onTimeout()")
     , m_purpose(Protocol::PurposePrimary)
+    , m_lastActivity(0)
 {
-    m_authTimeout.setInterval(10000);
-    m_authTimeout.setSingleShot(true);
-    connect(&m_authTimeout, SIGNAL(timeout()), SLOT(onTimeout()));
 }
 
 void OutgoingContactSocket::setAuthentication(Protocol::Purpose purpose, const QByteArray &secret)
@@ -57,6 +56,7 @@ void OutgoingContactSocket::connectToHost(const QString &hostname, quint16 port)
         disconnect();
 
     m_socket = new Tor::TorSocket(this);
+    m_socket->setLastActivity(m_lastActivity);
     connect(m_socket, SIGNAL(connected()), SLOT(onConnected()));
     connect(m_socket, SIGNAL(readyRead()), SLOT(onReadable()));
     m_socket->connectToHost(hostname, port);
@@ -73,6 +73,19 @@ void OutgoingContactSocket::disconnect()
     m_authTimeout.stop();
 }
 
+void OutgoingContactSocket::setLastActivity(qint64 msecs)
+{
+    m_lastActivity = msecs;
+    if (m_socket)
+        m_socket->setLastActivity(msecs);
+}
+
+void OutgoingContactSocket::reconnectNow()
+{
+    if (m_socket)
+        m_socket->reconnectNow();
+}
+
 void OutgoingContactSocket::onConnected()
 {
     QByteArray intro = IncomingSocket::introData(m_purpose);
@@ -83,7 +96,7 @@ void OutgoingContactSocket::onConnected()
     intro.append(m_secret);
 
     m_socket->write(intro);
-    m_authTimeout.start();
+    m_authTimeout.start(10000);
 }
 
 void OutgoingContactSocket::onDisconnected()
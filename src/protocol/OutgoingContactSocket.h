@@ -35,7 +35,7 @@
 
 #include "tor/TorSocket.h"
 #include "ProtocolConstants.h"
-#include <QTimer>
+#include "utils/TimerWheel.h"
 
 /* Establish a socket with a peer (via Tor), with automatic retries provided
  * by TorSocket, negotiate protocol, and authenticate as a contact.
@@ -54,6 +54,11 @@ public:
     void connectToHost(const QString &hostname, quint16 port);
     void disconnect();
 
+    /* Passed to the socket; see Tor::TorSocket::setLastActivity */
+    void setLastActivity(qint64 msecs);
+    /* Retry now if waiting to reconnect */
+    void reconnectNow();
+
     bool isAuthenticationPending() const { return m_authTimeout.isActive(); }
 
 signals:
@@ -69,9 +74,10 @@ private slots:
 
 private:
     Tor::TorSocket *m_socket;
-    QTimer m_authTimeout;
+    WheelSlotTimer m_authTimeout;
     Protocol::Purpose m_purpose;
     QByteArray m_secret;
+    qint64 m_lastActivity;
 };
 
 #endif
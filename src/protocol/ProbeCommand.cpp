@@ -0,0 +1,145 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ProbeCommand.h"
+#include "CommandDataParser.h"
+#include "ProtocolConstants.h"
+#include "core/ContactUser.h"
+#include <QtEndian>
+#include <QDebug>
+
+REGISTER_COMMAND_HANDLER(0x02, ProbeCommand)
+
+/* [4*timestamp][2*replySize] */
+static const int probeHeaderSize = 6;
+static const int maxReplySize = Protocol::MaxCommandData - 4;
+
+ProbeCommand::ProbeCommand(QObject *parent)
+    : ProtocolCommand(parent)
+    , m_roundTripTime(-1)
+    , m_timestamp(0)
+    , m_requestSize(0)
+    , m_replySize(0)
+    , m_finalReplyState(0)
+{
+}
+
+bool ProbeCommand::isRateLimited() const
+{
+    return m_finalReplyState == Protocol::replyState(false, true, RateLimited);
+}
+
+void ProbeCommand::send(ProtocolSocket *to, quint32 timestamp, int requestSize, int replySize)
+{
+    m_timestamp = timestamp;
+    m_requestSize = qBound(probeHeaderSize, requestSize, int(Protocol::MaxCommandData));
+    m_replySize = qBound(0, replySize, maxReplySize);
+
+    int dataPos = prepareCommand(Protocol::commandState(0), m_requestSize);
+    CommandDataParser builder(&commandBuffer);
+    builder << m_timestamp << quint16(m_replySize);
+    commandBuffer.append(QByteArray(m_requestSize - probeHeaderSize, '\0'));
+    Q_ASSERT(commandBuffer.size() - dataPos == m_requestSize);
+
+    m_sentTime.start();
+    sendCommand(to);
+}
+
+/* Token bucket per contact, so a peer can't turn us into a traffic amplifier */
+bool ProbeCommand::takeBudget(ContactUser *user, int size)
+{
+    if (!user->m_probeBudgetTime.isValid()) {
+        user->m_probeBudgetTime.start();
+        user->m_probeBudget = BudgetBurst;
+    } else {
+        qint64 elapsed = user->m_probeBudgetTime.restart();
+        user->m_probeBudget = qMin(user->m_probeBudget + (elapsed * BudgetPerSecond) / 1000,
+                                   qint64(BudgetBurst));
+    }
+
+    if (user->m_probeBudget < size)
+        return false;
+
+    user->m_probeBudget -= size;
+    return true;
+}
+
+void ProbeCommand::process(CommandHandler &command)
+{
+    quint32 timestamp;
+    quint16 replySize;
+
+    CommandDataParser parser(&command.data);
+    parser >> timestamp >> replySize;
+    if (!parser)
+    {
+        command.sendReply(Protocol::CommandSyntaxError);
+        return;
+    }
+
+    int size = qMin(int(replySize), maxReplySize);
+    if (!takeBudget(command.user, command.data.size() + size))
+    {
+        qDebug() << "Rejecting probe from contact" << command.user->uniqueID << "due to rate limit";
+        command.sendReply(Protocol::replyState(false, true, RateLimited));
+        return;
+    }
+
+    QByteArray reply;
+    reply.reserve(4 + size);
+    CommandDataParser builder(&reply);
+    builder << timestamp;
+    reply.append(QByteArray(size, '\0'));
+
+    command.sendReply(Protocol::replyState(true, true, 0), reply);
+}
+
+void ProbeCommand::processReply(quint8 state, const uchar *data, unsigned dataSize)
+{
+    if (!Protocol::isFinal(state))
+        return;
+
+    m_finalReplyState = state;
+    if (!Protocol::isSuccess(state))
+        return;
+
+    quint32 echoed = (dataSize >= 4) ? qFromBigEndian<quint32>(data) : 0;
+    if (dataSize < 4 || echoed != m_timestamp)
+    {
+        qDebug() << "Probe reply has an invalid timestamp; ignoring";
+        m_finalReplyState = Protocol::MessageSyntaxError;
+        return;
+    }
+
+    m_replySize = dataSize - 4;
+    m_roundTripTime = m_sentTime.nsecsElapsed() / 1000;
+}
@@ -0,0 +1,88 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROBECOMMAND_H
+#define PROBECOMMAND_H
+
+#include "ProtocolCommand.h"
+#include <QElapsedTimer>
+
+/* Measures the round-trip time and capacity of the path to a contact. The
+ * command carries requestSize octets of padding and asks the peer to reply
+ * with replySize octets; see ConnectionProbe for the burst logic. */
+class ProbeCommand : public ProtocolCommand
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ProbeCommand)
+
+public:
+    enum
+    {
+        /* Command-specific failure state sent when the peer's probe budget is exhausted */
+        RateLimited = 0x01,
+        /* Receiving side budget, in octets of request and reply data */
+        BudgetPerSecond = 128 * 1024,
+        BudgetBurst = 512 * 1024
+    };
+
+    explicit ProbeCommand(QObject *parent = 0);
+
+    virtual quint8 command() const { return 0x02; }
+
+    void send(ProtocolSocket *to, quint32 timestamp, int requestSize, int replySize);
+
+    static void process(CommandHandler &command);
+
+    quint8 finalReplyState() const { return m_finalReplyState; }
+    bool isSuccess() const { return Protocol::isSuccess(m_finalReplyState); }
+    bool isRateLimited() const;
+
+    quint32 timestamp() const { return m_timestamp; }
+    int requestSize() const { return m_requestSize; }
+    int replySize() const { return m_replySize; }
+    /* Round-trip time in microseconds, measured from send() to the final reply */
+    qint64 roundTripTime() const { return m_roundTripTime; }
+
+protected:
+    virtual void processReply(quint8 state, const uchar *data, unsigned dataSize);
+
+private:
+    QElapsedTimer m_sentTime;
+    qint64 m_roundTripTime;
+    quint32 m_timestamp;
+    int m_requestSize, m_replySize;
+    quint8 m_finalReplyState;
+
+    static bool takeBudget(ContactUser *user, int size);
+};
+
+#endif // PROBECOMMAND_H
@@ -0,0 +1,170 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "RequestPuzzle.h"
+#include "ProtocolConstants.h"
+#include "utils/SecureRNG.h"
+#include <QElapsedTimer>
+#include <QtEndian>
+#include <QDebug>
+#include <math.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+/* A cookie with a puzzle begins with these two octets, followed by the difficulty */
+static const uchar puzzleMarker[2] = { 0x50, 0x57 };
+/* Time constant of the request rate average, in seconds */
+static const double RateWindow = 60;
+
+/* Protected only by being used on the main thread */
+static double requestRate = 0;
+static QElapsedTimer rateTimer;
+
+int RequestPuzzle::difficulty(const QByteArray &cookie)
+{
+    if (cookie.size() != Protocol::RequestCookieSize)
+        return 0;
+
+    const uchar *c = reinterpret_cast<const uchar*>(cookie.constData());
+    if (c[0] != puzzleMarker[0] || c[1] != puzzleMarker[1])
+        return 0;
+    return qMin(int(c[2]), MaxDifficulty);
+}
+
+QByteArray RequestPuzzle::createCookie(int difficulty)
+{
+    QByteArray cookie = SecureRNG::random(Protocol::RequestCookieSize);
+    if (cookie.size() != Protocol::RequestCookieSize)
+        return QByteArray();
+
+    uchar *c = reinterpret_cast<uchar*>(cookie.data());
+    if (difficulty > 0) {
+        c[0] = puzzleMarker[0];
+        c[1] = puzzleMarker[1];
+        c[2] = uchar(qMin(difficulty, MaxDifficulty));
+    } else if (c[0] == puzzleMarker[0] && c[1] == puzzleMarker[1]) {
+        /* Random cookies must never look like a puzzle */
+        c[0] = ~c[0];
+    }
+
+    return cookie;
+}
+
+static bool hasLeadingZeros(const uchar *digest, int bits)
+{
+    int i = 0;
+    for (; bits >= 8; bits -= 8, i++) {
+        if (digest[i])
+            return false;
+    }
+    return !bits || !(digest[i] >> (8 - bits));
+}
+
+QByteArray RequestPuzzle::solve(const QByteArray &cookie, const QByteArray &connSecret)
+{
+    int bits = difficulty(cookie);
+    QByteArray nonce(NonceSize, 0);
+    if (!bits)
+        return nonce;
+
+    SHA256_CTX prefix;
+    SHA256_Init(&prefix);
+    SHA256_Update(&prefix, cookie.constData(), cookie.size());
+    SHA256_Update(&prefix, connSecret.constData(), connSecret.size());
+
+    QElapsedTimer timer;
+    timer.start();
+
+    uchar digest[SHA256_DIGEST_LENGTH];
+    uchar *n = reinterpret_cast<uchar*>(nonce.data());
+    for (quint64 i = 0; ; i++) {
+        qToBigEndian(i, n);
+
+        SHA256_CTX ctx = prefix;
+        SHA256_Update(&ctx, n, NonceSize);
+        SHA256_Final(digest, &ctx);
+
+        if (hasLeadingZeros(digest, bits)) {
+            qDebug() << "Solved contact request puzzle of difficulty" << bits << "in" << timer.elapsed() << "ms";
+            return nonce;
+        }
+    }
+}
+
+bool RequestPuzzle::verify(const QByteArray &cookie, const QByteArray &connSecret, const QByteArray &nonce)
+{
+    int bits = difficulty(cookie);
+    if (!bits)
+        return true;
+    if (nonce.size() != NonceSize)
+        return false;
+
+    SHA256_CTX ctx;
+    uchar digest[SHA256_DIGEST_LENGTH];
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, cookie.constData(), cookie.size());
+    SHA256_Update(&ctx, connSecret.constData(), connSecret.size());
+    SHA256_Update(&ctx, nonce.constData(), nonce.size());
+    SHA256_Final(digest, &ctx);
+
+    return hasLeadingZeros(digest, bits);
+}
+
+static void decayRate()
+{
+    if (!rateTimer.isValid()) {
+        rateTimer.start();
+        return;
+    }
+
+    double elapsed = rateTimer.restart() / 1000.0;
+    requestRate *= exp(-elapsed / RateWindow);
+}
+
+void RequestPuzzle::recordRequest()
+{
+    /* Each request adds one to an exponentially decaying count, which approximates
+     * the number of requests per RateWindow */
+    decayRate();
+    requestRate += 1;
+}
+
+int RequestPuzzle::currentDifficulty()
+{
+    decayRate();
+    if (requestRate <= RequestThreshold)
+        return 0;
+
+    /* Another bit, doubling the work, for each doubling of the rate beyond the threshold */
+    int difficulty = MinDifficulty + int(log(requestRate / RequestThreshold) / log(2.0));
+    return qBound(int(MinDifficulty), difficulty, int(MaxDifficulty));
+}
@@ -0,0 +1,73 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef REQUESTPUZZLE_H
+#define REQUESTPUZZLE_H
+
+#include <QByteArray>
+
+/* Client puzzle for contact requests under load.
+ *
+ * When contact requests arrive faster than RequestThreshold per minute, the
+ * server's cookie asks for a proof of work: the client must find a nonce for
+ * which SHA256(cookie, connSecret, nonce) begins with a number of zero bits,
+ * which grows with the observed request rate. The server checks this with a
+ * single hash before doing any public key work. See section 8 of
+ * doc/protocol.txt. */
+class RequestPuzzle
+{
+public:
+    static const int NonceSize = 8;
+    static const int MinDifficulty = 12;
+    static const int MaxDifficulty = 24;
+    /* Requests per minute above which a puzzle is required */
+    static const int RequestThreshold = 10;
+
+    /* Zero bits required by cookie, or 0 if it has no puzzle */
+    static int difficulty(const QByteArray &cookie);
+    /* Random cookie of Protocol::RequestCookieSize, with a puzzle if difficulty is non-zero */
+    static QByteArray createCookie(int difficulty);
+
+    /* Finds a nonce solving the puzzle of cookie; this can take several seconds */
+    static QByteArray solve(const QByteArray &cookie, const QByteArray &connSecret);
+    static bool verify(const QByteArray &cookie, const QByteArray &connSecret, const QByteArray &nonce);
+
+    /* Counts a contact request connection toward the observed load */
+    static void recordRequest();
+    /* Difficulty for new cookies, based on the recent request rate */
+    static int currentDifficulty();
+
+private:
+    RequestPuzzle();
+};
+
+#endif // REQUESTPUZZLE_H
@@ -0,0 +1,82 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "AddOnionCommand.h"
+#include "utils/CryptoKey.h"
+
+using namespace Tor;
+
+AddOnionCommand::AddOnionCommand()
+    : TorControlCommand("ADD_ONION")
+{
+}
+
+bool AddOnionCommand::isSuccessful() const
+{
+    return statusCode() == 250;
+}
+
+QByteArray AddOnionCommand::build(const CryptoKey &key, const QList<HiddenService::Target> &targets)
+{
+    QByteArray secret = key.expandedSecretKey();
+    if (secret.isEmpty())
+        return QByteArray();
+
+    QByteArray out("ADD_ONION ED25519-V3:");
+    out.append(secret.toBase64());
+    secret.fill(0);
+
+    for (QList<HiddenService::Target>::ConstIterator it = targets.begin(); it != targets.end(); ++it)
+    {
+        out += " Port=" + QByteArray::number(it->servicePort) + "," +
+               it->targetAddress.toString().toLatin1() + ":" + QByteArray::number(it->targetPort);
+    }
+
+    out.append("\r\n");
+    return out;
+}
+
+void AddOnionCommand::handleReply(int code, QByteArray &data, bool end)
+{
+    if (code == 250 && data.startsWith("ServiceID="))
+        m_serviceID = data.mid(10);
+
+    if (end)
+    {
+        if (isSuccessful()) {
+            emit succeeded();
+        } else {
+            m_errorMessage = QString::fromLatin1(data);
+            emit failed(code);
+        }
+    }
+}
@@ -30,28 +30,52 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "main.h"
 #include "HiddenService.h"
 #include "TorControl.h"
 #include "TorSocket.h"
 #include "utils/CryptoKey.h"
+#include "utils/CryptoService.h"
 #include <QDir>
 #include <QFile>
+#include <QFileSystemWatcher>
 #include <QTimer>
 #include <QDebug>
 
 using namespace Tor;
 
 HiddenService::HiddenService(const QString &p, QObject *parent)
-    : QObject(parent), dataPath(p), selfTest(0), pStatus(NotCreated)
+    : QObject(parent), dataPath(p), selfTest(0), pStatus(NotCreated), pVersion(2), keyWatcher(0), keyJob(0)
 {
     /* Set the initial status and, if possible, load the hostname */
     QDir dir(dataPath);
     if (dir.exists(QLatin1String("hostname")) && dir.exists(QLatin1String("private_key")))
     {
+        /* Tor writes RSA keys in PKCS#1 form; our Ed25519 keys are PKCS#8 */
+        QFile keyFile(keyFilePath());
+        if (keyFile.open(QIODevice::ReadOnly) && keyFile.readLine().contains("BEGIN RSA"))
+            pVersion = 2;
+
         readHostname();
         if (!pHostname.isEmpty())
             pStatus = Offline;
     }
+    else
+    {
+        /* New services are v3, unless configured otherwise or built without Ed25519 */
+        bool ed25519 = CryptoKey::isSupported(CryptoKey::Ed25519);
+        pVersion = config->value("tor/serviceVersion", ed25519 ? 3 : 2).toInt() == 2 ? 2 : 3;
+        if (pVersion == 3 && !ed25519)
+        {
+            qWarning() << "Version 3 hidden services require Ed25519 support, which this build lacks; "
+                          "creating a version 2 service instead";
+            pVersion = 2;
+        }
+    }
+
+    /* Have the key ready before the first contact request needs it */
+    if (pStatus != NotCreated)
+        loadCryptoKey();
 }
 
 void HiddenService::setStatus(Status newStatus)
@@ -91,7 +115,7 @@ void HiddenService::readHostname()
     }
 
     QByteArray data;
-    data.resize(32);
+    data.resize(80);
 
     int rd = file.readLine(data.data(), data.size());
     if (rd < 0)
@@ -103,7 +127,7 @@ void HiddenService::readHostname()
     data.resize(rd);
 
     int sep = data.lastIndexOf('.');
-    if (sep != 16 || data.mid(sep) != ".onion\n")
+    if ((sep != 16 && sep != 56) || data.mid(sep) != ".onion\n")
     {
         qDebug() << "Failed to read hostname file for hidden service" << dataPath << "- invalid contents";
         return;
@@ -115,13 +139,115 @@ void HiddenService::readHostname()
 
 CryptoKey HiddenService::cryptoKey() const
 {
+    if (pCryptoKey.isLoaded())
+        return pCryptoKey;
+
     CryptoKey key;
+    if (!key.loadFromFile(keyFilePath(), true) || !key.isPrivate()) {
+        qWarning() << "Failed to load hidden service key";
+        return CryptoKey();
+    }
+
+    pCryptoKey = key;
+    watchKeyFile();
+    return pCryptoKey;
+}
+
+bool HiddenService::createKey()
+{
+    Q_ASSERT(pVersion == 3);
+
+    CryptoKey key;
+    if (!key.generate(CryptoKey::Ed25519))
+        return false;
+
+    QByteArray encodedKey = key.encodedPrivateKey();
+    QString serviceID = key.torServiceID();
+    if (encodedKey.isEmpty() || serviceID.isEmpty())
+        return false;
+
+    if (!QDir().mkpath(dataPath)) {
+        qWarning() << "Failed to create hidden service directory" << dataPath;
+        return false;
+    }
+
+    QFile keyFile(keyFilePath());
+    bool ok = keyFile.open(QIODevice::WriteOnly | QIODevice::Truncate) &&
+              keyFile.setPermissions(QFile::ReadOwner | QFile::WriteOwner) &&
+              keyFile.write(encodedKey) == encodedKey.size();
+    encodedKey.fill(0);
+    keyFile.close();
+    if (!ok) {
+        qWarning() << "Failed to write hidden service key -" << keyFile.errorString();
+        return false;
+    }
+
+    QFile hostnameFile(dataPath + QLatin1String("/hostname"));
+    QByteArray hostname = serviceID.toLatin1() + ".onion\n";
+    if (!hostnameFile.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+        hostnameFile.write(hostname) != hostname.size())
+    {
+        qWarning() << "Failed to write hidden service hostname -" << hostnameFile.errorString();
+        return false;
+    }
 
-    bool ok = key.loadFromFile(dataPath + QLatin1String("/private_key"), true);
-    if (!ok)
+    qDebug() << "Created v3 hidden service key for" << serviceID;
+    pCryptoKey = key;
+    watchKeyFile();
+    return true;
+}
+
+void HiddenService::loadCryptoKey()
+{
+    if (keyJob)
+        return;
+
+    keyJob = CryptoService::instance()->loadKeyFromFile(keyFilePath(), true, this);
+    if (keyJob)
+        connect(keyJob, SIGNAL(finished()), SLOT(keyLoaded()));
+}
+
+void HiddenService::keyLoaded()
+{
+    CryptoKey key = keyJob->key();
+    keyJob->deleteLater();
+    keyJob = 0;
+
+    if (!key.isPrivate()) {
         qWarning() << "Failed to load hidden service key";
+        return;
+    }
 
-    return key;
+    pCryptoKey = key;
+    watchKeyFile();
+}
+
+void HiddenService::watchKeyFile() const
+{
+    HiddenService *that = const_cast<HiddenService*>(this);
+    if (!keyWatcher) {
+        that->keyWatcher = new QFileSystemWatcher(that);
+        connect(keyWatcher, SIGNAL(fileChanged(QString)), that, SLOT(keyFileChanged()));
+    }
+
+    if (!keyWatcher->files().contains(keyFilePath()))
+        keyWatcher->addPath(keyFilePath());
+}
+
+void HiddenService::keyFileChanged()
+{
+    qDebug() << "Hidden service key file changed; reloading";
+    pCryptoKey.clear();
+
+    /* A file that is replaced rather than rewritten is no longer watched */
+    if (keyWatcher->files().isEmpty() && QFile::exists(keyFilePath()))
+        keyWatcher->addPath(keyFilePath());
+
+    if (keyJob) {
+        delete keyJob;
+        keyJob = 0;
+    }
+    loadCryptoKey();
 }
 
 void HiddenService::startSelfTest()
@@ -159,6 +285,10 @@ void HiddenService::servicePublished()
     qDebug() << "Hidden service published successfully";
     setStatus(Published);
 
+    /* A newly created service has just written its key */
+    if (!pCryptoKey.isLoaded())
+        loadCryptoKey();
+
     startSelfTest();
 }
 
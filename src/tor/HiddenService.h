@@ -36,8 +36,10 @@
 #include <QObject>
 #include <QHostAddress>
 #include <QList>
+#include "utils/CryptoKey.h"
 
-class CryptoKey;
+class QFileSystemWatcher;
+class CryptoJob;
 
 namespace Tor
 {
@@ -71,8 +73,13 @@ public:
     HiddenService(const QString &dataPath, QObject *parent = 0);
 
     Status status() const { return pStatus; }
+    /* 2 for RSA services kept by Tor in dataPath; 3 for Ed25519 services, whose key
+     * we create and hold, and publish with ADD_ONION */
+    int version() const { return pVersion; }
 
     const QString &hostname() const { return pHostname; }
+    /* Private key of the service; kept loaded, and reloaded when the key file changes.
+     * Loads synchronously if it isn't already. */
     CryptoKey cryptoKey() const;
 
     const QList<Target> &targets() const { return pTargets; }
@@ -90,14 +97,25 @@ private slots:
     void servicePublished();
     void selfTestSucceeded();
     void connectivityChanged();
+    void keyFileChanged();
+    void keyLoaded();
 
 private:
     QList<Target> pTargets;
     QString pHostname;
     TorSocket *selfTest;
     Status pStatus;
+    int pVersion;
+    mutable CryptoKey pCryptoKey;
+    QFileSystemWatcher *keyWatcher;
+    CryptoJob *keyJob;
 
+    QString keyFilePath() const { return dataPath + QLatin1String("/private_key"); }
     void setStatus(Status newStatus);
+    /* Generates the key and hostname of a new v3 service */
+    bool createKey();
+    void loadCryptoKey();
+    void watchKeyFile() const;
     void readHostname();
 };
 
@@ -0,0 +1,314 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ReconnectScheduler.h"
+#include "TorSocket.h"
+#include "TorControl.h"
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <algorithm>
+
+using namespace Tor;
+
+/* Seconds before the first retry; each later retry doubles it */
+static const int BaseDelay = 30;
+/* Peers not seen for this many days are dormant, and retried once per interval */
+static const int DormantDays = 7;
+static const int DormantInterval = 60 * 60;
+static const int DeepDormantDays = 30;
+static const int DeepDormantInterval = 6 * 60 * 60;
+
+ReconnectScheduler *ReconnectScheduler::instance()
+{
+    static ReconnectScheduler *p = 0;
+    if (!p)
+        p = new ReconnectScheduler(qApp);
+    return p;
+}
+
+ReconnectScheduler::ReconnectScheduler(QObject *parent)
+    : QObject(parent), m_maxAttempts(8), m_nextGeneration(0), m_nextReady(0)
+{
+    m_clock.start();
+    m_timer.setSingleShot(true);
+    connect(&m_timer, SIGNAL(timeout()), SLOT(processDue()));
+    connect(torControl, SIGNAL(connectivityChanged()), SLOT(connectivityChanged()));
+}
+
+void ReconnectScheduler::setMaxAttempts(int max)
+{
+    m_maxAttempts = qMax(1, max);
+    startReady();
+}
+
+static int idleDays(TorSocket *socket)
+{
+    if (!socket->lastActivity())
+        return 0;
+    return int((QDateTime::currentMSecsSinceEpoch() - socket->lastActivity()) / (24 * 60 * 60 * 1000LL));
+}
+
+ReconnectScheduler::Priority ReconnectScheduler::priorityOf(TorSocket *socket, const Entry &entry) const
+{
+    if (entry.urgent)
+        return Urgent;
+    return (idleDays(socket) >= DormantDays) ? Dormant : Normal;
+}
+
+int ReconnectScheduler::retryDelay(TorSocket *socket, int attempts) const
+{
+    int maxInterval = socket->maxAttemptInterval();
+    int minInterval = 0;
+    int days = idleDays(socket);
+    if (days >= DeepDormantDays)
+        minInterval = DeepDormantInterval;
+    else if (days >= DormantDays)
+        minInterval = DormantInterval;
+    maxInterval = qMax(maxInterval, minInterval);
+
+    qint64 delay = qint64(BaseDelay) << qBound(0, attempts - 1, 16);
+    delay = qBound(qint64(minInterval), delay, qint64(maxInterval)) * 1000;
+
+    /* Half of the delay is randomized, so sockets that failed together spread out.
+     * For dormant sockets it's added on top, so the interval stays a minimum. */
+    qint64 jitter = qint64((qrand() / (RAND_MAX + 1.0)) * (delay / 2));
+    return int(minInterval ? delay + jitter : delay / 2 + jitter);
+}
+
+void ReconnectScheduler::schedule(TorSocket *socket, Entry &entry, qint64 delay)
+{
+    removeReady(entry);
+
+    entry.generation = ++m_nextGeneration;
+    entry.due = m_clock.elapsed() + qMax(Q_INT64_C(0), delay);
+
+    HeapItem item = { entry.due, entry.generation, socket };
+    m_heap.append(item);
+    std::push_heap(m_heap.begin(), m_heap.end());
+    updateTimer();
+}
+
+void ReconnectScheduler::updateTimer()
+{
+    /* Discard superseded items from the top, so the timer is for a live one */
+    while (!m_heap.isEmpty()) {
+        const HeapItem &top = m_heap.first();
+        QHash<TorSocket*,Entry>::ConstIterator it = m_entries.constFind(top.socket);
+        if (it != m_entries.constEnd() && it->generation == top.generation && it->due >= 0)
+            break;
+        std::pop_heap(m_heap.begin(), m_heap.end());
+        m_heap.removeLast();
+    }
+
+    if (m_heap.isEmpty() || !torControl->hasConnectivity()) {
+        m_timer.stop();
+        return;
+    }
+
+    qint64 wait = m_heap.first().due - m_clock.elapsed();
+    m_timer.start(int(qBound(Q_INT64_C(0), wait, Q_INT64_C(24 * 60 * 60 * 1000))));
+}
+
+void ReconnectScheduler::processDue()
+{
+    qint64 now = m_clock.elapsed();
+    while (!m_heap.isEmpty() && m_heap.first().due <= now) {
+        HeapItem item = m_heap.first();
+        std::pop_heap(m_heap.begin(), m_heap.end());
+        m_heap.removeLast();
+
+        QHash<TorSocket*,Entry>::Iterator it = m_entries.find(item.socket);
+        if (it != m_entries.end() && it->generation == item.generation && it->due >= 0)
+            makeReady(item.socket, *it);
+    }
+
+    startReady();
+    updateTimer();
+}
+
+void ReconnectScheduler::makeReady(TorSocket *socket, Entry &entry)
+{
+    if (entry.ready)
+        return;
+
+    /* After every socket of the same or higher priority */
+    entry.ready = true;
+    entry.readyKey = ReadyKey(-int(priorityOf(socket, entry)), m_nextReady++);
+    m_ready.insert(entry.readyKey, socket);
+}
+
+void ReconnectScheduler::removeReady(Entry &entry)
+{
+    if (!entry.ready)
+        return;
+
+    m_ready.remove(entry.readyKey);
+    entry.ready = false;
+}
+
+void ReconnectScheduler::startReady()
+{
+    if (!torControl->hasConnectivity())
+        return;
+
+    while (!m_ready.isEmpty() && m_active.size() < m_maxAttempts) {
+        TorSocket *socket = m_ready.begin().value();
+        QHash<TorSocket*,Entry>::Iterator it = m_entries.find(socket);
+        Q_ASSERT(it != m_entries.end());
+        removeReady(*it);
+        quint32 generation = it->generation;
+
+        socket->reconnect();
+
+        /* No attempt starts if the socket is already connecting or connected, has no
+         * host, or has stopped reconnecting; unless it was scheduled again meanwhile,
+         * it's no longer waiting either way */
+        if (!m_active.contains(socket)) {
+            it = m_entries.find(socket);
+            if (it != m_entries.end() && it->generation == generation) {
+                it->due = -1;
+                it->urgent = false;
+            }
+        }
+    }
+}
+
+void ReconnectScheduler::scheduleRetry(TorSocket *socket)
+{
+    QHash<TorSocket*,Entry>::Iterator it = m_entries.find(socket);
+    if (it == m_entries.end()) {
+        Entry entry = { 0, 0, false, -1, false, ReadyKey() };
+        it = m_entries.insert(socket, entry);
+    } else if (it->due >= 0) {
+        /* Already waiting; one failure can be reported more than once */
+        return;
+    }
+
+    it->attempts++;
+    int delay = retryDelay(socket, it->attempts);
+    schedule(socket, *it, delay);
+    qDebug() << "Reconnecting socket to" << socket->hostName() << socket->port() << "in" << delay / 1000 << "seconds";
+}
+
+void ReconnectScheduler::scheduleNow(TorSocket *socket, Priority priority)
+{
+    QHash<TorSocket*,Entry>::Iterator it = m_entries.find(socket);
+    if (it == m_entries.end()) {
+        Entry entry = { 0, 0, false, -1, false, ReadyKey() };
+        it = m_entries.insert(socket, entry);
+    }
+
+    if (priority == Urgent)
+        it->urgent = true;
+    schedule(socket, *it, 0);
+}
+
+void ReconnectScheduler::prioritize(TorSocket *socket)
+{
+    QHash<TorSocket*,Entry>::Iterator it = m_entries.find(socket);
+    if (it == m_entries.end() || it->due < 0)
+        return;
+
+    it->urgent = true;
+    schedule(socket, *it, 0);
+}
+
+void ReconnectScheduler::resetAttempts(TorSocket *socket)
+{
+    QHash<TorSocket*,Entry>::Iterator it = m_entries.find(socket);
+    if (it == m_entries.end())
+        return;
+
+    it->attempts = 0;
+    if (it->due >= 0 && !it->ready)
+        schedule(socket, *it, retryDelay(socket, 1));
+}
+
+void ReconnectScheduler::remove(TorSocket *socket)
+{
+    QHash<TorSocket*,Entry>::Iterator it = m_entries.find(socket);
+    if (it != m_entries.end()) {
+        removeReady(*it);
+        m_entries.erase(it);
+    }
+    if (m_active.remove(socket))
+        startReady();
+}
+
+void ReconnectScheduler::attemptStarted(TorSocket *socket)
+{
+    m_active.insert(socket, true);
+
+    QHash<TorSocket*,Entry>::Iterator it = m_entries.find(socket);
+    if (it != m_entries.end()) {
+        removeReady(*it);
+        it->due = -1;
+        it->urgent = false;
+    }
+}
+
+void ReconnectScheduler::attemptFinished(TorSocket *socket)
+{
+    if (m_active.remove(socket))
+        startReady();
+}
+
+void ReconnectScheduler::connectivityChanged()
+{
+    /* Attempts in progress still hold their slots until they finish or fail */
+    m_heap.clear();
+    m_ready.clear();
+
+    bool online = torControl->hasConnectivity();
+    qint64 now = m_clock.elapsed();
+    for (QHash<TorSocket*,Entry>::Iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+        it->ready = false;
+        if (it->due < 0)
+            continue;
+
+        /* Everything waiting is retried now, without the backoff from before, except
+         * dormant sockets, which keep the time they were due */
+        if (priorityOf(it.key(), *it) == Dormant) {
+            if (online)
+                schedule(it.key(), *it, it->due - now);
+            continue;
+        }
+
+        it->attempts = 0;
+        it->due = 0;
+        if (online)
+            schedule(it.key(), *it, 0);
+    }
+
+    updateTimer();
+}
@@ -0,0 +1,144 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RECONNECTSCHEDULER_H
+#define RECONNECTSCHEDULER_H
+
+#include <QObject>
+#include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QVector>
+#include <QTimer>
+#include <QElapsedTimer>
+
+namespace Tor {
+
+class TorSocket;
+
+/* Schedules reconnection attempts for every TorSocket.
+ *
+ * Retries back off exponentially with random jitter, up to the socket's maximum
+ * interval. Sockets whose peer hasn't been seen in a long time are dormant, and
+ * are retried only once per dormant interval. Due retries are kept on a single
+ * timer heap, and at most maxAttempts() connection attempts are in progress at
+ * once; the rest wait, in priority order, for a free slot. When connectivity
+ * returns, or a socket is prioritized, waiting sockets are retried without any
+ * further delay, except that dormant sockets still wait until they are due. */
+class ReconnectScheduler : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ReconnectScheduler)
+
+public:
+    enum Priority
+    {
+        Dormant,
+        Normal,
+        Urgent
+    };
+
+    static ReconnectScheduler *instance();
+
+    int maxAttempts() const { return m_maxAttempts; }
+    void setMaxAttempts(int max);
+
+    /* Schedules the next retry of socket after a failed attempt */
+    void scheduleRetry(TorSocket *socket);
+    /* Schedules socket to connect as soon as possible */
+    void scheduleNow(TorSocket *socket, Priority priority = Normal);
+    /* Moves socket to the front, if it's waiting to reconnect */
+    void prioritize(TorSocket *socket);
+    void resetAttempts(TorSocket *socket);
+    void remove(TorSocket *socket);
+
+    /* Attempts in progress count against maxAttempts() */
+    void attemptStarted(TorSocket *socket);
+    void attemptFinished(TorSocket *socket);
+
+private slots:
+    void processDue();
+    void connectivityChanged();
+
+private:
+    /* Orders waiting sockets by descending priority, then by when they became due */
+    typedef QPair<int,quint32> ReadyKey;
+
+    struct Entry
+    {
+        int attempts;
+        quint32 generation;
+        /* Set by prioritize until the next attempt starts */
+        bool urgent;
+        /* Milliseconds of m_clock when the socket is due, or -1 if not scheduled */
+        qint64 due;
+        /* In m_ready under readyKey */
+        bool ready;
+        ReadyKey readyKey;
+    };
+
+    struct HeapItem
+    {
+        qint64 due;
+        quint32 generation;
+        TorSocket *socket;
+
+        /* Inverted, so the heap's top is the earliest */
+        bool operator<(const HeapItem &other) const { return due > other.due; }
+    };
+
+    QHash<TorSocket*,Entry> m_entries;
+    /* Entries superseded by a later schedule are left in the heap and skipped by generation */
+    QVector<HeapItem> m_heap;
+    /* Sockets that are due, waiting for a free attempt */
+    QMap<ReadyKey,TorSocket*> m_ready;
+    QHash<TorSocket*,bool> m_active;
+    int m_maxAttempts;
+    quint32 m_nextGeneration;
+    quint32 m_nextReady;
+    QElapsedTimer m_clock;
+    QTimer m_timer;
+
+    explicit ReconnectScheduler(QObject *parent = 0);
+
+    Priority priorityOf(TorSocket *socket, const Entry &entry) const;
+    int retryDelay(TorSocket *socket, int attempts) const;
+    void schedule(TorSocket *socket, Entry &entry, qint64 delay);
+    void makeReady(TorSocket *socket, Entry &entry);
+    void removeReady(Entry &entry);
+    void startReady();
+    void updateTimer();
+};
+
+}
+
+#endif // RECONNECTSCHEDULER_H
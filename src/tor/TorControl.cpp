@@ -38,6 +38,8 @@
 #include "AuthenticateCommand.h"
 #include "SetConfCommand.h"
 #include "GetConfCommand.h"
+#include "AddOnionCommand.h"
+#include "utils/CryptoKey.h"
 #include "utils/StringUtil.h"
 #include <QHostAddress>
 #include <QDir>
@@ -78,6 +80,7 @@ public:
 
     void getTorInfo();
     void publishServices();
+    void publishOnionService(HiddenService *service);
 
 public slots:
     void socketConnected();
@@ -488,6 +491,13 @@ void TorControlPrivate::publishServices()
     for (QList<HiddenService*>::Iterator it = services.begin(); it != services.end(); ++it)
     {
         HiddenService *service = *it;
+
+        if (service->version() == 3)
+        {
+            publishOnionService(service);
+            continue;
+        }
+
         QDir dir(service->dataPath);
 
         qDebug() << "torctrl: Configuring hidden service at" << service->dataPath;
@@ -506,7 +516,35 @@ void TorControlPrivate::publishServices()
         QObject::connect(command, SIGNAL(setConfSucceeded()), service, SLOT(servicePublished()));
     }
 
-    socket->sendCommand(command, command->build(settings));
+    if (settings.isEmpty())
+        delete command;
+    else
+        socket->sendCommand(command, command->build(settings));
+}
+
+void TorControlPrivate::publishOnionService(HiddenService *service)
+{
+    qDebug() << "torctrl: Publishing v3 hidden service at" << service->dataPath;
+
+    if (service->status() == HiddenService::NotCreated && !service->createKey())
+    {
+        qWarning() << "torctrl: Failed to create key for hidden service at" << service->dataPath;
+        return;
+    }
+
+    CryptoKey key = service->cryptoKey();
+    AddOnionCommand *command = new AddOnionCommand;
+    QByteArray data = command->build(key, service->targets());
+    if (data.isEmpty())
+    {
+        qWarning() << "torctrl: Failed to load key for hidden service at" << service->dataPath;
+        delete command;
+        return;
+    }
+
+    QObject::connect(command, SIGNAL(succeeded()), service, SLOT(servicePublished()));
+    socket->sendCommand(command, data);
+    data.fill(0);
 }
 
 void TorControl::shutdown()
@@ -55,7 +55,11 @@ void TorControlSocket::sendCommand(TorControlCommand *command, const QByteArray
     Q_ASSERT(data.endsWith("\r\n"));
     write(data);
 
-    qDebug() << "torctrl: Sent" << data.trimmed();
+    /* ADD_ONION carries the service's secret key */
+    if (data.startsWith("ADD_ONION "))
+        qDebug() << "torctrl: Sent ADD_ONION";
+    else
+        qDebug() << "torctrl: Sent" << data.trimmed();
 }
 
 void TorControlSocket::registerEvent(const QByteArray &action, TorControlCommand *command)
@@ -32,6 +32,7 @@
 
 #include "TorSocket.h"
 #include "TorControl.h"
+#include "ReconnectScheduler.h"
 #include <QNetworkProxy>
 
 using namespace Tor;
@@ -41,19 +42,19 @@ TorSocket::TorSocket(QObject *parent)
     , m_port(0)
     , m_reconnectEnabled(true)
     , m_maxInterval(900)
-    , m_connectAttempts(0)
+    , m_lastActivity(0)
 {
     connect(torControl, SIGNAL(connectivityChanged()), SLOT(connectivityChanged()));
-    connect(&m_connectTimer, SIGNAL(timeout()), SLOT(reconnect()));
+    connect(this, SIGNAL(connected()), SLOT(onConnected()));
     connect(this, SIGNAL(disconnected()), SLOT(onFailed()));
     connect(this, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(onFailed()));
 
-    m_connectTimer.setSingleShot(true);
     connectivityChanged();
 }
 
 TorSocket::~TorSocket()
 {
+    ReconnectScheduler::instance()->remove(this);
 }
 
 void TorSocket::setReconnectEnabled(bool enabled)
@@ -63,10 +64,10 @@ void TorSocket::setReconnectEnabled(bool enabled)
 
     m_reconnectEnabled = enabled;
     if (m_reconnectEnabled) {
-        m_connectAttempts = 0;
+        ReconnectScheduler::instance()->resetAttempts(this);
         reconnect();
     } else {
-        m_connectTimer.stop();
+        ReconnectScheduler::instance()->remove(this);
     }
 }
 
@@ -77,32 +78,19 @@ void TorSocket::setMaxAttemptInterval(int interval)
 
 void TorSocket::resetAttempts()
 {
-    m_connectAttempts = 0;
-    if (m_connectTimer.isActive()) {
-        m_connectTimer.stop();
-        m_connectTimer.start(reconnectInterval() * 1000);
-    }
+    ReconnectScheduler::instance()->resetAttempts(this);
 }
 
-int TorSocket::reconnectInterval()
+void TorSocket::reconnectNow()
 {
-    int delay = 0;
-    if (m_connectAttempts <= 4)
-        delay = 30;
-    else if (m_connectAttempts <= 6)
-        delay = 120;
-    else
-        delay = m_maxInterval;
-
-    return qMin(delay, m_maxInterval);
+    ReconnectScheduler::instance()->prioritize(this);
 }
 
 void TorSocket::reconnect()
 {
-    if (!torControl->hasConnectivity() || !reconnectEnabled())
+    if (!torControl->hasConnectivity() || !reconnectEnabled() || state() != QAbstractSocket::UnconnectedState)
         return;
 
-    m_connectTimer.stop();
     if (!m_host.isEmpty() && m_port) {
         qDebug() << "Attempting reconnection of socket to" << m_host << m_port;
         connectToHost(m_host, m_port);
@@ -111,14 +99,9 @@ void TorSocket::reconnect()
 
 void TorSocket::connectivityChanged()
 {
-    if (torControl->hasConnectivity()) {
+    /* Reconnecting when connectivity returns is left to the scheduler */
+    if (torControl->hasConnectivity())
         setProxy(torControl->connectionProxy());
-        if (state() == QAbstractSocket::UnconnectedState)
-            reconnect();
-    } else {
-        m_connectTimer.stop();
-        m_connectAttempts = 0;
-    }
 }
 
 void TorSocket::connectToHost(const QString &hostName, quint16 port, OpenMode openMode,
@@ -127,12 +110,16 @@ void TorSocket::connectToHost(const QString &hostName, quint16 port, OpenMode op
     m_host = hostName;
     m_port = port;
 
-    if (!torControl->hasConnectivity())
+    if (!torControl->hasConnectivity()) {
+        if (reconnectEnabled())
+            ReconnectScheduler::instance()->scheduleNow(this);
         return;
+    }
 
     if (proxy() != torControl->connectionProxy())
         setProxy(torControl->connectionProxy());
 
+    ReconnectScheduler::instance()->attemptStarted(this);
     QAbstractSocket::connectToHost(hostName, port, openMode, protocol);
 }
 
@@ -141,11 +128,14 @@ void TorSocket::connectToHost(const QHostAddress &address, quint16 port, OpenMod
     TorSocket::connectToHost(address.toString(), port, openMode);
 }
 
+void TorSocket::onConnected()
+{
+    ReconnectScheduler::instance()->attemptFinished(this);
+}
+
 void TorSocket::onFailed()
 {
-    if (reconnectEnabled() && !m_connectTimer.isActive()) {
-        m_connectAttempts++;
-        m_connectTimer.start(reconnectInterval() * 1000);
-        qDebug() << "Reconnecting socket to" << m_host << m_port << "in" << m_connectTimer.interval() / 1000 << "seconds";
-    }
+    ReconnectScheduler::instance()->attemptFinished(this);
+    if (reconnectEnabled())
+        ReconnectScheduler::instance()->scheduleRetry(this);
 }
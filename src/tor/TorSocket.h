@@ -34,7 +34,6 @@
 #define TORSOCKET_H
 
 #include <QTcpSocket>
-#include <QTimer>
 
 namespace Tor {
 
@@ -43,8 +42,8 @@ namespace Tor {
  * reacts to Tor's connectivity state.
  *
  * Use normal QTcpSocket/QAbstractSocket API. When a connection fails, it
- * will be retried automatically after the correct interval and when
- * connectivity is available.
+ * will be retried automatically by the ReconnectScheduler, after a backoff
+ * interval and when connectivity is available.
  *
  * To fully disconnect, destroy the object, or call
  * setReconnectEnabled(false) and disconnect the socket with
@@ -66,6 +65,13 @@ public:
     int maxAttemptInterval() { return m_maxInterval; }
     void setMaxAttemptInterval(int interval);
     void resetAttempts();
+    /* Retry now if waiting to reconnect, ahead of other sockets */
+    void reconnectNow();
+
+    /* Time the peer was last seen, in milliseconds since the epoch, or 0 if unknown.
+     * Sockets to peers not seen for a long time retry less often. */
+    qint64 lastActivity() const { return m_lastActivity; }
+    void setLastActivity(qint64 msecs) { m_lastActivity = msecs; }
 
     virtual void connectToHost(const QString &hostName, quint16 port, OpenMode openMode = ReadWrite, NetworkLayerProtocol protocol = AnyIPProtocol);
     virtual void connectToHost(const QHostAddress &address, quint16 port, OpenMode openMode = ReadWrite);
@@ -73,21 +79,20 @@ public:
     QString hostName() const { return m_host; }
     quint16 port() const { return m_port; }
 
-protected:
-    virtual int reconnectInterval();
-
 private slots:
     void reconnect();
     void connectivityChanged();
+    void onConnected();
     void onFailed();
 
 private:
+    friend class ReconnectScheduler;
+
     QString m_host;
     quint16 m_port;
-    QTimer m_connectTimer;
     bool m_reconnectEnabled;
     int m_maxInterval;
-    int m_connectAttempts;
+    qint64 m_lastActivity;
 
     using QAbstractSocket::connectToHost;
 };
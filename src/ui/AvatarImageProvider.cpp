@@ -1,38 +1,80 @@
 #include "AvatarImageProvider.h"
-#include "core/IdentityManager.h"
+#include "utils/StateDatabase.h"
+#include <QCache>
+#include <QDebug>
+#include <QMutex>
+#include <QStringList>
+
+/* Budget for decoded images, in bytes */
+static const int CacheSize = 16 * 1024 * 1024;
+
+struct CachedAvatar
+{
+    QImage image;
+    QSize originalSize;
+};
+
+/* Owns the decoded images. Avatar data is read from the database on the loader
+ * thread; the version of the data is part of the cache key, so outdated images
+ * are never found and age out of the cache. */
+class AvatarCache
+{
+public:
+    AvatarCache()
+        : images(CacheSize)
+    {
+    }
+
+    QMutex mutex;
+    /* Protected by mutex */
+    QCache<QString,CachedAvatar> images;
+};
 
 AvatarImageProvider::AvatarImageProvider()
-    : QQuickImageProvider(Pixmap)
+    : QQuickImageProvider(Image, ForceAsynchronousImageLoading)
+    , m_cache(new AvatarCache)
 {
 }
 
-QPixmap AvatarImageProvider::requestPixmap(const QString &id, QSize *size, const QSize &requestedSize)
+AvatarImageProvider::~AvatarImageProvider()
 {
-    QPixmap re;
-    QStringList sections = id.split(QLatin1Char('/'));
-    if (sections.size() < 2)
-        return re;
+    delete m_cache;
+}
 
+QImage AvatarImageProvider::requestImage(const QString &id, QSize *size, const QSize &requestedSize)
+{
+    /* id is "<identity>/identity" or "<identity>/contact/<contact>"; anything after is ignored */
+    QStringList sections = id.split(QLatin1Char('/'));
     bool ok = false;
-    int identityId = sections[0].toInt(&ok);
-    UserIdentity *identity = identityManager->lookupUniqueID(identityId);
-    if (!ok || !identity)
-        return re;
+    int identityId = sections.value(0).toInt(&ok);
+    StateDatabase::RecordType type = StateDatabase::IdentityRecord;
+    int recordId = identityId;
+    if (ok && sections.value(1) == QLatin1String("contact")) {
+        type = StateDatabase::ContactRecord;
+        recordId = sections.value(2).toInt(&ok);
+    } else if (sections.value(1) != QLatin1String("identity")) {
+        ok = false;
+    }
 
-    if (sections[1] == QLatin1String("identity"))
-    {
-        QByteArray data = identity->readSetting("avatar").toByteArray();
-        re.loadFromData(data);
+    quint64 version = ok ? database->blobVersion(type, recordId, identityId, StateDatabase::AvatarBlob) : 0;
+    QString sizeKey = requestedSize.isValid() ? QString::fromLatin1("@%1x%2").arg(requestedSize.width()).arg(requestedSize.height())
+                                              : QString();
+    QString cacheKey = QString::fromLatin1("%1/%2/%3#%4").arg(int(type)).arg(identityId).arg(recordId).arg(version) + sizeKey;
+
+    if (version) {
+        QMutexLocker locker(&m_cache->mutex);
+        CachedAvatar *cached = m_cache->images.object(cacheKey);
+        if (cached) {
+            *size = cached->originalSize;
+            return cached->image;
+        }
     }
-    else if (sections[1] == QLatin1String("contact") && sections.size() >= 3)
-    {
-        int contactId = sections[2].toInt(&ok);
-        ContactUser *user = identity->contacts.lookupUniqueID(contactId);
-        if (!ok || !user)
-            return re;
 
-        QByteArray data = user->readSetting("avatar").toByteArray();
-        re.loadFromData(data);
+    QImage re;
+    if (version) {
+        QByteArray data = database->blob(type, recordId, identityId, StateDatabase::AvatarBlob, &version);
+        if (!re.loadFromData(data))
+            qWarning() << "Avatar data for" << id << "could not be decoded";
     }
 
     if (!re.isNull())
@@ -40,10 +82,20 @@ QPixmap AvatarImageProvider::requestPixmap(const QString &id, QSize *size, const
         *size = re.size();
         if (requestedSize.isValid())
             re = re.scaled(requestedSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+        CachedAvatar *cached = new CachedAvatar;
+        cached->image = re;
+        cached->originalSize = *size;
+
+        /* The avatar may have changed since the version was read; cache under the version of this data */
+        cacheKey = QString::fromLatin1("%1/%2/%3#%4").arg(int(type)).arg(identityId).arg(recordId).arg(version) + sizeKey;
+        QMutexLocker locker(&m_cache->mutex);
+        m_cache->images.insert(cacheKey, cached, re.byteCount());
     }
     else
     {
-        re = QPixmap(requestedSize);
+        /* There is no avatar, or it isn't an image */
+        re = QImage(requestedSize, QImage::Format_ARGB32_Premultiplied);
         re.fill(Qt::transparent);
         *size = requestedSize;
     }
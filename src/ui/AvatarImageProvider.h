@@ -3,12 +3,20 @@
 
 #include <QQuickImageProvider>
 
+class AvatarCache;
+
+/* Avatars are read, decoded and scaled on QML's image loading thread, and the
+ * results are kept in a size-bounded cache until the avatar changes. */
 class AvatarImageProvider : public QQuickImageProvider
 {
 public:
     AvatarImageProvider();
+    virtual ~AvatarImageProvider();
+
+    virtual QImage requestImage(const QString &id, QSize *size, const QSize &requestedSize);
 
-    virtual QPixmap requestPixmap(const QString &id, QSize *size, const QSize &requestedSize);
+private:
+    AvatarCache *m_cache;
 };
 
 #endif // AVATARIMAGEPROVIDER_H
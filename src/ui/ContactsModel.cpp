@@ -34,17 +34,58 @@
 #include "core/IdentityManager.h"
 #include "core/ContactsManager.h"
 #include <QDebug>
+#include <algorithm>
 
-inline bool contactSort(const ContactUser *c1, const ContactUser *c2)
+bool ContactsModel::SortKey::operator<(const SortKey &other) const
 {
-    if (c1->status() != c2->status())
-        return c1->status() < c2->status();
-    return c1->nickname().localeAwareCompare(c2->nickname()) < 0;
+    if (status != other.status)
+        return status < other.status;
+#if QT_VERSION >= 0x050200
+    return nickname.compare(other.nickname) < 0;
+#else
+    return nickname.localeAwareCompare(other.nickname) < 0;
+#endif
 }
 
+class ContactsModel::SortKeyLessThan
+{
+public:
+    explicit SortKeyLessThan(const QHash<ContactUser*,SortKey> &keys)
+        : m_keys(keys)
+    {
+    }
+
+    bool operator()(ContactUser *c1, ContactUser *c2) const
+    {
+        return *m_keys.constFind(c1) < *m_keys.constFind(c2);
+    }
+
+private:
+    const QHash<ContactUser*,SortKey> &m_keys;
+};
+
 ContactsModel::ContactsModel(QObject *parent)
     : QAbstractListModel(parent), m_identity(0)
 {
+    /* Changes are applied to the order at most once per frame */
+    m_updateTimer.setSingleShot(true);
+    m_updateTimer.setInterval(16);
+    connect(&m_updateTimer, SIGNAL(timeout()), SLOT(updateOrder()));
+}
+
+ContactsModel::SortKey ContactsModel::sortKey(ContactUser *user) const
+{
+#if QT_VERSION >= 0x050200
+    SortKey key = { user->status(), m_collator.sortKey(user->nickname()) };
+#else
+    SortKey key = { user->status(), user->nickname() };
+#endif
+    return key;
+}
+
+int ContactsModel::insertPosition(ContactUser *user) const
+{
+    return std::lower_bound(contacts.begin(), contacts.end(), user, SortKeyLessThan(m_sortKeys)) - contacts.begin();
 }
 
 void ContactsModel::setIdentity(UserIdentity *identity)
@@ -57,6 +98,9 @@ void ContactsModel::setIdentity(UserIdentity *identity)
     foreach (ContactUser *user, contacts)
         user->disconnect(this);
     contacts.clear();
+    m_sortKeys.clear();
+    m_changed.clear();
+    m_updateTimer.stop();
 
     if (m_identity) {
         disconnect(m_identity, 0, this, 0);
@@ -69,10 +113,12 @@ void ContactsModel::setIdentity(UserIdentity *identity)
         connect(&identity->contacts, SIGNAL(contactAdded(ContactUser*)), SLOT(contactAdded(ContactUser*)));
 
         contacts = identity->contacts.contacts();
-        std::sort(contacts.begin(), contacts.end(), contactSort);
-
-        foreach (ContactUser *user, contacts)
+        foreach (ContactUser *user, contacts) {
+            m_sortKeys.insert(user, sortKey(user));
             connectSignals(user);
+        }
+
+        std::sort(contacts.begin(), contacts.end(), SortKeyLessThan(m_sortKeys));
     }
 
     endResetModel();
@@ -101,24 +147,102 @@ void ContactsModel::updateUser(ContactUser *user)
             return;
     }
 
-    int row = contacts.indexOf(user);
-    if (row < 0)
+    if (!m_sortKeys.contains(user))
     {
         user->disconnect(this);
         return;
     }
 
-    QList<ContactUser*> sorted = contacts;
-    std::sort(sorted.begin(), sorted.end(), contactSort);
-    int newRow = sorted.indexOf(user);
+    m_changed.insert(user);
+    if (!m_updateTimer.isActive())
+        m_updateTimer.start();
+}
+
+void ContactsModel::updateOrder()
+{
+    m_updateTimer.stop();
+    if (m_changed.isEmpty())
+        return;
 
-    if (row != newRow)
+    if (m_changed.size() == 1)
     {
-        beginMoveRows(QModelIndex(), row, row, QModelIndex(), (newRow > row) ? (newRow+1) : newRow);
-        contacts = sorted;
-        endMoveRows();
+        /* Move the single changed row to its new position */
+        ContactUser *user = *m_changed.begin();
+        m_changed.clear();
+
+        int row = contacts.indexOf(user);
+        if (row < 0)
+            return;
+
+        contacts.removeAt(row);
+        m_sortKeys.insert(user, sortKey(user));
+        int newRow = insertPosition(user);
+        contacts.insert(row, user);
+
+        if (row != newRow)
+        {
+            beginMoveRows(QModelIndex(), row, row, QModelIndex(), (newRow > row) ? (newRow+1) : newRow);
+            contacts.move(row, newRow);
+            endMoveRows();
+        }
+        emit dataChanged(index(newRow, 0), index(newRow, 0));
+        return;
+    }
+
+    /* Reorder everything that changed in one layout change */
+    emit layoutAboutToBeChanged();
+
+    QModelIndexList oldIndexes = persistentIndexList();
+    QList<ContactUser*> oldUsers;
+    foreach (const QModelIndex &index, oldIndexes)
+        oldUsers.append(contacts.value(index.row()));
+
+    QList<ContactUser*> changed, unchanged;
+    unchanged.reserve(contacts.size());
+    foreach (ContactUser *user, contacts)
+    {
+        if (m_changed.contains(user))
+            changed.append(user);
+        else
+            unchanged.append(user);
+    }
+    m_changed.clear();
+
+    foreach (ContactUser *user, changed)
+        m_sortKeys.insert(user, sortKey(user));
+
+    contacts = unchanged;
+    if (changed.size() > contacts.size() / 4)
+    {
+        contacts.append(changed);
+        std::sort(contacts.begin(), contacts.end(), SortKeyLessThan(m_sortKeys));
+    }
+    else
+    {
+        foreach (ContactUser *user, changed)
+            contacts.insert(insertPosition(user), user);
+    }
+
+    QHash<ContactUser*,int> rows;
+    rows.reserve(contacts.size());
+    for (int i = 0; i < contacts.size(); i++)
+        rows.insert(contacts[i], i);
+
+    QModelIndexList newIndexes;
+    foreach (ContactUser *user, oldUsers)
+    {
+        int row = rows.value(user, -1);
+        newIndexes.append((row < 0) ? QModelIndex() : index(row, 0));
+    }
+    changePersistentIndexList(oldIndexes, newIndexes);
+
+    emit layoutChanged();
+
+    foreach (ContactUser *user, changed)
+    {
+        int row = rows.value(user);
+        emit dataChanged(index(row, 0), index(row, 0));
     }
-    emit dataChanged(index(newRow, 0), index(newRow, 0));
 }
 
 void ContactsModel::connectSignals(ContactUser *user)
@@ -134,11 +258,11 @@ void ContactsModel::contactAdded(ContactUser *user)
 
     connectSignals(user);
 
-    QList<ContactUser*>::Iterator lp = qLowerBound(contacts.begin(), contacts.end(), user, contactSort);
-    int row = lp - contacts.begin();
+    m_sortKeys.insert(user, sortKey(user));
+    int row = insertPosition(user);
 
     beginInsertRows(QModelIndex(), row, row);
-    contacts.insert(lp, user);
+    contacts.insert(row, user);
     endInsertRows();
 }
 
@@ -152,6 +276,9 @@ void ContactsModel::contactRemoved(ContactUser *user)
     contacts.removeAt(row);
     endRemoveRows();
 
+    m_sortKeys.remove(user);
+    m_changed.remove(user);
+
     disconnect(user, 0, this, 0);
 }
 
@@ -35,6 +35,12 @@
 
 #include <QAbstractListModel>
 #include <QList>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+#if QT_VERSION >= 0x050200
+#include <QCollator>
+#endif
 
 class UserIdentity;
 class ContactUser;
@@ -72,14 +78,39 @@ signals:
 
 private slots:
     void updateUser(ContactUser *user = 0);
+    void updateOrder();
     void contactAdded(ContactUser *user);
     void contactRemoved(ContactUser *user);
 
 private:
+    /* Contacts are sorted by status, then nickname. The sort key is cached, so the
+     * order stays consistent until a changed contact is repositioned. */
+    struct SortKey
+    {
+        int status;
+#if QT_VERSION >= 0x050200
+        QCollatorSortKey nickname;
+#else
+        QString nickname;
+#endif
+        bool operator<(const SortKey &other) const;
+    };
+
+    class SortKeyLessThan;
+
     UserIdentity *m_identity;
     QList<ContactUser*> contacts;
+    QHash<ContactUser*,SortKey> m_sortKeys;
+    /* Contacts that changed since the order was last updated */
+    QSet<ContactUser*> m_changed;
+    QTimer m_updateTimer;
+#if QT_VERSION >= 0x050200
+    QCollator m_collator;
+#endif
 
     void connectSignals(ContactUser *user);
+    SortKey sortKey(ContactUser *user) const;
+    int insertPosition(ContactUser *user) const;
 };
 
 #endif // CONTACTSMODEL_H
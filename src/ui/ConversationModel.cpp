@@ -1,8 +1,21 @@
 #include "ConversationModel.h"
 #include "protocol/ChatMessageCommand.h"
+#include "core/MessageHistory.h"
+
+/* History is read and cached in pages of this many messages */
+static const int PageSize = 64;
+static const int MaxCachedPages = 16;
+/* Once more messages than this are held in memory, older ones are left to history */
+static const int MaxResidentMessages = 1000;
+
+static bool isDelivered(int status)
+{
+    return status == ConversationModel::Received || status == ConversationModel::Delivered;
+}
 
 ConversationModel::ConversationModel(QObject *parent)
-    : QAbstractListModel(parent), m_contact(0), lastReceivedId(0)
+    : QAbstractListModel(parent), m_contact(0), m_history(0), lastReceivedId(0), m_undeliveredRows(0),
+      m_historyEnd(0), m_historyRows(0), m_pageCache(MaxCachedPages)
 {
 }
 
@@ -13,6 +26,11 @@ void ConversationModel::setContact(ContactUser *contact)
 
     beginResetModel();
     messages.clear();
+    m_pendingIndex.clear();
+    m_pageCache.clear();
+    m_history = 0;
+    m_historyEnd = 0;
+    m_historyRows = 0;
 
     if (m_contact)
         disconnect(m_contact, 0, this, 0);
@@ -22,8 +40,20 @@ void ConversationModel::setContact(ContactUser *contact)
                 SLOT(receiveMessage(ChatMessageData)));
         connect(m_contact, SIGNAL(statusChanged()), this,
                 SLOT(onContactStatusChanged()));
+        /* Opening a conversation shouldn't wait out the reconnect backoff */
+        m_contact->prioritizeConnection();
+
+        m_history = m_contact->history();
+        if (m_history && m_history->isOpen()) {
+            m_historyEnd = m_history->nextSequence();
+            m_historyRows = int(qMin(quint64(PageSize), m_historyEnd - m_history->firstSequence()));
+        } else {
+            m_history = 0;
+        }
     }
 
+    m_undeliveredRows = countUndeliveredRows();
+
     endResetModel();
     emit contactChanged();
 }
@@ -37,10 +67,13 @@ void ConversationModel::sendMessage(const QString &text)
     connect(command, SIGNAL(commandFinished()), this, SLOT(messageReply()));
     command->send(m_contact->conn(), QDateTime::currentDateTime(), text, lastReceivedId);
 
-    beginInsertRows(QModelIndex(), 0, 0);
-    MessageData message = { text, QDateTime::currentDateTime(), command->identifier(), Sending };
-    messages.prepend(message);
-    endInsertRows();
+    int sectionRow = m_undeliveredRows - 1;
+    MessageData message = { text, QDateTime::currentDateTime(), command->identifier(), Sending, 0 };
+    appendToHistory(message);
+    insertMessage(0, message);
+
+    setUndeliveredRows(m_undeliveredRows + 1, (sectionRow >= 0) ? sectionRow + 1 : -1);
+    trimMessages();
 }
 
 void ConversationModel::receiveMessage(const ChatMessageData &data)
@@ -51,41 +84,178 @@ void ConversationModel::receiveMessage(const ChatMessageData &data)
     int row = 0;
     if (data.priorMessageID) {
         for (int i = 0; i < messages.size() && i < 5; i++) {
-            if (messages[i].status == Received ||
-                messages[i].identifier == data.priorMessageID)
-            {
+            const MessageData &m = residentAt(i);
+            if (m.status == Received || m.identifier == data.priorMessageID) {
                 row = i;
                 break;
             }
         }
     }
 
-    beginInsertRows(QModelIndex(), row, row);
-    MessageData message = { data.text.trimmed(), data.when, data.messageID, Received };
+    int sectionRow = m_undeliveredRows - 1;
+    MessageData message = { data.text.trimmed(), data.when, data.messageID, Received, 0 };
+    appendToHistory(message);
     lastReceivedId = data.messageID;
-    messages.insert(row, message);
+    insertMessage(row, message);
+
+    /* A received message ends the run of undelivered messages above it */
+    if (row < m_undeliveredRows)
+        setUndeliveredRows(row, sectionRow + 1);
+    trimMessages();
+}
+
+void ConversationModel::insertMessage(int row, const MessageData &message)
+{
+    int position = messages.size() - row;
+
+    beginInsertRows(QModelIndex(), row, row);
+    messages.insert(position, message);
+
+    /* Only the few newest positions can move */
+    for (QHash<quint16,int>::Iterator it = m_pendingIndex.begin(); it != m_pendingIndex.end(); ++it) {
+        if (*it >= position)
+            ++*it;
+    }
+    if (message.status == Sending)
+        m_pendingIndex.insert(message.identifier, position);
+
     endInsertRows();
 }
 
+void ConversationModel::appendToHistory(MessageData &message)
+{
+    if (!m_history)
+        return;
+
+    MessageHistory::Message hm;
+    hm.time = message.time;
+    hm.text = message.text;
+    hm.identifier = message.identifier;
+    hm.status = MessageHistory::Status(message.status);
+    message.sequence = m_history->append(hm);
+    m_contact->writeSetting("lastMessage", message.time);
+}
+
+/* Messages are logged in the order they arrive, which can differ slightly from the
+ * order shown for messages received out of order. When too many are held in memory,
+ * those older than a boundary are dropped and shown from history instead; the rows
+ * keep their positions, but their contents are replaced by history's order. */
+void ConversationModel::trimMessages()
+{
+    if (!m_history || messages.size() <= MaxResidentMessages)
+        return;
+
+    quint64 boundary = messages.last().sequence;
+    for (int i = 0; i < MaxResidentMessages / 2; i++)
+        boundary = qMin(boundary, residentAt(i).sequence);
+    /* Messages waiting for a reply are kept, so they can be found by identifier */
+    for (QHash<quint16,int>::ConstIterator it = m_pendingIndex.begin(); it != m_pendingIndex.end(); ++it)
+        boundary = qMin(boundary, messages[*it].sequence);
+
+    if (boundary <= m_historyEnd)
+        return;
+
+    int oldSize = messages.size();
+    for (QList<MessageData>::Iterator it = messages.begin(); it != messages.end(); ) {
+        if (it->sequence < boundary)
+            it = messages.erase(it);
+        else
+            ++it;
+    }
+
+    m_historyRows += oldSize - messages.size();
+    m_historyEnd = boundary;
+    m_pageCache.clear();
+    rebuildPendingIndex();
+
+    emit dataChanged(index(messages.size(), 0), index(oldSize - 1, 0));
+    setUndeliveredRows(countUndeliveredRows(), m_undeliveredRows - 1);
+}
+
+void ConversationModel::rebuildPendingIndex()
+{
+    m_pendingIndex.clear();
+    for (int i = 0; i < messages.size(); i++) {
+        if (messages[i].status == Sending)
+            m_pendingIndex.insert(messages[i].identifier, i);
+    }
+}
+
 void ConversationModel::messageReply()
 {
     ChatMessageCommand *command = qobject_cast<ChatMessageCommand*>(sender());
     if (!command)
         return;
 
-    int row = indexOfIdentifier(command->identifier(), true);
-    if (row < 0)
+    QHash<quint16,int>::Iterator it = m_pendingIndex.find(command->identifier());
+    if (it == m_pendingIndex.end())
         return;
+    int row = rowOfPosition(*it);
+    m_pendingIndex.erase(it);
 
-    MessageData &data = messages[row];
+    MessageData &data = residentAt(row);
     data.status = Protocol::isSuccess(command->finalReplyState()) ? Delivered : Error;
+    if (m_history)
+        m_history->setStatus(data.sequence, MessageHistory::Status(data.status));
     emit dataChanged(index(row, 0), index(row, 0));
+
+    if (data.status == Delivered && row < m_undeliveredRows)
+        setUndeliveredRows(row, m_undeliveredRows - 1);
+}
+
+/* Counts undelivered rows from row 0, including history that hasn't been fetched */
+int ConversationModel::countUndeliveredRows()
+{
+    int count = 0;
+    for (int i = messages.size() - 1; i >= 0; i--) {
+        if (isDelivered(messages[i].status))
+            return count;
+        count++;
+    }
+
+    if (!m_history)
+        return count;
+
+    quint64 end = m_historyEnd;
+    while (end > m_history->firstSequence()) {
+        quint64 start = qMax(m_history->firstSequence(), (end > quint64(PageSize)) ? end - PageSize : 0);
+        QList<MessageHistory::Message> page = m_history->read(start, int(end - start));
+        if (page.isEmpty())
+            break;
+
+        for (int i = page.size() - 1; i >= 0; i--) {
+            if (isDelivered(page[i].status))
+                return count;
+            count++;
+        }
+        end = start;
+    }
+
+    return count;
+}
+
+/* previousSectionRow is the row that had the "offline" section, in current row numbers */
+void ConversationModel::setUndeliveredRows(int count, int previousSectionRow)
+{
+    m_undeliveredRows = count;
+
+    int sectionRow = count - 1;
+    if (m_contact->status() == ContactUser::Online || sectionRow == previousSectionRow)
+        return;
+
+    QVector<int> roles(1, SectionRole);
+    if (previousSectionRow >= 0 && previousSectionRow < rowCount())
+        emit dataChanged(index(previousSectionRow, 0), index(previousSectionRow, 0), roles);
+    if (sectionRow >= 0 && sectionRow < rowCount())
+        emit dataChanged(index(sectionRow, 0), index(sectionRow, 0), roles);
 }
 
 void ConversationModel::onContactStatusChanged()
 {
-    // Update in case section has changed
-    emit dataChanged(index(0, 0), index(rowCount()-1, 0), QVector<int>() << SectionRole);
+    // Only the row at the end of the undelivered messages has a section
+    int sectionRow = m_undeliveredRows - 1;
+    if (sectionRow >= 0 && sectionRow < rowCount())
+        emit dataChanged(index(sectionRow, 0), index(sectionRow, 0), QVector<int>() << SectionRole);
 }
 
 QHash<int,QByteArray> ConversationModel::roleNames() const
@@ -103,47 +273,77 @@ int ConversationModel::rowCount(const QModelIndex &parent) const
 {
     if (parent.isValid())
         return 0;
-    return messages.size();
+    return messages.size() + m_historyRows;
 }
 
-QVariant ConversationModel::data(const QModelIndex &index, int role) const
+bool ConversationModel::canFetchMore(const QModelIndex &parent) const
 {
-    if (!index.isValid() || index.row() >= messages.size())
-        return QVariant();
+    if (parent.isValid() || !m_history)
+        return false;
+    return quint64(m_historyRows) < m_historyEnd - m_history->firstSequence();
+}
 
-    const MessageData &message = messages[index.row()];
+void ConversationModel::fetchMore(const QModelIndex &parent)
+{
+    if (!canFetchMore(parent))
+        return;
 
-    switch (role) {
-        case Qt::DisplayRole: return message.text;
-        case TimestampRole: return message.time;
-        case IsOutgoingRole: return message.status != Received;
-        case StatusRole: return message.status;
-
-        case SectionRole: {
-            if (m_contact->status() == ContactUser::Online)
-                return QString();
-            if (index.row() < messages.size() - 1) {
-                const MessageData &next = messages[index.row()+1];
-                if (next.status != Received && next.status != Delivered)
-                    return QString();
-            }
-            for (int i = 0; i <= index.row(); i++) {
-                if (messages[i].status == Received || messages[i].status == Delivered)
-                    return QString();
-            }
-            return QStringLiteral("offline");
+    int count = int(qMin(quint64(PageSize), m_historyEnd - m_history->firstSequence() - m_historyRows));
+    int first = rowCount();
+    beginInsertRows(QModelIndex(), first, first + count - 1);
+    m_historyRows += count;
+    endInsertRows();
+}
+
+const ConversationModel::MessageData *ConversationModel::messageAt(int row) const
+{
+    if (row < 0 || row >= rowCount())
+        return 0;
+    if (row < messages.size())
+        return &messages[messages.size() - 1 - row];
+
+    quint64 sequence = m_historyEnd - 1 - quint64(row - messages.size());
+    quint64 page = sequence / PageSize;
+
+    QList<MessageData> *data = m_pageCache.object(page);
+    if (!data) {
+        data = new QList<MessageData>;
+        QList<MessageHistory::Message> read = m_history->read(page * PageSize, PageSize);
+        foreach (const MessageHistory::Message &hm, read) {
+            MessageData message = { hm.text, hm.time, hm.identifier, MessageStatus(hm.status), hm.sequence };
+            data->append(message);
         }
+        m_pageCache.insert(page, data);
     }
 
-    return QVariant();
+    if (data->isEmpty() || sequence < data->first().sequence)
+        return 0;
+    int i = int(sequence - data->first().sequence);
+    if (i >= data->size())
+        return 0;
+    return &data->at(i);
 }
 
-int ConversationModel::indexOfIdentifier(quint16 identifier, bool isOutgoing) const
+QVariant ConversationModel::data(const QModelIndex &index, int role) const
 {
-    for (int i = 0; i < messages.size(); i++) {
-        if (messages[i].identifier == identifier && (messages[i].status != Received) == isOutgoing)
-            return i;
+    if (!index.isValid())
+        return QVariant();
+
+    const MessageData *message = messageAt(index.row());
+    if (!message)
+        return QVariant();
+
+    switch (role) {
+        case Qt::DisplayRole: return message->text;
+        case TimestampRole: return message->time;
+        case IsOutgoingRole: return message->status != Received;
+        case StatusRole: return message->status;
+
+        case SectionRole:
+            if (m_contact->status() != ContactUser::Online && index.row() == m_undeliveredRows - 1)
+                return QStringLiteral("offline");
+            return QString();
     }
-    return -1;
-}
 
+    return QVariant();
+}
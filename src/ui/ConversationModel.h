@@ -3,8 +3,12 @@
 
 #include <QAbstractListModel>
 #include <QDateTime>
+#include <QCache>
+#include <QHash>
 #include "core/ContactUser.h"
 
+class MessageHistory;
+
 class ConversationModel : public QAbstractListModel
 {
     Q_OBJECT
@@ -35,6 +39,8 @@ public:
     virtual QHash<int,QByteArray> roleNames() const;
     virtual int rowCount(const QModelIndex &parent = QModelIndex()) const;
     virtual QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    virtual bool canFetchMore(const QModelIndex &parent) const;
+    virtual void fetchMore(const QModelIndex &parent);
 
 public slots:
     void sendMessage(const QString &text);
@@ -53,13 +59,36 @@ private:
         QDateTime time;
         quint16 identifier;
         MessageStatus status;
+        quint64 sequence;
     };
 
     ContactUser *m_contact;
+    MessageHistory *m_history;
+    /* Messages since the contact was set, oldest first; the last is row 0 */
     QList<MessageData> messages;
     quint16 lastReceivedId;
-
-    int indexOfIdentifier(quint16 identifier, bool isOutgoing) const;
+    /* Position in messages of outgoing messages waiting for a reply, by identifier */
+    QHash<quint16,int> m_pendingIndex;
+    /* Number of rows, from row 0, of outgoing messages that weren't delivered. While
+     * the contact is offline, the oldest of them is in the "offline" section. */
+    int m_undeliveredRows;
+
+    /* Rows after messages are read from history, newest first, starting below
+     * m_historyEnd. m_historyRows of them have been fetched by the view, and
+     * recently used pages of them are cached. */
+    quint64 m_historyEnd;
+    int m_historyRows;
+    mutable QCache<quint64,QList<MessageData> > m_pageCache;
+
+    MessageData &residentAt(int row) { return messages[messages.size() - 1 - row]; }
+    int rowOfPosition(int position) const { return messages.size() - 1 - position; }
+    const MessageData *messageAt(int row) const;
+    void insertMessage(int row, const MessageData &message);
+    void appendToHistory(MessageData &message);
+    void trimMessages();
+    void rebuildPendingIndex();
+    int countUndeliveredRows();
+    void setUndeliveredRows(int count, int previousSectionRow);
 };
 
 #endif
@@ -43,6 +43,7 @@
 #include "ui/AvatarImageProvider.h"
 #include "ContactsModel.h"
 #include "ui/ConversationModel.h"
+#include "ui/MessageSearchModel.h"
 #include <QtQml>
 #include <QQmlApplicationEngine>
 #include <QQmlContext>
@@ -68,6 +69,7 @@ MainWindow::MainWindow(QObject *parent)
     qmlRegisterUncreatableType<Tor::TorControl>("org.torsionim.torsion", 1, 0, "TorControl", QString());
     qmlRegisterUncreatableType<Tor::TorProcess>("org.torsionim.torsion", 1, 0, "TorProcess", QString());
     qmlRegisterType<ConversationModel>("org.torsionim.torsion", 1, 0, "ConversationModel");
+    qmlRegisterType<MessageSearchModel>("org.torsionim.torsion", 1, 0, "MessageSearchModel");
     qmlRegisterType<ContactsModel>("org.torsionim.torsion", 1, 0, "ContactsModel");
     qmlRegisterType<ContactIDValidator>("org.torsionim.torsion", 1, 0, "ContactIDValidator");
 
@@ -0,0 +1,180 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "MessageSearchModel.h"
+#include "core/MessageHistory.h"
+#include "core/MessageSearchIndex.h"
+#include <QElapsedTimer>
+#include <QDebug>
+
+static const int PageSize = 50;
+
+MessageSearchModel::MessageSearchModel(QObject *parent)
+    : QAbstractListModel(parent)
+{
+}
+
+void MessageSearchModel::setContact(ContactUser *contact)
+{
+    if (contact == m_contact)
+        return;
+
+    m_contact = contact;
+    updateResults();
+    emit contactChanged();
+}
+
+void MessageSearchModel::setQuery(const QString &query)
+{
+    if (query == m_query)
+        return;
+
+    m_query = query;
+    updateResults();
+    emit queryChanged();
+}
+
+void MessageSearchModel::updateResults()
+{
+    beginResetModel();
+    m_rows.clear();
+    m_results.clear();
+    m_terms = MessageSearchIndex::terms(m_query);
+
+    if (m_contact && !m_terms.isEmpty()) {
+        MessageHistory *history = m_contact->history();
+        QElapsedTimer timer;
+        timer.start();
+        m_results = history->search(m_query);
+        if (history->isSearchReady()) {
+            qDebug() << "Message search found" << m_results.size() << "results in" << timer.elapsed() << "ms";
+        } else {
+            /* Searched again once the index has loaded */
+            connect(history, SIGNAL(searchReady()), this, SLOT(updateResults()), Qt::UniqueConnection);
+        }
+    }
+
+    endResetModel();
+    emit resultsChanged();
+}
+
+QHash<int,QByteArray> MessageSearchModel::roleNames() const
+{
+    QHash<int, QByteArray> roles;
+    roles[Qt::DisplayRole] = "text";
+    roles[TimestampRole] = "timestamp";
+    roles[IsOutgoingRole] = "isOutgoing";
+    roles[SequenceRole] = "sequence";
+    roles[HighlightsRole] = "highlights";
+    return roles;
+}
+
+int MessageSearchModel::rowCount(const QModelIndex &parent) const
+{
+    if (parent.isValid())
+        return 0;
+    return m_rows.size();
+}
+
+QVariant MessageSearchModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_rows.size())
+        return QVariant();
+
+    const Result &result = m_rows[index.row()];
+    switch (role) {
+        case Qt::DisplayRole: return result.text;
+        case TimestampRole: return result.time;
+        case IsOutgoingRole: return result.isOutgoing;
+        case SequenceRole: return result.sequence;
+        case HighlightsRole: return result.highlights;
+    }
+
+    return QVariant();
+}
+
+bool MessageSearchModel::canFetchMore(const QModelIndex &parent) const
+{
+    return !parent.isValid() && m_rows.size() < m_results.size();
+}
+
+void MessageSearchModel::fetchMore(const QModelIndex &parent)
+{
+    if (!canFetchMore(parent))
+        return;
+
+    if (!m_contact) {
+        beginResetModel();
+        m_rows.clear();
+        m_results.clear();
+        endResetModel();
+        emit resultsChanged();
+        return;
+    }
+
+    MessageHistory *history = m_contact->history();
+    int first = m_rows.size();
+    int last = qMin(first + PageSize, m_results.size()) - 1;
+
+    /* Results are newest first; the page's messages are read in one pass */
+    QHash<quint64,MessageHistory::Message> messages;
+    foreach (const MessageHistory::Message &message, history->readSequences(m_results.mid(first, last - first + 1)))
+        messages.insert(message.sequence, message);
+
+    QList<Result> page;
+    for (int i = first; i <= last; i++) {
+        Result result;
+        result.sequence = m_results[i];
+        result.isOutgoing = false;
+
+        QHash<quint64,MessageHistory::Message>::ConstIterator it = messages.constFind(result.sequence);
+        if (it != messages.constEnd()) {
+            const MessageHistory::Message &message = *it;
+            result.text = message.text;
+            result.time = message.time;
+            result.isOutgoing = (message.status != MessageHistory::Received);
+
+            foreach (const MessageSearchIndex::Highlight &h, MessageSearchIndex::highlights(message.text, m_terms)) {
+                QVariantMap highlight;
+                highlight.insert(QStringLiteral("start"), h.start);
+                highlight.insert(QStringLiteral("length"), h.length);
+                result.highlights.append(highlight);
+            }
+        }
+
+        page.append(result);
+    }
+
+    beginInsertRows(QModelIndex(), first, last);
+    m_rows.append(page);
+    endInsertRows();
+}
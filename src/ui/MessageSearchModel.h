@@ -0,0 +1,107 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MESSAGESEARCHMODEL_H
+#define MESSAGESEARCHMODEL_H
+
+#include <QAbstractListModel>
+#include <QDateTime>
+#include <QVector>
+#include <QStringList>
+#include <QPointer>
+#include "core/ContactUser.h"
+
+/* Messages in a contact's history matching a search query, newest first.
+ *
+ * The matching sequence numbers are found at once from the history's search
+ * index, or when it has loaded on first use; the messages themselves are read a page at a time as the view
+ * fetches them. The highlights role lists the {start, length} of each
+ * matched word in the text. */
+class MessageSearchModel : public QAbstractListModel
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(MessageSearchModel)
+
+    Q_PROPERTY(ContactUser* contact READ contact WRITE setContact NOTIFY contactChanged)
+    Q_PROPERTY(QString query READ query WRITE setQuery NOTIFY queryChanged)
+    Q_PROPERTY(int resultCount READ resultCount NOTIFY resultsChanged)
+
+public:
+    enum {
+        TimestampRole = Qt::UserRole,
+        IsOutgoingRole,
+        SequenceRole,
+        HighlightsRole
+    };
+
+    MessageSearchModel(QObject *parent = 0);
+
+    ContactUser *contact() const { return m_contact; }
+    void setContact(ContactUser *contact);
+
+    QString query() const { return m_query; }
+    void setQuery(const QString &query);
+
+    int resultCount() const { return m_results.size(); }
+
+    virtual QHash<int,QByteArray> roleNames() const;
+    virtual int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    virtual QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    virtual bool canFetchMore(const QModelIndex &parent) const;
+    virtual void fetchMore(const QModelIndex &parent);
+
+signals:
+    void contactChanged();
+    void queryChanged();
+    void resultsChanged();
+
+private:
+    struct Result {
+        quint64 sequence;
+        QString text;
+        QDateTime time;
+        bool isOutgoing;
+        QVariantList highlights;
+    };
+
+    QPointer<ContactUser> m_contact;
+    QString m_query;
+    QStringList m_terms;
+    /* All matching sequences, newest first; the first rows of them are read */
+    QVector<quint64> m_results;
+    QList<Result> m_rows;
+
+private slots:
+    void updateResults();
+};
+
+#endif // MESSAGESEARCHMODEL_H
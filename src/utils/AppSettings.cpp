@@ -34,8 +34,51 @@
 #include <QMetaObject>
 #include <QMetaProperty>
 #include <QDir>
+#include <QFileInfo>
+#include <QDataStream>
+#include <QEvent>
 #include <QDebug>
 
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+/* Pending changes are written to the settings file after this long, or as soon as there
+ * are MaxPendingChanges of them. The journal keeps them safe in the meantime. */
+static const int FlushInterval = 30000;
+static const int MaxPendingChanges = 512;
+
+AppSettings::AppSettings(QObject *parent)
+    : QSettings(parent), keyChangeSource(0), m_pendingChanges(0), m_statChanges(0), m_statFileWrites(0),
+      m_statJournalSyncs(0)
+{
+}
+
+AppSettings::AppSettings(const QString &filename, Format format, QObject *parent)
+    : QSettings(filename, format, parent), keyChangeSource(0), m_pendingChanges(0), m_statChanges(0),
+      m_statFileWrites(0), m_statJournalSyncs(0)
+{
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(FlushInterval);
+    connect(&m_flushTimer, SIGNAL(timeout()), SLOT(flush()));
+
+    /* Journal writes are synced to disk once per event loop iteration */
+    m_journalSyncTimer.setSingleShot(true);
+    m_journalSyncTimer.setInterval(0);
+    connect(&m_journalSyncTimer, SIGNAL(timeout()), SLOT(syncJournal()));
+
+    m_statisticsTime.start();
+    openJournal();
+}
+
+AppSettings::~AppSettings()
+{
+    flush();
+}
+
 QString AppSettings::configLocation() const
 {
     QString s = QDir::fromNativeSeparators(fileName());
@@ -45,16 +88,255 @@ QString AppSettings::configLocation() const
 
 void AppSettings::setValue(const QString &key, const QVariant &value)
 {
+    if (m_journal.isOpen())
+        appendJournal(JournalSetValue, fullKey(key), value);
     QSettings::setValue(key, value);
+    changeQueued();
     keyChanged(group() + key, value);
 }
 
 void AppSettings::remove(const QString &key)
 {
+    if (m_journal.isOpen())
+        appendJournal(JournalRemove, fullKey(key));
     QSettings::remove(key);
+    changeQueued();
     keyChanged(group() + key, QVariant());
 }
 
+QString AppSettings::fullKey(const QString &key) const
+{
+    QString g = group();
+    if (g.isEmpty())
+        return key;
+    return g + QLatin1Char('/') + key;
+}
+
+bool AppSettings::event(QEvent *e)
+{
+    /* QSettings posts UpdateRequest to itself after a change, and rewrites the entire file
+     * when it arrives. While journaling, the file is only written by flush(). */
+    if (e->type() == QEvent::UpdateRequest && m_journal.isOpen())
+        return true;
+
+    return QSettings::event(e);
+}
+
+void AppSettings::changeQueued()
+{
+    if (!m_journal.isOpen())
+        return;
+
+    m_statChanges++;
+    m_pendingChanges++;
+
+    if (m_pendingChanges >= MaxPendingChanges) {
+        flush();
+        return;
+    }
+
+    if (!m_flushTimer.isActive())
+        m_flushTimer.start();
+}
+
+void AppSettings::flush()
+{
+    m_flushTimer.stop();
+    if (!m_pendingChanges)
+        return;
+
+    QSettings::sync();
+    m_statFileWrites++;
+
+    if (status() != QSettings::NoError || !syncSettingsFile()) {
+        /* Everything is still in the journal; try again later */
+        qWarning() << "AppSettings: Writing settings to" << fileName() << "failed; will retry";
+        m_flushTimer.start();
+        return;
+    }
+
+    m_pendingChanges = 0;
+    if (m_journal.isOpen()) {
+        m_journalSyncTimer.stop();
+        if (!m_journal.resize(0))
+            qWarning() << "AppSettings: Cannot truncate settings journal:" << m_journal.errorString();
+    }
+
+    logStatistics();
+}
+
+void AppSettings::openJournal()
+{
+    m_journal.setFileName(fileName() + QLatin1String(".journal"));
+
+    int replayed = 0;
+    if (m_journal.exists() && m_journal.size() > 0)
+        replayed = replayJournal();
+
+    /* If replayed changes couldn't be written to the settings file, keep the journal intact */
+    bool keep = replayed && (status() != QSettings::NoError || !syncSettingsFile());
+    if (!m_journal.open(QIODevice::WriteOnly | (keep ? QIODevice::Append : QIODevice::Truncate))) {
+        qWarning() << "AppSettings: Cannot open settings journal" << m_journal.fileName() << ":"
+                   << m_journal.errorString() << "- settings will be written directly";
+        return;
+    }
+
+    if (keep) {
+        m_pendingChanges = replayed;
+        m_flushTimer.start();
+    }
+}
+
+/* Each journal record is:
+ *   [quint32 payload size][quint16 payload checksum][payload]
+ * with the payload a QDataStream of [quint8 operation][QString key][QVariant value]. Keys are
+ * absolute, independent of the group active when the change was made. A record that is
+ * incomplete or fails its checksum was torn by a crash, and ends the journal. */
+int AppSettings::replayJournal()
+{
+    QFile file(m_journal.fileName());
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "AppSettings: Cannot read settings journal" << file.fileName() << ":" << file.errorString();
+        return 0;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    int count = 0;
+    for (;;) {
+        quint32 size;
+        quint16 checksum;
+        if (file.bytesAvailable() < 6)
+            break;
+        stream >> size >> checksum;
+        if (size > quint64(file.bytesAvailable()))
+            break;
+
+        QByteArray payload(size, 0);
+        if (stream.readRawData(payload.data(), size) != int(size))
+            break;
+        if (qChecksum(payload.constData(), size) != checksum)
+            break;
+
+        QDataStream ps(payload);
+        ps.setVersion(QDataStream::Qt_5_0);
+        quint8 op;
+        QString key;
+        QVariant value;
+        ps >> op >> key >> value;
+        if (ps.status() != QDataStream::Ok)
+            break;
+
+        if (op == JournalSetValue)
+            QSettings::setValue(key, value);
+        else if (op == JournalRemove)
+            QSettings::remove(key);
+        else
+            break;
+        count++;
+    }
+
+    if (file.bytesAvailable())
+        qWarning() << "AppSettings: Ignoring" << file.bytesAvailable() << "bytes of incomplete settings journal";
+    file.close();
+
+    if (count) {
+        qDebug() << "AppSettings: Recovered" << count << "changes from settings journal";
+        QSettings::sync();
+        m_statFileWrites++;
+    }
+
+    return count;
+}
+
+void AppSettings::appendJournal(JournalOperation op, const QString &key, const QVariant &value)
+{
+    QByteArray payload;
+    {
+        QDataStream ps(&payload, QIODevice::WriteOnly);
+        ps.setVersion(QDataStream::Qt_5_0);
+        ps << quint8(op) << key << value;
+    }
+
+    QByteArray record;
+    {
+        QDataStream rs(&record, QIODevice::WriteOnly);
+        rs << quint32(payload.size()) << quint16(qChecksum(payload.constData(), payload.size()));
+    }
+    record.append(payload);
+
+    /* Written through to the OS immediately, so the change survives if the process dies */
+    if (m_journal.write(record) != record.size() || !m_journal.flush()) {
+        qWarning() << "AppSettings: Writing settings journal failed:" << m_journal.errorString()
+                   << "- settings will be written directly";
+        m_journal.close();
+        m_pendingChanges++;
+        flush();
+        if (!m_pendingChanges)
+            QFile::remove(m_journal.fileName());
+        return;
+    }
+
+    if (!m_journalSyncTimer.isActive())
+        m_journalSyncTimer.start();
+}
+
+/* QSettings replaces the file without syncing it; the journal may only be discarded
+ * once the new file and its directory entry are on disk */
+bool AppSettings::syncSettingsFile()
+{
+    QFile file(fileName());
+#ifdef Q_OS_WIN
+    bool ok = file.open(QIODevice::ReadWrite) && _commit(file.handle()) == 0;
+#else
+    bool ok = file.open(QIODevice::ReadOnly) && fsync(file.handle()) == 0;
+#endif
+    if (!ok) {
+        qWarning() << "AppSettings: Cannot sync settings file" << fileName() << ":" << file.errorString();
+        return false;
+    }
+
+#ifndef Q_OS_WIN
+    int dir = ::open(QFile::encodeName(QFileInfo(fileName()).absolutePath()).constData(), O_RDONLY);
+    if (dir >= 0) {
+        fsync(dir);
+        ::close(dir);
+    }
+#endif
+    return true;
+}
+
+void AppSettings::syncJournal()
+{
+    if (!m_journal.isOpen() || !m_pendingChanges)
+        return;
+
+    /* Without write-behind, QSettings would have rewritten the settings file here instead */
+    int fd = m_journal.handle();
+#ifdef Q_OS_WIN
+    _commit(fd);
+#else
+    fsync(fd);
+#endif
+    m_statJournalSyncs++;
+
+    logStatistics();
+}
+
+void AppSettings::logStatistics()
+{
+    if (m_statisticsTime.elapsed() < 60000)
+        return;
+
+    qDebug() << "AppSettings:" << m_statChanges << "changes in the last" << (m_statisticsTime.elapsed() / 1000)
+             << "seconds;" << m_statFileWrites << "settings file writes," << m_statJournalSyncs
+             << "journal syncs (previously each would have been a settings file write)";
+
+    m_statChanges = m_statFileWrites = m_statJournalSyncs = 0;
+    m_statisticsTime.restart();
+}
+
 bool AppSettings::addTrackingProperty(const QString &key, QObject *object, const char *propname)
 {
     const QMetaObject *metaObject = object->metaObject();
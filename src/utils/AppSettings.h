@@ -35,6 +35,9 @@
 
 #include <QSettings>
 #include <QMultiHash>
+#include <QFile>
+#include <QTimer>
+#include <QElapsedTimer>
 
 class AppSettings : public QSettings
 {
@@ -42,15 +45,11 @@ class AppSettings : public QSettings
     Q_DISABLE_COPY(AppSettings)
 
 public:
-    AppSettings(QObject *parent = 0)
-        : QSettings(parent), keyChangeSource(0)
-    {
-    }
-
-    AppSettings(const QString &filename, Format format, QObject *parent = 0)
-        : QSettings(filename, format, parent), keyChangeSource(0)
-    {
-    }
+    AppSettings(QObject *parent = 0);
+    /* Settings stored in a file are written behind: changes are appended to a journal
+     * immediately, and the settings file itself is only rewritten by flush(). */
+    AppSettings(const QString &filename, Format format, QObject *parent = 0);
+    virtual ~AppSettings();
 
     QString configLocation() const;
 
@@ -77,9 +76,18 @@ public:
      * If the property does not have a notify signal, the connection will be unidirectional. */
     bool addTrackingProperty(const QString &key, QObject *object, const char *property = 0);
 
+    /* Number of changes held in memory and the journal that are not yet in the settings file */
+    int pendingChanges() const { return m_pendingChanges; }
+
 public slots:
     void removeTrackingProperty(QObject *object);
 
+    /* Rewrite the settings file with all pending changes and discard the journal */
+    void flush();
+
+protected:
+    virtual bool event(QEvent *e);
+
 private slots:
     void keyChanged(const QString &key, const QVariant &value);
     void objectChanged(QObject *object, int index);
@@ -94,10 +102,37 @@ private slots:
     void objectChanged3() { objectChanged(sender(), 3); }
     void objectChanged4() { objectChanged(sender(), 4); }
 
+    void syncJournal();
+
 private:
+    enum JournalOperation
+    {
+        JournalSetValue = 1,
+        JournalRemove = 2
+    };
+
     QMultiHash<QString,QObject*> trackingKeyMap;
     QMultiHash<QObject*,QPair<QString,int> > trackingObjectMap;
     QObject *keyChangeSource;
+
+    QFile m_journal;
+    QTimer m_flushTimer;
+    QTimer m_journalSyncTimer;
+    int m_pendingChanges;
+
+    /* Statistics, reported once per minute */
+    QElapsedTimer m_statisticsTime;
+    int m_statChanges;
+    int m_statFileWrites;
+    int m_statJournalSyncs;
+
+    QString fullKey(const QString &key) const;
+    void openJournal();
+    bool syncSettingsFile();
+    int replayJournal();
+    void appendJournal(JournalOperation op, const QString &key, const QVariant &value = QVariant());
+    void changeQueued();
+    void logStatistics();
 };
 
 extern AppSettings *config;
@@ -36,6 +36,20 @@
 #include <QFile>
 #include <openssl/bio.h>
 #include <openssl/pem.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <openssl/rsa.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define HAVE_ED25519
+#endif
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 void base32_encode(char *dest, unsigned destlen, const char *src, unsigned srclen);
 bool base32_decode(char *dest, unsigned destlen, const char *src, unsigned srclen);
@@ -56,6 +70,11 @@ CryptoKey::Data::~Data()
         RSA_free(key);
         key = 0;
     }
+    if (pkey)
+    {
+        EVP_PKEY_free(pkey);
+        pkey = 0;
+    }
 }
 
 void CryptoKey::clear()
@@ -65,6 +84,31 @@ void CryptoKey::clear()
 
 bool CryptoKey::loadFromData(const QByteArray &data, bool privateKey)
 {
+    /* RSA keys are in PKCS#1 ("BEGIN RSA ..."), everything else in PKCS#8 or SubjectPublicKeyInfo */
+    if (!data.contains("-----BEGIN RSA "))
+    {
+#ifdef HAVE_ED25519
+        BIO *b = BIO_new_mem_buf((void*)data.constData(), -1);
+        EVP_PKEY *key;
+        if (privateKey)
+            key = PEM_read_bio_PrivateKey(b, NULL, NULL, NULL);
+        else
+            key = PEM_read_bio_PUBKEY(b, NULL, NULL, NULL);
+        BIO_free(b);
+
+        if (key && EVP_PKEY_id(key) == EVP_PKEY_ED25519)
+        {
+            d = new Data(key);
+            return true;
+        }
+
+        if (key)
+            EVP_PKEY_free(key);
+#endif
+        qWarning() << "Failed to parse" << (privateKey ? "private" : "public") << "key from data";
+        return false;
+    }
+
     BIO *b = BIO_new_mem_buf((void*)data.constData(), -1);
 
     RSA *key;
@@ -94,20 +138,104 @@ bool CryptoKey::loadFromFile(const QString &path, bool privateKey)
         return false;
     }
 
-    QByteArray data = file.readAll();
+    /* Key files are read into memory that is kept out of swap where possible,
+     * and wiped as soon as the key is parsed. */
+    qint64 size = file.size();
+    if (size <= 0 || size > 65536)
+    {
+        qWarning() << "Failed to read key from" << path << "- invalid size";
+        return false;
+    }
+
+    QByteArray data(int(size) + 1, 0);
+#ifdef Q_OS_WIN
+    bool locked = VirtualLock(data.data(), data.size());
+#else
+    bool locked = mlock(data.constData(), data.size()) == 0;
+#endif
+
+    bool ok = file.read(data.data(), size) == size;
     file.close();
+    if (ok)
+        ok = loadFromData(data, privateKey);
+    else
+        qWarning() << "Failed to read key from" << path << "-" << file.errorString();
+
+    OPENSSL_cleanse(data.data(), data.size());
+    if (locked)
+    {
+#ifdef Q_OS_WIN
+        VirtualUnlock(data.data(), data.size());
+#else
+        munlock(data.constData(), data.size());
+#endif
+    }
 
-    return loadFromData(data, privateKey);
+    return ok;
+}
+
+bool CryptoKey::isSupported(Type type)
+{
+#ifdef HAVE_ED25519
+    Q_UNUSED(type);
+    return true;
+#else
+    return type != Ed25519;
+#endif
+}
+
+bool CryptoKey::generate(Type type)
+{
+    clear();
+
+#ifdef HAVE_ED25519
+    if (type == Ed25519)
+    {
+        EVP_PKEY *key = 0;
+        EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, NULL);
+        bool ok = ctx && EVP_PKEY_keygen_init(ctx) == 1 && EVP_PKEY_keygen(ctx, &key) == 1;
+        EVP_PKEY_CTX_free(ctx);
+
+        if (!ok)
+        {
+            qWarning() << "Failed to generate Ed25519 key";
+            return false;
+        }
+
+        d = new Data(key);
+        return true;
+    }
+#endif
+
+    qWarning() << "Generating keys of type" << type << "is not supported";
+    return false;
 }
 
 bool CryptoKey::isPrivate() const
 {
-    return isLoaded() && d->key->p != 0;
+    if (!isLoaded())
+        return false;
+
+#ifdef HAVE_ED25519
+    if (d->pkey)
+    {
+        size_t len = 0;
+        return EVP_PKEY_get_raw_private_key(d->pkey, NULL, &len) == 1 && len == 32;
+    }
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    const BIGNUM *p = 0;
+    RSA_get0_factors(d->key, &p, NULL);
+    return p != 0;
+#else
+    return d->key->p != 0;
+#endif
 }
 
 QByteArray CryptoKey::publicKeyDigest() const
 {
-    if (!isLoaded())
+    if (!isLoaded() || !d->key)
         return QByteArray();
 
     int len = i2d_RSAPublicKey(d->key, NULL);
@@ -147,7 +275,13 @@ QByteArray CryptoKey::encodedPublicKey() const
 
     BIO *b = BIO_new(BIO_s_mem());
 
-    if (!PEM_write_bio_RSAPublicKey(b, d->key))
+    bool ok;
+    if (d->pkey)
+        ok = PEM_write_bio_PUBKEY(b, d->pkey);
+    else
+        ok = PEM_write_bio_RSAPublicKey(b, d->key);
+
+    if (!ok)
     {
         qWarning() << "Failed to encode public key";
         BIO_free(b);
@@ -167,11 +301,108 @@ QByteArray CryptoKey::encodedPublicKey() const
     return re;
 }
 
+QByteArray CryptoKey::encodedPrivateKey() const
+{
+    if (!isPrivate())
+        return QByteArray();
+
+    BIO *b = BIO_new(BIO_s_mem());
+
+    bool ok;
+    if (d->pkey)
+        ok = PEM_write_bio_PrivateKey(b, d->pkey, NULL, NULL, 0, NULL, NULL);
+    else
+        ok = PEM_write_bio_RSAPrivateKey(b, d->key, NULL, NULL, 0, NULL, NULL);
+
+    if (!ok)
+    {
+        qWarning() << "Failed to encode private key";
+        BIO_free(b);
+        return QByteArray();
+    }
+
+    char *data;
+    long length = BIO_get_mem_data(b, &data);
+    QByteArray re(data, int(length));
+    BIO_free(b);
+
+    return re;
+}
+
+QByteArray CryptoKey::expandedSecretKey() const
+{
+#ifdef HAVE_ED25519
+    if (!isPrivate() || !d->pkey)
+        return QByteArray();
+
+    unsigned char seed[32];
+    size_t len = sizeof(seed);
+    if (EVP_PKEY_get_raw_private_key(d->pkey, seed, &len) != 1 || len != sizeof(seed))
+        return QByteArray();
+
+    /* As in RFC 8032 5.1.5: the clamped scalar followed by the hash prefix */
+    QByteArray re(SHA512_DIGEST_LENGTH, 0);
+    unsigned char *h = reinterpret_cast<unsigned char*>(re.data());
+    SHA512(seed, sizeof(seed), h);
+    OPENSSL_cleanse(seed, sizeof(seed));
+
+    h[0] &= 248;
+    h[31] &= 127;
+    h[31] |= 64;
+    return re;
+#else
+    return QByteArray();
+#endif
+}
+
+#ifdef HAVE_ED25519
+/* rend-spec-v3 6: CHECKSUM = SHA3-256(".onion checksum" | PUBKEY | VERSION)[:2],
+ * for the 35 byte address PUBKEY | CHECKSUM | VERSION */
+static bool v3AddressChecksum(const unsigned char *address, unsigned char *checksum)
+{
+    unsigned char digest[32];
+    unsigned int digestLength = 0;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool ok = ctx && EVP_DigestInit_ex(ctx, EVP_sha3_256(), NULL) == 1 &&
+              EVP_DigestUpdate(ctx, ".onion checksum", 15) == 1 &&
+              EVP_DigestUpdate(ctx, address, 32) == 1 &&
+              EVP_DigestUpdate(ctx, address + 34, 1) == 1 &&
+              EVP_DigestFinal_ex(ctx, digest, &digestLength) == 1;
+    EVP_MD_CTX_free(ctx);
+
+    if (ok) {
+        checksum[0] = digest[0];
+        checksum[1] = digest[1];
+    }
+    return ok;
+}
+#endif
+
 QString CryptoKey::torServiceID() const
 {
     if (!isLoaded())
         return QString();
 
+#ifdef HAVE_ED25519
+    if (d->pkey)
+    {
+        /* rend-spec-v3 6: base32(PUBKEY | CHECKSUM | VERSION), where
+         * CHECKSUM = SHA3-256(".onion checksum" | PUBKEY | VERSION)[:2] */
+        unsigned char address[35];
+        size_t len = 32;
+        if (EVP_PKEY_get_raw_public_key(d->pkey, address, &len) != 1 || len != 32)
+            return QString();
+        address[34] = 0x03;
+        if (!v3AddressChecksum(address, address + 32))
+            return QString();
+
+        QByteArray re;
+        re.resize(57);
+        base32_encode(re.data(), 57, reinterpret_cast<const char*>(address), sizeof(address));
+        return QString::fromLatin1(re.constData(), 56);
+    }
+#endif
+
     QByteArray digest = publicKeyDigest();
     if (digest.isNull())
         return QString();
@@ -189,6 +420,29 @@ QByteArray CryptoKey::signData(const QByteArray &data) const
     if (!isPrivate())
         return QByteArray();
 
+#ifdef HAVE_ED25519
+    if (d->pkey)
+    {
+        /* Ed25519 signs the message itself; there is no separate digest */
+        QByteArray re(64, 0);
+        size_t sigsize = re.size();
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        bool ok = ctx && EVP_DigestSignInit(ctx, NULL, NULL, NULL, d->pkey) == 1 &&
+                  EVP_DigestSign(ctx, reinterpret_cast<unsigned char*>(re.data()), &sigsize,
+                                 reinterpret_cast<const unsigned char*>(data.constData()), data.size()) == 1;
+        EVP_MD_CTX_free(ctx);
+
+        if (!ok)
+        {
+            qWarning() << "Ed25519 signature failed";
+            return QByteArray();
+        }
+
+        re.truncate(int(sigsize));
+        return re;
+    }
+#endif
+
     QByteArray digest;
     digest.resize(32);
     bool ok = SHA256(reinterpret_cast<const unsigned char*>(data.constData()), data.size(),
@@ -221,6 +475,19 @@ bool CryptoKey::verifySignature(const QByteArray &data, QByteArray signature) co
     if (!isLoaded())
         return false;
 
+#ifdef HAVE_ED25519
+    if (d->pkey)
+    {
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        bool ok = ctx && EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, d->pkey) == 1 &&
+                  EVP_DigestVerify(ctx, reinterpret_cast<const unsigned char*>(signature.constData()),
+                                   signature.size(), reinterpret_cast<const unsigned char*>(data.constData()),
+                                   data.size()) == 1;
+        EVP_MD_CTX_free(ctx);
+        return ok;
+    }
+#endif
+
     QByteArray digest;
     digest.resize(32);
     bool ok = SHA256(reinterpret_cast<const unsigned char*>(data.constData()), data.size(),
@@ -301,6 +568,33 @@ QByteArray torControlHashedPassword(const QByteArray &password)
            QByteArray::fromRawData(reinterpret_cast<const char*>(md), 20).toHex().toUpper();
 }
 
+bool isValidTorServiceID(const QByteArray &serviceID)
+{
+    char decoded[36];
+    if (serviceID.size() == 16)
+        return base32_decode(decoded, sizeof(decoded), serviceID.constData(), 16);
+    if (serviceID.size() != 56 || !base32_decode(decoded, sizeof(decoded), serviceID.constData(), 56))
+        return false;
+
+    if (decoded[34] != 0x03)
+        return false;
+
+#ifdef HAVE_ED25519
+    unsigned char checksum[2];
+    const unsigned char *address = reinterpret_cast<const unsigned char*>(decoded);
+    return v3AddressChecksum(address, checksum) && checksum[0] == address[32] && checksum[1] == address[33];
+#else
+    return true;
+#endif
+}
+
+bool secureCompare(const QByteArray &a, const QByteArray &b)
+{
+    if (a.size() != b.size())
+        return false;
+    return CRYPTO_memcmp(a.constData(), b.constData(), a.size()) == 0;
+}
+
 /* Copyright (c) 2001-2004, Roger Dingledine
  * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson
  * Copyright (c) 2007-2010, The Tor Project, Inc.
@@ -364,10 +658,31 @@ void base32_encode(char *dest, unsigned destlen, const char *src, unsigned srcle
     dest[i] = '\0';
 }
 
-/* Implements base32 decoding as in rfc3548. Requires that srclen*5 is a multiple of 8. */
+/* 5-bit value of each character, or 0xFF if it isn't part of the alphabet. Both cases are accepted. */
+static const quint8 base32Values[256] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+    0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+    0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+/* Implements base32 decoding as in rfc3548. Requires that srclen*5 is a multiple of 8.
+ * Each group of 8 characters is decoded to 5 bytes through the table, without branching
+ * on the input; invalid characters are detected once at the end. */
 bool base32_decode(char *dest, unsigned destlen, const char *src, unsigned srclen)
 {
-    unsigned int i, j, bit;
     unsigned nbits = srclen * 5;
 
      /* We need an even multiple of 8 bits, and enough space */
@@ -376,49 +691,23 @@ bool base32_decode(char *dest, unsigned destlen, const char *src, unsigned srcle
         return false;
     }
 
-    char *tmp = new char[srclen];
-
-    /* Convert base32 encoded chars to the 5-bit values that they represent. */
-    for (j = 0; j < srclen; ++j)
+    quint8 invalid = 0;
+    for (unsigned i = 0; i < srclen; i += 8, dest += 5)
     {
-        if (src[j] > 0x60 && src[j] < 0x7B)
-            tmp[j] = src[j] - 0x61;
-        else if (src[j] > 0x31 && src[j] < 0x38)
-            tmp[j] = src[j] - 0x18;
-        else if (src[j] > 0x40 && src[j] < 0x5B)
-            tmp[j] = src[j] - 0x41;
-        else
+        quint64 v = 0;
+        for (unsigned j = 0; j < 8; ++j)
         {
-            delete[] tmp;
-            return false;
+            quint8 c = base32Values[(quint8)src[i + j]];
+            invalid |= c;
+            v = (v << 5) | (c & 0x1F);
         }
-    }
 
-    /* Assemble result byte-wise by applying five possible cases. */
-    for (i = 0, bit = 0; bit < nbits; ++i, bit += 8)
-    {
-        switch (bit % 40)
-        {
-        case 0:
-            dest[i] = (((quint8)tmp[(bit/5)]) << 3) + (((quint8)tmp[(bit/5)+1]) >> 2);
-            break;
-        case 8:
-            dest[i] = (((quint8)tmp[(bit/5)]) << 6) + (((quint8)tmp[(bit/5)+1]) << 1)
-                      + (((quint8)tmp[(bit/5)+2]) >> 4);
-            break;
-        case 16:
-            dest[i] = (((quint8)tmp[(bit/5)]) << 4) + (((quint8)tmp[(bit/5)+1]) >> 1);
-            break;
-        case 24:
-            dest[i] = (((quint8)tmp[(bit/5)]) << 7) + (((quint8)tmp[(bit/5)+1]) << 2)
-                      + (((quint8)tmp[(bit/5)+2]) >> 3);
-            break;
-        case 32:
-            dest[i] = (((quint8)tmp[(bit/5)]) << 5) + ((quint8)tmp[(bit/5)+1]);
-            break;
-        }
+        dest[0] = char(v >> 32);
+        dest[1] = char(v >> 24);
+        dest[2] = char(v >> 16);
+        dest[3] = char(v >> 8);
+        dest[4] = char(v);
     }
 
-    delete[] tmp;
-    return true;
+    return !(invalid & 0x80);
 }
@@ -37,26 +37,46 @@
 #include <QSharedData>
 #include <QExplicitlySharedDataPointer>
 
+/* RSA-1024 keys, as used by v2 onion services, and Ed25519 keys for v3
+ * services. Ed25519 requires OpenSSL 1.1.1; without it, those keys fail to
+ * load or generate. */
 class CryptoKey
 {
 public:
+    enum Type
+    {
+        RSA1024,
+        Ed25519
+    };
+
     CryptoKey();
     CryptoKey(const CryptoKey &other) : d(other.d) { }
     ~CryptoKey();
 
     static void test(const QString &file);
+    /* False for Ed25519 when built without support for it */
+    static bool isSupported(Type type);
 
     bool loadFromData(const QByteArray &data, bool privateKey = false);
     bool loadFromFile(const QString &path, bool privateKey = false);
+    /* Creates a new private key; only Ed25519 is supported */
+    bool generate(Type type);
     void clear();
 
     bool isValid() const { return d.data() != 0; }
-    bool isLoaded() const { return d.data() && d->key != 0; }
+    bool isLoaded() const { return d.data() && (d->key != 0 || d->pkey != 0); }
     bool isPrivate() const;
+    Type type() const { return (d.data() && d->pkey) ? Ed25519 : RSA1024; }
 
+    /* SHA1 digest of the DER-encoded RSA public key; empty for Ed25519 */
     QByteArray publicKeyDigest() const;
+    /* PEM; PKCS#1 for RSA and SubjectPublicKeyInfo for Ed25519 */
     QByteArray encodedPublicKey() const;
+    QByteArray encodedPrivateKey() const;
+    /* Onion service ID without .onion; 16 characters for RSA, 56 for Ed25519 */
     QString torServiceID() const;
+    /* Secret key in the expanded form Tor expects from ADD_ONION; Ed25519 only */
+    QByteArray expandedSecretKey() const;
 
     /* Raw signatures; no digest */
     QByteArray signData(const QByteArray &data) const;
@@ -66,9 +86,13 @@ private:
     struct Data : public QSharedData
     {
         typedef struct rsa_st RSA;
+        typedef struct evp_pkey_st EVP_PKEY;
         RSA *key;
+        /* Ed25519 keys */
+        EVP_PKEY *pkey;
 
-        Data(RSA *k = 0) : key(k) { }
+        Data(RSA *k = 0) : key(k), pkey(0) { }
+        Data(EVP_PKEY *k) : key(0), pkey(k) { }
         ~Data();
     };
 
@@ -77,4 +101,11 @@ private:
 
 QByteArray torControlHashedPassword(const QByteArray &password);
 
+/* Checks an onion service ID without .onion: 16 base32 characters for v2, or 56 for v3,
+ * whose version and checksum are also verified */
+bool isValidTorServiceID(const QByteArray &serviceID);
+
+/* Comparison that takes the same time regardless of where the data differs; use for secrets */
+bool secureCompare(const QByteArray &a, const QByteArray &b);
+
 #endif // CRYPTOKEY_H
@@ -0,0 +1,279 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "CryptoService.h"
+#include <QRunnable>
+#include <QPointer>
+#include <QAtomicInt>
+#include <QCoreApplication>
+#include <QThread>
+#include <QDebug>
+#include <openssl/crypto.h>
+
+struct CryptoRequest
+{
+    enum Operation
+    {
+        LoadKey,
+        Sign,
+        Verify
+    } operation;
+
+    /* Used directly if loaded; otherwise loaded from keyData or keyFile */
+    CryptoKey key;
+    QByteArray keyData;
+    QString keyFile;
+    bool privateKey;
+
+    QByteArray data;
+    QByteArray signature;
+
+    bool ok;
+    bool finished;
+    QAtomicInt cancelled;
+    /* Only used on the main thread */
+    QPointer<CryptoJob> job;
+
+    CryptoRequest(Operation op) : operation(op), privateKey(false), ok(false), finished(false) { }
+};
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* OpenSSL before 1.1 leaves locking to the application; without it, RSA blinding
+ * and the error queue aren't safe to use from several threads. */
+static QMutex *opensslLocks = 0;
+
+static void opensslLockingCallback(int mode, int n, const char *file, int line)
+{
+    Q_UNUSED(file);
+    Q_UNUSED(line);
+    if (mode & CRYPTO_LOCK)
+        opensslLocks[n].lock();
+    else
+        opensslLocks[n].unlock();
+}
+#endif
+
+class CryptoTask : public QRunnable
+{
+public:
+    CryptoTask(CryptoService *service, const QSharedPointer<CryptoRequest> &request)
+        : m_service(service), m_request(request)
+    {
+    }
+
+    virtual void run()
+    {
+        if (!m_request->cancelled.load())
+            execute(m_request.data());
+
+        QMutexLocker locker(&m_service->m_resultsMutex);
+        bool wasEmpty = m_service->m_results.isEmpty();
+        m_service->m_results.append(m_request);
+        if (wasEmpty)
+            QMetaObject::invokeMethod(m_service, "deliverResults", Qt::QueuedConnection);
+    }
+
+private:
+    CryptoService *m_service;
+    QSharedPointer<CryptoRequest> m_request;
+
+    static void execute(CryptoRequest *r)
+    {
+        if (!r->key.isLoaded()) {
+            bool loaded;
+            if (!r->keyFile.isEmpty())
+                loaded = r->key.loadFromFile(r->keyFile, r->privateKey);
+            else
+                loaded = r->key.loadFromData(r->keyData, r->privateKey);
+            r->keyData.clear();
+            if (!loaded)
+                return;
+        }
+
+        switch (r->operation) {
+        case CryptoRequest::LoadKey:
+            r->ok = true;
+            break;
+        case CryptoRequest::Sign:
+            r->signature = r->key.signData(r->data);
+            r->ok = !r->signature.isNull();
+            break;
+        case CryptoRequest::Verify:
+            r->ok = r->key.verifySignature(r->data, r->signature);
+            break;
+        }
+    }
+};
+
+CryptoJob::CryptoJob(const QSharedPointer<CryptoRequest> &request, QObject *parent)
+    : QObject(parent), d(request)
+{
+}
+
+CryptoJob::~CryptoJob()
+{
+    cancel();
+}
+
+bool CryptoJob::isFinished() const
+{
+    return d->finished;
+}
+
+bool CryptoJob::isOk() const
+{
+    return d->finished && d->ok;
+}
+
+CryptoKey CryptoJob::key() const
+{
+    return d->finished ? d->key : CryptoKey();
+}
+
+QByteArray CryptoJob::signature() const
+{
+    return d->finished ? d->signature : QByteArray();
+}
+
+void CryptoJob::cancel()
+{
+    d->cancelled.store(1);
+}
+
+CryptoService *CryptoService::instance()
+{
+    static CryptoService *p = 0;
+    if (!p)
+        p = new CryptoService(qApp);
+    return p;
+}
+
+CryptoService::CryptoService(QObject *parent)
+    : QObject(parent), m_pending(0)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    if (!CRYPTO_get_locking_callback()) {
+        opensslLocks = new QMutex[CRYPTO_num_locks()];
+        CRYPTO_set_locking_callback(opensslLockingCallback);
+    }
+#endif
+
+    m_pool.setMaxThreadCount(qMax(1, QThread::idealThreadCount()));
+}
+
+CryptoJob *CryptoService::start(const QSharedPointer<CryptoRequest> &request, QObject *parent)
+{
+    if (m_pending >= MaxPending) {
+        qDebug() << "Crypto service is busy; refusing operation";
+        return 0;
+    }
+
+    CryptoJob *job = new CryptoJob(request, parent);
+    request->job = job;
+    m_pending++;
+    m_pool.start(new CryptoTask(this, request));
+    return job;
+}
+
+CryptoJob *CryptoService::loadKey(const QByteArray &data, bool privateKey, QObject *parent)
+{
+    QSharedPointer<CryptoRequest> request(new CryptoRequest(CryptoRequest::LoadKey));
+    request->keyData = data;
+    request->privateKey = privateKey;
+    return start(request, parent);
+}
+
+CryptoJob *CryptoService::loadKeyFromFile(const QString &path, bool privateKey, QObject *parent)
+{
+    QSharedPointer<CryptoRequest> request(new CryptoRequest(CryptoRequest::LoadKey));
+    request->keyFile = path;
+    request->privateKey = privateKey;
+    return start(request, parent);
+}
+
+CryptoJob *CryptoService::sign(const CryptoKey &key, const QByteArray &data, QObject *parent)
+{
+    Q_ASSERT(key.isPrivate());
+
+    QSharedPointer<CryptoRequest> request(new CryptoRequest(CryptoRequest::Sign));
+    request->key = key;
+    request->data = data;
+    return start(request, parent);
+}
+
+CryptoJob *CryptoService::verify(const CryptoKey &key, const QByteArray &data, const QByteArray &signature,
+                                 QObject *parent)
+{
+    Q_ASSERT(key.isLoaded());
+
+    QSharedPointer<CryptoRequest> request(new CryptoRequest(CryptoRequest::Verify));
+    request->key = key;
+    request->data = data;
+    request->signature = signature;
+    return start(request, parent);
+}
+
+CryptoJob *CryptoService::verify(const QByteArray &publicKeyData, const QByteArray &data,
+                                 const QByteArray &signature, QObject *parent)
+{
+    QSharedPointer<CryptoRequest> request(new CryptoRequest(CryptoRequest::Verify));
+    request->keyData = publicKeyData;
+    request->data = data;
+    request->signature = signature;
+    return start(request, parent);
+}
+
+void CryptoService::deliverResults()
+{
+    QList<QSharedPointer<CryptoRequest> > results;
+    {
+        QMutexLocker locker(&m_resultsMutex);
+        results.swap(m_results);
+    }
+
+    foreach (const QSharedPointer<CryptoRequest> &request, results) {
+        m_pending--;
+        if (request->cancelled.load() || !request->job)
+            continue;
+
+        request->finished = true;
+        emit request->job->finished();
+    }
+}
+
+void CryptoService::waitForDone()
+{
+    while (m_pending) {
+        m_pool.waitForDone();
+        deliverResults();
+    }
+}
@@ -0,0 +1,125 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CRYPTOSERVICE_H
+#define CRYPTOSERVICE_H
+
+#include <QObject>
+#include <QMutex>
+#include <QList>
+#include <QSharedPointer>
+#include <QThreadPool>
+#include "CryptoKey.h"
+
+struct CryptoRequest;
+class CryptoService;
+
+/* Handle for an operation running on the CryptoService.
+ *
+ * finished() is emitted on the thread that created the job once results are
+ * available. Deleting the job, or calling cancel(), abandons the operation;
+ * it is skipped if it hasn't started, and its result is discarded otherwise. */
+class CryptoJob : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(CryptoJob)
+
+    friend class CryptoService;
+
+public:
+    virtual ~CryptoJob();
+
+    bool isFinished() const;
+    /* True if the operation succeeded; for verification, if the signature is valid */
+    bool isOk() const;
+
+    /* Key used for the operation, including one loaded by the job */
+    CryptoKey key() const;
+    /* Result of a signing operation */
+    QByteArray signature() const;
+
+    void cancel();
+
+signals:
+    void finished();
+
+private:
+    QSharedPointer<CryptoRequest> d;
+
+    CryptoJob(const QSharedPointer<CryptoRequest> &request, QObject *parent);
+};
+
+/* Runs RSA key loading, signing and verification on a pool of worker threads,
+ * so these never block the event loop.
+ *
+ * Each call returns a CryptoJob owned by parent, or 0 if MaxPending operations
+ * are already waiting; callers should treat that as a temporary failure. */
+class CryptoService : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(CryptoService)
+
+public:
+    static const int MaxPending = 64;
+
+    static CryptoService *instance();
+
+    CryptoJob *loadKey(const QByteArray &data, bool privateKey, QObject *parent);
+    CryptoJob *loadKeyFromFile(const QString &path, bool privateKey, QObject *parent);
+    CryptoJob *sign(const CryptoKey &key, const QByteArray &data, QObject *parent);
+    CryptoJob *verify(const CryptoKey &key, const QByteArray &data, const QByteArray &signature, QObject *parent);
+    /* Loads the encoded public key and verifies with it; the key is available from the job */
+    CryptoJob *verify(const QByteArray &publicKeyData, const QByteArray &data, const QByteArray &signature,
+                      QObject *parent);
+
+    int pendingCount() const { return m_pending; }
+    /* Completes all pending operations before returning */
+    void waitForDone();
+
+private slots:
+    void deliverResults();
+
+private:
+    friend class CryptoTask;
+
+    QThreadPool m_pool;
+    int m_pending;
+    /* Completed requests waiting for the main thread, protected by m_resultsMutex */
+    QMutex m_resultsMutex;
+    QList<QSharedPointer<CryptoRequest> > m_results;
+
+    explicit CryptoService(QObject *parent = 0);
+
+    CryptoJob *start(const QSharedPointer<CryptoRequest> &request, QObject *parent);
+};
+
+#endif // CRYPTOSERVICE_H
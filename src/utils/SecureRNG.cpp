@@ -34,12 +34,156 @@
 #include <QtDebug>
 #include <openssl/rand.h>
 #include <openssl/err.h>
+#include <openssl/crypto.h>
+#include <QThreadStorage>
+#include <QtEndian>
 #include <limits.h>
+#include <string.h>
 
 #ifdef Q_OS_WIN
 #include <Wincrypt.h>
+#else
+#include <unistd.h>
+#endif
+
+/* Small requests are served from a per-thread ChaCha20 generator keyed from
+ * RAND_bytes, instead of taking OpenSSL's RNG lock for every few bytes. Each
+ * refill replaces the key with the first 32 bytes of output, so earlier output
+ * can't be recovered from the state. The key is renewed from RAND_bytes after
+ * ReseedInterval bytes, and in a forked child before it produces anything. */
+static const int MaxBufferedRequest = 64;
+static const int BufferSize = 512;
+static const int KeySize = 32;
+static const int ReseedInterval = 1024 * 1024;
+
+static inline quint32 rotl(quint32 v, int c)
+{
+    return (v << c) | (v >> (32 - c));
+}
+
+#define QUARTERROUND(a, b, c, d) \
+    x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16); \
+    x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12); \
+    x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8); \
+    x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+
+/* One 64-byte block of ChaCha20 (RFC 7539) with a zero nonce */
+static void chacha20Block(const uchar key[KeySize], quint32 counter, uchar out[64])
+{
+    quint32 input[16], x[16];
+    input[0] = 0x61707865;
+    input[1] = 0x3320646e;
+    input[2] = 0x79622d32;
+    input[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++)
+        input[4 + i] = qFromLittleEndian<quint32>(key + i * 4);
+    input[12] = counter;
+    input[13] = input[14] = input[15] = 0;
+
+    memcpy(x, input, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(0, 4, 8, 12)
+        QUARTERROUND(1, 5, 9, 13)
+        QUARTERROUND(2, 6, 10, 14)
+        QUARTERROUND(3, 7, 11, 15)
+        QUARTERROUND(0, 5, 10, 15)
+        QUARTERROUND(1, 6, 11, 12)
+        QUARTERROUND(2, 7, 8, 13)
+        QUARTERROUND(3, 4, 9, 14)
+    }
+
+    for (int i = 0; i < 16; i++)
+        qToLittleEndian<quint32>(x[i] + input[i], out + i * 4);
+    OPENSSL_cleanse(x, sizeof(x));
+}
+
+#undef QUARTERROUND
+
+class BufferedRNG
+{
+public:
+    BufferedRNG() : m_available(0), m_sinceSeed(0), m_seeded(false), m_pid(0) { }
+    ~BufferedRNG()
+    {
+        OPENSSL_cleanse(m_key, sizeof(m_key));
+        OPENSSL_cleanse(m_buffer, sizeof(m_buffer));
+    }
+
+    bool read(char *buf, int size)
+    {
+        Q_ASSERT(size <= MaxBufferedRequest);
+
+#ifndef Q_OS_WIN
+        if (m_seeded && m_pid != getpid()) {
+            /* Don't share a stream with the parent process, not even buffered output */
+            OPENSSL_cleanse(m_buffer, sizeof(m_buffer));
+            m_seeded = false;
+            m_available = 0;
+        }
+#endif
+
+        if (m_available < size && !refill())
+            return false;
+
+        /* Output is taken from the end of the buffer, and wiped once used */
+        uchar *p = m_buffer + m_available - size;
+        memcpy(buf, p, size);
+        OPENSSL_cleanse(p, size);
+        m_available -= size;
+        return true;
+    }
+
+private:
+    uchar m_key[KeySize];
+    uchar m_buffer[BufferSize];
+    int m_available;
+    int m_sinceSeed;
+    bool m_seeded;
+#ifndef Q_OS_WIN
+    pid_t m_pid;
+#else
+    int m_pid;
 #endif
 
+    bool refill()
+    {
+        if (!m_seeded || m_sinceSeed >= ReseedInterval) {
+            if (!RAND_bytes(m_key, KeySize)) {
+                qWarning() << "RNG failed:" << ERR_get_error();
+                return false;
+            }
+#ifndef Q_OS_WIN
+            m_pid = getpid();
+#endif
+            m_seeded = true;
+            m_sinceSeed = 0;
+        }
+
+        /* The first KeySize bytes of the stream become the next key */
+        uchar block[64], nextKey[KeySize];
+        int filled = -KeySize;
+        for (quint32 counter = 0; filled < BufferSize; counter++) {
+            chacha20Block(m_key, counter, block);
+            for (int i = 0; i < 64 && filled < BufferSize; i++, filled++) {
+                if (filled < 0)
+                    nextKey[KeySize + filled] = block[i];
+                else
+                    m_buffer[filled] = block[i];
+            }
+        }
+
+        memcpy(m_key, nextKey, KeySize);
+        OPENSSL_cleanse(nextKey, sizeof(nextKey));
+        OPENSSL_cleanse(block, sizeof(block));
+
+        m_available = BufferSize;
+        m_sinceSeed += BufferSize;
+        return true;
+    }
+};
+
+static QThreadStorage<BufferedRNG*> bufferedRNG;
+
 #if QT_VERSION >= 0x040700
 #include <QElapsedTimer>
 #endif
@@ -95,6 +239,12 @@ bool SecureRNG::seed()
 
 bool SecureRNG::random(char *buf, int size)
 {
+    if (size <= MaxBufferedRequest) {
+        if (!bufferedRNG.hasLocalData())
+            bufferedRNG.setLocalData(new BufferedRNG);
+        return bufferedRNG.localData()->read(buf, size);
+    }
+
     int r = RAND_bytes(reinterpret_cast<unsigned char*>(buf), size);
     if (!r)
     {
@@ -148,7 +298,7 @@ quint64 SecureRNG::randomInt64(quint64 max)
 
     for (;;)
     {
-        random(reinterpret_cast<char*>(value), sizeof(value));
+        random(reinterpret_cast<char*>(&value), sizeof(value));
         if (value < cutoff)
             return value % max;
     }
@@ -0,0 +1,1296 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "StateDatabase.h"
+#include "AppSettings.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QStringList>
+#include <QtEndian>
+#include <QDebug>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/* Database file:
+ *
+ *   Header (64 bytes)
+ *     0   char[4]  magic "TSDB"
+ *     4   quint32  version
+ *     8   quint32  record size
+ *     12  quint32  record capacity
+ *     16  quint32  blob file generation
+ *     24  quint64  bytes of blob file no longer referenced by any record
+ *     32  quint32  flags (bit 0: settings were imported from the INI file)
+ *
+ *   Records (capacity of them, each two slots of 192 bytes)
+ *     0   quint8   type (RecordType; 0 is an unused record)
+ *     1   quint8   flags (bit 0: local secret set, bit 1: remote secret set)
+ *     2   quint16  port
+ *     4   quint32  id
+ *     8   quint32  owner (identity id)
+ *     12  quint8   hostname length
+ *     14  quint16  checksum of the record, calculated with this field as 0
+ *     16  char[64] hostname
+ *     80  char[16] local secret
+ *     96  char[16] remote secret
+ *     112 qint64   CreatedTime, in milliseconds since the epoch (0 if unset)
+ *     120 qint64   LastActiveTime
+ *     128 BlobRef  per BlobField
+ *     176 qint64   LastMessageTime
+ *     184 quint32  sequence number
+ *
+ * A record is written to the slot that doesn't hold its last synced version, and
+ * the slots swap roles only after that write has been synced, so a write torn by a
+ * crash always leaves the previous version intact. The mapped slots can reach the disk
+ * at any time, before the blobs they refer to, so the current version is the slot with
+ * a valid checksum, intact blobs, and the higher sequence number. A record with no valid slot
+ * is copied to the file named after the database followed by ".damaged" (as a
+ * quint32 record index and both slots), reported, and never reused.
+ *
+ *   BlobRef (16 bytes)
+ *     0   quint64  offset in blob file
+ *     8   quint32  size (0 if unset)
+ *     12  quint16  checksum of the data
+ *
+ * The blob file is named after the database file, followed by ".blobs." and the
+ * generation. It begins with a 16 byte header of "TSBL", quint32 version, and
+ * quint32 generation; blobs are appended after that and never modified. When
+ * enough of the file is garbage, it's compacted while opening the database, by
+ * writing a new generation and atomically replacing the database file to refer
+ * to it.
+ *
+ * All integers are little-endian. */
+
+static const char dbMagic[] = "TSDB";
+static const char blobMagic[] = "TSBL";
+static const quint32 dbVersion = 1;
+static const int HeaderSize = 64;
+static const int RecordSize = 192;
+static const int RecordStride = RecordSize * 2;
+static const int BlobHeaderSize = 16;
+static const int BlobRefSize = 16;
+static const int MaxHostnameLength = 63;
+static const int SecretSize = 16;
+static const int MinimumCapacity = 64;
+static const quint64 CompactThreshold = 1024 * 1024;
+
+enum HeaderOffset
+{
+    HdrVersion = 4,
+    HdrRecordSize = 8,
+    HdrCapacity = 12,
+    HdrBlobGeneration = 16,
+    HdrBlobGarbage = 24,
+    HdrFlags = 32
+};
+
+enum HeaderFlags
+{
+    SettingsImported = 0x01
+};
+
+enum RecordOffset
+{
+    RecType = 0,
+    RecFlags = 1,
+    RecPort = 2,
+    RecId = 4,
+    RecOwner = 8,
+    RecHostnameLength = 12,
+    RecChecksum = 14,
+    RecHostname = 16,
+    RecLocalSecret = 80,
+    RecRemoteSecret = 96,
+    RecTimes = 112,
+    RecBlobs = 128,
+    RecLastMessageTime = 176,
+    RecSequence = 184
+};
+
+enum RecordFlags
+{
+    HasLocalSecret = 0x01,
+    HasRemoteSecret = 0x02
+};
+
+StateDatabase *database = 0;
+
+static quint64 indexKey(int type, int id)
+{
+    return (quint64(type) << 32) | quint32(id);
+}
+
+static quint16 recordChecksum(const uchar *data)
+{
+    uchar copy[RecordSize];
+    memcpy(copy, data, RecordSize);
+    copy[RecChecksum] = copy[RecChecksum+1] = 0;
+    return qChecksum(reinterpret_cast<const char*>(copy), RecordSize);
+}
+
+static bool isSlotValid(const uchar *slot)
+{
+    return qFromLittleEndian<quint16>(slot + RecChecksum) == recordChecksum(slot);
+}
+
+static bool isSlotEmpty(const uchar *slot)
+{
+    for (int i = 0; i < RecordSize; i++) {
+        if (slot[i])
+            return false;
+    }
+    return true;
+}
+
+/* Sequence numbers wrap */
+static bool isSlotNewer(const uchar *slot, const uchar *other)
+{
+    return qint32(qFromLittleEndian<quint32>(slot + RecSequence) - qFromLittleEndian<quint32>(other + RecSequence)) > 0;
+}
+
+static bool syncFile(QFile &file)
+{
+    if (!file.isOpen())
+        return false;
+    if (!file.flush())
+        return false;
+#ifdef Q_OS_WIN
+    return _commit(file.handle()) == 0;
+#else
+    return fsync(file.handle()) == 0;
+#endif
+}
+
+StateDatabase::StateDatabase(const QString &path, QObject *parent)
+    : QObject(parent), m_path(path), m_mutex(QMutex::Recursive), m_map(0), m_records(0), m_blobMap(0),
+      m_blobMapSize(0), m_capacity(0), m_blobGeneration(0), m_blobGarbage(0), m_damagedRecords(0),
+      m_batchDepth(0), m_batchOffset(0)
+{
+    m_syncTimer.setSingleShot(true);
+    m_syncTimer.setInterval(1000);
+    connect(&m_syncTimer, SIGNAL(timeout()), SLOT(sync()));
+}
+
+StateDatabase::~StateDatabase()
+{
+    close();
+}
+
+bool StateDatabase::open()
+{
+    if (!openFiles())
+        return false;
+
+    if (m_blobGarbage > CompactThreshold && m_blobGarbage * 2 > quint64(m_blobFile.size())) {
+        if (!compact())
+            qWarning() << "StateDatabase: Compacting" << blobPath(m_blobGeneration) << "failed";
+        if (!isOpen())
+            return false;
+    }
+
+    return true;
+}
+
+bool StateDatabase::openFiles()
+{
+    QMutexLocker locker(&m_mutex);
+    close();
+
+    m_file.setFileName(m_path);
+    bool exists = m_file.exists() && m_file.size() > 0;
+    if (!m_file.open(QIODevice::ReadWrite)) {
+        m_errorString = m_file.errorString();
+        return false;
+    }
+
+    if (!exists) {
+        QByteArray header(HeaderSize, 0);
+        uchar *h = reinterpret_cast<uchar*>(header.data());
+        memcpy(h, dbMagic, 4);
+        qToLittleEndian<quint32>(dbVersion, h + HdrVersion);
+        qToLittleEndian<quint32>(RecordSize, h + HdrRecordSize);
+        qToLittleEndian<quint32>(1, h + HdrBlobGeneration);
+
+        if (m_file.write(header) != HeaderSize || !m_file.flush()) {
+            m_errorString = m_file.errorString();
+            close();
+            return false;
+        }
+    }
+
+    if (m_file.size() < HeaderSize) {
+        m_errorString = tr("Database file is truncated");
+        close();
+        return false;
+    }
+
+    m_map = m_file.map(0, m_file.size());
+    if (!m_map) {
+        m_errorString = m_file.errorString();
+        close();
+        return false;
+    }
+
+    if (memcmp(m_map, dbMagic, 4) != 0) {
+        m_errorString = tr("Not a Torsion database");
+        close();
+        return false;
+    }
+
+    quint32 version = qFromLittleEndian<quint32>(m_map + HdrVersion);
+    if (version > dbVersion) {
+        m_errorString = tr("Database was created by a newer version of Torsion");
+        close();
+        return false;
+    }
+
+    m_capacity = int(qFromLittleEndian<quint32>(m_map + HdrCapacity));
+    if (qFromLittleEndian<quint32>(m_map + HdrRecordSize) != quint32(RecordSize) || m_capacity < 0 ||
+        HeaderSize + qint64(m_capacity) * RecordStride > m_file.size())
+    {
+        m_errorString = tr("Database file is corrupt");
+        close();
+        return false;
+    }
+
+    m_blobGeneration = qFromLittleEndian<quint32>(m_map + HdrBlobGeneration);
+    m_blobGarbage = qFromLittleEndian<quint64>(m_map + HdrBlobGarbage);
+
+    if (!openBlobFile()) {
+        close();
+        return false;
+    }
+
+    loadRecords();
+    removeStaleBlobFiles();
+    return true;
+}
+
+void StateDatabase::close()
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (m_batchDepth) {
+        qWarning() << "StateDatabase: Closing during a batch";
+        m_batchDepth = 0;
+    }
+
+    if (m_map)
+        sync();
+    if (!m_batchBlobs.isEmpty()) {
+        qWarning() << "StateDatabase: Discarding" << m_batchBlobs.size() << "bytes of blob data that couldn't be written";
+        m_batchBlobs.clear();
+    }
+
+    m_syncTimer.stop();
+    m_idIndex.clear();
+    m_freeRecords.clear();
+    m_activeSlots.clear();
+    m_unsyncedRecords.clear();
+    m_capacity = 0;
+    m_damagedRecords = 0;
+
+    free(m_records);
+    m_records = 0;
+
+    if (m_blobMap) {
+        m_blobFile.unmap(m_blobMap);
+        m_blobMap = 0;
+        m_blobMapSize = 0;
+    }
+    m_blobFile.close();
+
+    if (m_map) {
+        m_file.unmap(m_map);
+        m_map = 0;
+    }
+    m_file.close();
+}
+
+QString StateDatabase::blobPath(quint32 generation) const
+{
+    return m_path + QLatin1String(".blobs.") + QString::number(generation);
+}
+
+bool StateDatabase::openBlobFile()
+{
+    m_blobFile.setFileName(blobPath(m_blobGeneration));
+    if (!m_blobFile.open(QIODevice::ReadWrite)) {
+        m_errorString = m_blobFile.errorString();
+        return false;
+    }
+
+    if (m_blobFile.size() == 0) {
+        QByteArray header(BlobHeaderSize, 0);
+        uchar *h = reinterpret_cast<uchar*>(header.data());
+        memcpy(h, blobMagic, 4);
+        qToLittleEndian<quint32>(dbVersion, h + 4);
+        qToLittleEndian<quint32>(m_blobGeneration, h + 8);
+
+        if (m_blobFile.write(header) != BlobHeaderSize || !m_blobFile.flush()) {
+            m_errorString = m_blobFile.errorString();
+            return false;
+        }
+    }
+
+    if (!remapBlobs() || m_blobMapSize < BlobHeaderSize || memcmp(m_blobMap, blobMagic, 4) != 0) {
+        m_errorString = tr("Database blob file is corrupt");
+        return false;
+    }
+
+    return true;
+}
+
+bool StateDatabase::remapBlobs() const
+{
+    if (m_blobMap) {
+        m_blobFile.unmap(m_blobMap);
+        m_blobMap = 0;
+        m_blobMapSize = 0;
+    }
+
+    qint64 size = m_blobFile.size();
+    m_blobMap = m_blobFile.map(0, size);
+    if (!m_blobMap) {
+        qWarning() << "StateDatabase: Cannot map blob file:" << m_blobFile.errorString();
+        return false;
+    }
+
+    m_blobMapSize = size;
+    return true;
+}
+
+uchar *StateDatabase::slotData(int record, int slot) const
+{
+    return m_map + HeaderSize + qint64(record) * RecordStride + slot * RecordSize;
+}
+
+/* Whether the blobs that slot refers to, and the other slot doesn't, are in the blob
+ * file. Those the slots share were synced along with the older one. */
+bool StateDatabase::hasSlotBlobs(const uchar *slot, const uchar *other) const
+{
+    for (int field = 0; field < BlobFieldCount; field++) {
+        const uchar *ref = slot + RecBlobs + field * BlobRefSize;
+        if (other && !memcmp(ref, other + RecBlobs + field * BlobRefSize, BlobRefSize))
+            continue;
+
+        quint64 offset = qFromLittleEndian<quint64>(ref);
+        quint32 size = qFromLittleEndian<quint32>(ref + 8);
+        if (!size)
+            continue;
+        if (offset < quint64(BlobHeaderSize) || offset + size > quint64(m_blobMapSize))
+            return false;
+        if (qChecksum(reinterpret_cast<const char*>(m_blobMap + offset), size) != qFromLittleEndian<quint16>(ref + 12))
+            return false;
+    }
+
+    return true;
+}
+
+void StateDatabase::loadRecords()
+{
+    m_idIndex.clear();
+    m_freeRecords.clear();
+    m_unsyncedRecords.clear();
+    m_damagedRecords = 0;
+
+    free(m_records);
+    m_records = static_cast<uchar*>(calloc(qMax(m_capacity, 1), RecordSize));
+    if (!m_records)
+        qFatal("StateDatabase: Cannot allocate %d records", m_capacity);
+    m_activeSlots.fill(0, m_capacity);
+
+    QList<int> damaged;
+    /* Records whose newer slot was rejected, and is rewritten with the version kept. This
+     * includes records that referred to a batch of blobs that was never written, and keeps
+     * such a slot from matching blobs appended at the same offset later. */
+    QList<int> repaired;
+
+    /* Free records are used from the end of m_freeRecords, so the lowest comes last */
+    for (int i = m_capacity - 1; i >= 0; i--) {
+        const uchar *slots[2] = { slotData(i, 0), slotData(i, 1) };
+        bool valid[2] = { isSlotValid(slots[0]), isSlotValid(slots[1]) };
+
+        int slot;
+        if (valid[0] && valid[1]) {
+            slot = isSlotNewer(slots[1], slots[0]) ? 1 : 0;
+            /* Written before its blobs were synced; the older slot was synced with its own */
+            if (!hasSlotBlobs(slots[slot], slots[slot ^ 1])) {
+                qWarning() << "StateDatabase: Record" << i << "refers to blob data that wasn't written; using its previous version";
+                slot ^= 1;
+                repaired.append(i);
+            }
+        } else if (valid[0] || valid[1]) {
+            slot = valid[0] ? 0 : 1;
+            /* Created, but not synced; left free as if it had never been written. Its
+             * sequence number is kept, so the next version written will replace it. */
+            if (isSlotEmpty(slots[slot ^ 1]) && !hasSlotBlobs(slots[slot], 0)) {
+                qWarning() << "StateDatabase: Record" << i << "was never completely written; discarding it";
+                qToLittleEndian<quint32>(qFromLittleEndian<quint32>(slots[slot] + RecSequence), recordData(i) + RecSequence);
+                m_activeSlots[i] = quint8(slot);
+                slot = -1;
+                repaired.append(i);
+            }
+        } else if (isSlotEmpty(slots[0]) && isSlotEmpty(slots[1]))
+            slot = -1;
+        else {
+            qWarning() << "StateDatabase: Record" << i << "is damaged";
+            recordData(i)[RecType] = quint8(DamagedRecord);
+            damaged.append(i);
+            continue;
+        }
+
+        if (slot >= 0) {
+            memcpy(recordData(i), slots[slot], RecordSize);
+            m_activeSlots[i] = quint8(slot);
+        }
+
+        int type = recordData(i)[RecType];
+        if (type == FreeRecord) {
+            m_freeRecords.append(i);
+        } else if (type == IdentityRecord || type == ContactRecord) {
+            m_idIndex.insert(indexKey(type, recordId(i)), i);
+        }
+    }
+
+    if (!repaired.isEmpty()) {
+        foreach (int record, repaired)
+            recordChanged(record);
+        sync();
+    }
+
+    if (!damaged.isEmpty())
+        setAsideRecords(damaged);
+}
+
+/* Copies damaged records to the .damaged file and marks them as DamagedRecord, so they
+ * stay out of use and aren't reported again. If they can't be copied, they're left
+ * as they are, and still not used. */
+void StateDatabase::setAsideRecords(const QList<int> &records)
+{
+    m_damagedRecords = records.size();
+
+    QFile file(damagedRecordsPath());
+    bool ok = file.open(QIODevice::WriteOnly | QIODevice::Append);
+    foreach (int record, records) {
+        uchar index[4];
+        qToLittleEndian<quint32>(quint32(record), index);
+        if (!ok || file.write(reinterpret_cast<const char*>(index), 4) != 4 ||
+            file.write(reinterpret_cast<const char*>(slotData(record, 0)), RecordStride) != RecordStride)
+        {
+            ok = false;
+        }
+    }
+
+    if (!ok || !syncFile(file)) {
+        qWarning() << "StateDatabase: Cannot copy damaged records to" << file.fileName() << ":" << file.errorString();
+        return;
+    }
+
+    qWarning() << "StateDatabase: Copied" << records.size() << "damaged records to" << file.fileName();
+    foreach (int record, records) {
+        uchar *r = clearRecord(record);
+        r[RecType] = quint8(DamagedRecord);
+        recordChanged(record);
+    }
+    sync();
+}
+
+QString StateDatabase::damagedRecordsPath() const
+{
+    return m_path + QLatin1String(".damaged");
+}
+
+void StateDatabase::removeStaleBlobFiles()
+{
+    QFileInfo info(m_path);
+    QDir dir = info.dir();
+    QStringList files = dir.entryList(QStringList() << (info.fileName() + QLatin1String(".blobs.*")), QDir::Files);
+    QString current = QFileInfo(m_blobFile.fileName()).fileName();
+
+    foreach (const QString &file, files) {
+        if (file == current)
+            continue;
+        qDebug() << "StateDatabase: Removing stale blob file" << file;
+        dir.remove(file);
+    }
+}
+
+/* Rewrites the live blobs to a new generation of the blob file, and atomically replaces
+ * the database file with a copy that refers to it. The database is left open either way. */
+bool StateDatabase::compact()
+{
+    QMutexLocker locker(&m_mutex);
+    quint32 generation = m_blobGeneration + 1;
+    QFile newBlobs(blobPath(generation));
+    if (!newBlobs.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    QByteArray header(BlobHeaderSize, 0);
+    uchar *h = reinterpret_cast<uchar*>(header.data());
+    memcpy(h, blobMagic, 4);
+    qToLittleEndian<quint32>(dbVersion, h + 4);
+    qToLittleEndian<quint32>(generation, h + 8);
+    bool ok = newBlobs.write(header) == BlobHeaderSize;
+
+    /* Each record's current version goes in its first slot */
+    QByteArray image(HeaderSize + m_capacity * RecordStride, 0);
+    uchar *imageData = reinterpret_cast<uchar*>(image.data());
+    memcpy(imageData, m_map, HeaderSize);
+
+    for (int i = 0; ok && i < m_capacity; i++) {
+        uchar *r = imageData + HeaderSize + i * RecordStride;
+        if (recordData(i)[RecType] == DamagedRecord) {
+            /* Kept exactly as found, in case it couldn't be set aside */
+            memcpy(r, slotData(i, 0), RecordStride);
+            continue;
+        }
+
+        memcpy(r, recordData(i), RecordSize);
+        if (r[RecType] == FreeRecord)
+            continue;
+
+        for (int field = 0; field < BlobFieldCount; field++) {
+            uchar *ref = r + RecBlobs + field * BlobRefSize;
+            QByteArray data = blob(i, BlobField(field));
+            if (data.isEmpty()) {
+                memset(ref, 0, BlobRefSize);
+                continue;
+            }
+
+            qToLittleEndian<quint64>(quint64(newBlobs.pos()), ref);
+            if (newBlobs.write(data) != data.size()) {
+                ok = false;
+                break;
+            }
+        }
+
+        qToLittleEndian<quint16>(recordChecksum(r), r + RecChecksum);
+    }
+
+    qToLittleEndian<quint32>(generation, imageData + HdrBlobGeneration);
+    qToLittleEndian<quint64>(0, imageData + HdrBlobGarbage);
+
+    if (ok) {
+        syncFile(newBlobs);
+        ok = newBlobs.error() == QFile::NoError;
+    }
+    newBlobs.close();
+
+    QSaveFile newFile(m_path);
+    if (ok && newFile.open(QIODevice::WriteOnly) && newFile.write(image) == image.size()) {
+        newFile.flush();
+#ifdef Q_OS_WIN
+        _commit(newFile.handle());
+#else
+        fsync(newFile.handle());
+#endif
+        /* The existing file can't be replaced while it's open on all platforms */
+        close();
+        ok = newFile.commit();
+    } else {
+        ok = false;
+    }
+
+    if (!ok) {
+        newFile.cancelWriting();
+        QFile::remove(newBlobs.fileName());
+    }
+
+    if (!isOpen() && !openFiles())
+        return false;
+
+    return ok;
+}
+
+/* Current version of the record; see recordChanged */
+uchar *StateDatabase::recordData(int record) const
+{
+    return m_records + qint64(record) * RecordSize;
+}
+
+bool StateDatabase::isValidRecord(int record) const
+{
+    if (!m_map || record < 0 || record >= m_capacity || recordData(record)[RecType] == FreeRecord ||
+        recordData(record)[RecType] == DamagedRecord)
+    {
+        qWarning() << "StateDatabase: Access to invalid record" << record;
+        return false;
+    }
+
+    return true;
+}
+
+/* Zeroes the record, except for the sequence number that orders its slots */
+uchar *StateDatabase::clearRecord(int record)
+{
+    uchar *r = recordData(record);
+    quint32 sequence = qFromLittleEndian<quint32>(r + RecSequence);
+    memset(r, 0, RecordSize);
+    qToLittleEndian<quint32>(sequence, r + RecSequence);
+    return r;
+}
+
+/* Writes the record to the slot that doesn't hold its last synced version. It
+ * becomes the synced version in sync(); until then, changes overwrite it again. */
+void StateDatabase::recordChanged(int record)
+{
+    uchar *r = recordData(record);
+    qToLittleEndian<quint32>(qFromLittleEndian<quint32>(r + RecSequence) + 1, r + RecSequence);
+    qToLittleEndian<quint16>(recordChecksum(r), r + RecChecksum);
+
+    memcpy(slotData(record, m_activeSlots[record] ^ 1), r, RecordSize);
+    m_unsyncedRecords.insert(record);
+    scheduleSync();
+}
+
+void StateDatabase::writeHeader()
+{
+    qToLittleEndian<quint32>(quint32(m_capacity), m_map + HdrCapacity);
+    qToLittleEndian<quint32>(m_blobGeneration, m_map + HdrBlobGeneration);
+    qToLittleEndian<quint64>(m_blobGarbage, m_map + HdrBlobGarbage);
+    scheduleSync();
+}
+
+void StateDatabase::scheduleSync()
+{
+    if (!m_syncTimer.isActive())
+        m_syncTimer.start();
+}
+
+bool StateDatabase::sync()
+{
+    QMutexLocker locker(&m_mutex);
+    m_syncTimer.stop();
+
+    /* Changed slots may already be on disk, and aren't trusted at load unless their
+     * blobs are; syncing the blobs first makes them the current version. Blob data
+     * left over from a failed batch is retried until it's written. */
+    if (!m_batchDepth && !writeBatch())
+        scheduleSync();
+    if (!m_batchBlobs.isEmpty())
+        return false;
+    if (!syncFile(m_blobFile)) {
+        if (m_blobFile.isOpen())
+            qWarning() << "StateDatabase: Syncing blob file failed:" << m_blobFile.errorString();
+        scheduleSync();
+        return false;
+    }
+    if (!syncFile(m_file)) {
+        if (m_file.isOpen())
+            qWarning() << "StateDatabase: Syncing database file failed:" << m_file.errorString();
+        return false;
+    }
+
+    foreach (int record, m_unsyncedRecords)
+        m_activeSlots[record] ^= 1;
+    m_unsyncedRecords.clear();
+    return true;
+}
+
+bool StateDatabase::hasImportedSettings() const
+{
+    return m_map && (qFromLittleEndian<quint32>(m_map + HdrFlags) & SettingsImported);
+}
+
+bool StateDatabase::growRecords()
+{
+    int capacity = qMax(MinimumCapacity, m_capacity * 2);
+    qint64 size = HeaderSize + qint64(capacity) * RecordStride;
+
+    m_file.unmap(m_map);
+    m_map = 0;
+
+    bool ok = m_file.resize(size);
+    if (!ok) {
+        qWarning() << "StateDatabase: Cannot grow database file:" << m_file.errorString();
+        capacity = m_capacity;
+    }
+
+    m_map = m_file.map(0, m_file.size());
+    if (!m_map)
+        qFatal("StateDatabase: Cannot map database file: %s", qPrintable(m_file.errorString()));
+    if (!ok)
+        return false;
+
+    uchar *records = static_cast<uchar*>(realloc(m_records, size_t(capacity) * RecordSize));
+    if (!records)
+        qFatal("StateDatabase: Cannot allocate %d records", capacity);
+    m_records = records;
+    m_activeSlots.resize(capacity);
+
+    memset(slotData(m_capacity, 0), 0, (capacity - m_capacity) * RecordStride);
+    memset(recordData(m_capacity), 0, (capacity - m_capacity) * RecordSize);
+    for (int i = capacity - 1; i >= m_capacity; i--)
+        m_freeRecords.append(i);
+
+    m_capacity = capacity;
+    writeHeader();
+    return true;
+}
+
+QList<int> StateDatabase::records(RecordType type, int owner) const
+{
+    QList<int> re;
+    for (int i = 0; i < m_capacity; i++) {
+        const uchar *r = recordData(i);
+        if (r[RecType] == type && (owner < 0 || recordOwner(i) == owner))
+            re.append(i);
+    }
+    return re;
+}
+
+int StateDatabase::findRecord(RecordType type, int id) const
+{
+    return m_idIndex.value(indexKey(type, id), -1);
+}
+
+int StateDatabase::createRecord(RecordType type, int id, int owner)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_ASSERT(type != FreeRecord);
+    Q_ASSERT(type == IncomingRequestRecord || type == RejectedHostRecord || findRecord(type, id) < 0);
+
+    if (!m_map || (m_freeRecords.isEmpty() && !growRecords()))
+        return -1;
+
+    int record = m_freeRecords.last();
+    m_freeRecords.removeLast();
+
+    uchar *r = clearRecord(record);
+    r[RecType] = quint8(type);
+    qToLittleEndian<quint32>(quint32(id), r + RecId);
+    qToLittleEndian<quint32>(quint32(owner), r + RecOwner);
+    recordChanged(record);
+
+    if (type == IdentityRecord || type == ContactRecord)
+        m_idIndex.insert(indexKey(type, id), record);
+
+    return record;
+}
+
+void StateDatabase::removeRecord(int record)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!isValidRecord(record))
+        return;
+
+    uchar *r = recordData(record);
+    m_idIndex.remove(indexKey(r[RecType], recordId(record)));
+
+    for (int field = 0; field < BlobFieldCount; field++)
+        m_blobGarbage += qFromLittleEndian<quint32>(r + RecBlobs + field * BlobRefSize + 8);
+
+    clearRecord(record);
+    recordChanged(record);
+    m_freeRecords.append(record);
+    writeHeader();
+}
+
+StateDatabase::RecordType StateDatabase::recordType(int record) const
+{
+    if (!m_map || record < 0 || record >= m_capacity)
+        return FreeRecord;
+    return RecordType(recordData(record)[RecType]);
+}
+
+int StateDatabase::recordId(int record) const
+{
+    return int(qFromLittleEndian<quint32>(recordData(record) + RecId));
+}
+
+int StateDatabase::recordOwner(int record) const
+{
+    return int(qFromLittleEndian<quint32>(recordData(record) + RecOwner));
+}
+
+QByteArray StateDatabase::hostname(int record) const
+{
+    if (!isValidRecord(record))
+        return QByteArray();
+
+    const uchar *r = recordData(record);
+    int length = qMin(int(r[RecHostnameLength]), MaxHostnameLength);
+    return QByteArray(reinterpret_cast<const char*>(r + RecHostname), length);
+}
+
+bool StateDatabase::setHostname(int record, const QByteArray &hostname)
+{
+    if (!isValidRecord(record))
+        return false;
+
+    if (hostname.size() > MaxHostnameLength) {
+        qWarning() << "StateDatabase: Hostname" << hostname << "is too long to store";
+        return false;
+    }
+
+    uchar *r = recordData(record);
+    memset(r + RecHostname, 0, MaxHostnameLength + 1);
+    memcpy(r + RecHostname, hostname.constData(), hostname.size());
+    r[RecHostnameLength] = quint8(hostname.size());
+    recordChanged(record);
+    return true;
+}
+
+quint16 StateDatabase::port(int record) const
+{
+    if (!isValidRecord(record))
+        return 0;
+    return qFromLittleEndian<quint16>(recordData(record) + RecPort);
+}
+
+void StateDatabase::setPort(int record, quint16 port)
+{
+    if (!isValidRecord(record))
+        return;
+
+    qToLittleEndian<quint16>(port, recordData(record) + RecPort);
+    recordChanged(record);
+}
+
+static QByteArray readSecret(const uchar *r, int offset, int flag)
+{
+    if (!(r[RecFlags] & flag))
+        return QByteArray();
+    return QByteArray(reinterpret_cast<const char*>(r + offset), SecretSize);
+}
+
+static bool writeSecret(uchar *r, int offset, int flag, const QByteArray &secret)
+{
+    if (!secret.isEmpty() && secret.size() != SecretSize) {
+        qWarning() << "StateDatabase: Ignoring secret of invalid size" << secret.size();
+        return false;
+    }
+
+    memset(r + offset, 0, SecretSize);
+    if (secret.isEmpty()) {
+        r[RecFlags] &= ~flag;
+    } else {
+        memcpy(r + offset, secret.constData(), SecretSize);
+        r[RecFlags] |= flag;
+    }
+    return true;
+}
+
+QByteArray StateDatabase::localSecret(int record) const
+{
+    if (!isValidRecord(record))
+        return QByteArray();
+    return readSecret(recordData(record), RecLocalSecret, HasLocalSecret);
+}
+
+void StateDatabase::setLocalSecret(int record, const QByteArray &secret)
+{
+    if (isValidRecord(record) && writeSecret(recordData(record), RecLocalSecret, HasLocalSecret, secret))
+        recordChanged(record);
+}
+
+QByteArray StateDatabase::remoteSecret(int record) const
+{
+    if (!isValidRecord(record))
+        return QByteArray();
+    return readSecret(recordData(record), RecRemoteSecret, HasRemoteSecret);
+}
+
+void StateDatabase::setRemoteSecret(int record, const QByteArray &secret)
+{
+    if (isValidRecord(record) && writeSecret(recordData(record), RecRemoteSecret, HasRemoteSecret, secret))
+        recordChanged(record);
+}
+
+static int timeOffset(StateDatabase::TimeField field)
+{
+    /* LastMessageTime was added after the blobs */
+    if (field == StateDatabase::LastMessageTime)
+        return RecLastMessageTime;
+    return RecTimes + field * 8;
+}
+
+QDateTime StateDatabase::time(int record, TimeField field) const
+{
+    if (!isValidRecord(record))
+        return QDateTime();
+
+    qint64 msecs = qFromLittleEndian<qint64>(recordData(record) + timeOffset(field));
+    if (!msecs)
+        return QDateTime();
+    return QDateTime::fromMSecsSinceEpoch(msecs);
+}
+
+void StateDatabase::setTime(int record, TimeField field, const QDateTime &time)
+{
+    if (!isValidRecord(record))
+        return;
+
+    qint64 msecs = time.isValid() ? time.toMSecsSinceEpoch() : 0;
+    qToLittleEndian<qint64>(msecs, recordData(record) + timeOffset(field));
+    recordChanged(record);
+}
+
+QByteArray StateDatabase::blob(int record, BlobField field) const
+{
+    /* Reading may remap the blob file */
+    QMutexLocker locker(&m_mutex);
+    if (!isValidRecord(record))
+        return QByteArray();
+
+    const uchar *ref = recordData(record) + RecBlobs + field * BlobRefSize;
+    quint64 offset = qFromLittleEndian<quint64>(ref);
+    quint32 size = qFromLittleEndian<quint32>(ref + 8);
+    if (!size)
+        return QByteArray();
+
+    QByteArray data;
+    if (!m_batchBlobs.isEmpty() && offset >= quint64(m_batchOffset)) {
+        /* Written in the current batch, and not in the file yet */
+        if (offset + size > quint64(m_batchOffset + m_batchBlobs.size())) {
+            qWarning() << "StateDatabase: Record" << record << "refers to missing blob data";
+            return QByteArray();
+        }
+        data = m_batchBlobs.mid(int(offset - m_batchOffset), int(size));
+    } else {
+        if (offset + size > quint64(m_blobMapSize) && !remapBlobs())
+            return QByteArray();
+
+        if (offset < quint64(BlobHeaderSize) || offset + size > quint64(m_blobMapSize)) {
+            qWarning() << "StateDatabase: Record" << record << "refers to missing blob data";
+            return QByteArray();
+        }
+
+        data = QByteArray(reinterpret_cast<const char*>(m_blobMap + offset), int(size));
+    }
+
+    if (qChecksum(data.constData(), data.size()) != qFromLittleEndian<quint16>(ref + 12)) {
+        qWarning() << "StateDatabase: Record" << record << "refers to corrupt blob data";
+        return QByteArray();
+    }
+
+    return data;
+}
+
+quint64 StateDatabase::appendBlob(const QByteArray &data)
+{
+    /* Data held back by a failed batch keeps its offsets, so anything new goes after it */
+    if (m_batchDepth || !m_batchBlobs.isEmpty()) {
+        qint64 offset = m_batchOffset + m_batchBlobs.size();
+        m_batchBlobs.append(data);
+        if (!m_batchDepth)
+            scheduleSync();
+        return quint64(offset);
+    }
+
+    qint64 offset = m_blobFile.size();
+    if (!m_blobFile.seek(offset) || m_blobFile.write(data) != data.size() || !m_blobFile.flush()) {
+        qWarning() << "StateDatabase: Writing blob file failed:" << m_blobFile.errorString();
+        return 0;
+    }
+
+    return quint64(offset);
+}
+
+bool StateDatabase::setBlob(int record, BlobField field, const QByteArray &data)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!isValidRecord(record))
+        return false;
+
+    uchar *ref = recordData(record) + RecBlobs + field * BlobRefSize;
+    quint32 oldSize = qFromLittleEndian<quint32>(ref + 8);
+    if (oldSize == quint32(data.size()) && blob(record, field) == data)
+        return true;
+
+    quint64 offset = 0;
+    if (!data.isEmpty()) {
+        offset = appendBlob(data);
+        if (!offset)
+            return false;
+    }
+
+    /* The blob may have been remapped by appendBlob, but records are in a different mapping */
+    qToLittleEndian<quint64>(offset, ref);
+    qToLittleEndian<quint32>(quint32(data.size()), ref + 8);
+    qToLittleEndian<quint16>(data.isEmpty() ? 0 : qChecksum(data.constData(), data.size()), ref + 12);
+    recordChanged(record);
+
+    if (oldSize) {
+        m_blobGarbage += oldSize;
+        writeHeader();
+    }
+    return true;
+}
+
+quint64 StateDatabase::blobVersion(RecordType type, int id, int owner, BlobField field) const
+{
+    QMutexLocker locker(&m_mutex);
+    int record = findRecord(type, id);
+    if (record < 0 || recordOwner(record) != owner)
+        return 0;
+
+    const uchar *ref = recordData(record) + RecBlobs + field * BlobRefSize;
+    if (!qFromLittleEndian<quint32>(ref + 8))
+        return 0;
+    /* Blobs are never rewritten in place, so the offset identifies the data */
+    return qFromLittleEndian<quint64>(ref);
+}
+
+QByteArray StateDatabase::blob(RecordType type, int id, int owner, BlobField field, quint64 *version) const
+{
+    QMutexLocker locker(&m_mutex);
+    *version = blobVersion(type, id, owner, field);
+    if (!*version)
+        return QByteArray();
+    return blob(findRecord(type, id), field);
+}
+
+void StateDatabase::beginBatch()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_batchDepth++ || !m_batchBlobs.isEmpty())
+        return;
+
+    m_batchOffset = m_blobFile.size();
+}
+
+bool StateDatabase::endBatch()
+{
+    QMutexLocker locker(&m_mutex);
+    Q_ASSERT(m_batchDepth > 0);
+    if (--m_batchDepth)
+        return true;
+
+    sync();
+    return m_batchBlobs.isEmpty();
+}
+
+bool StateDatabase::writeBatch()
+{
+    if (m_batchBlobs.isEmpty())
+        return true;
+
+    /* Records already refer to these offsets; nothing else may have been appended since */
+    Q_ASSERT(m_blobFile.size() == m_batchOffset);
+    if (!m_blobFile.seek(m_batchOffset) || m_blobFile.write(m_batchBlobs) != m_batchBlobs.size() ||
+        !m_blobFile.flush())
+    {
+        qWarning() << "StateDatabase: Writing blob file failed:" << m_blobFile.errorString();
+        /* Drop anything partially written, so the data can be written at the same offset again */
+        m_blobFile.resize(m_batchOffset);
+        return false;
+    }
+
+    m_batchBlobs.clear();
+    return true;
+}
+
+QString StateDatabase::nickname(int record) const
+{
+    return QString::fromUtf8(blob(record, NicknameBlob));
+}
+
+bool StateDatabase::setNickname(int record, const QString &nickname)
+{
+    return setBlob(record, NicknameBlob, nickname.toUtf8());
+}
+
+QVariantMap StateDatabase::properties(int record) const
+{
+    QVariantMap re;
+    QByteArray data = blob(record, PropertiesBlob);
+    if (data.isEmpty())
+        return re;
+
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream >> re;
+    return re;
+}
+
+bool StateDatabase::setProperties(int record, const QVariantMap &properties)
+{
+    QByteArray data;
+    if (!properties.isEmpty()) {
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_5_0);
+        stream << properties;
+    }
+
+    return setBlob(record, PropertiesBlob, data);
+}
+
+/* Settings of identities and contacts in the INI format, and where they're stored here.
+ * Returns false for keys without a field of their own; *ok is cleared if writing failed. */
+static bool importField(StateDatabase *db, int record, const QString &key, const QVariant &value, bool *ok)
+{
+    if (key == QLatin1String("nickname"))
+        *ok &= db->setNickname(record, value.toString());
+    else if (key == QLatin1String("avatar"))
+        *ok &= db->setBlob(record, StateDatabase::AvatarBlob, value.toByteArray());
+    else if (key == QLatin1String("hostname"))
+        db->setHostname(record, value.toString().toLatin1());
+    else if (key == QLatin1String("port"))
+        db->setPort(record, quint16(value.toUInt()));
+    else if (key == QLatin1String("localSecret"))
+        db->setLocalSecret(record, value.toByteArray());
+    else if (key == QLatin1String("remoteSecret"))
+        db->setRemoteSecret(record, value.toByteArray());
+    else if (key == QLatin1String("whenCreated") || key == QLatin1String("requestDate"))
+        db->setTime(record, StateDatabase::CreatedTime, value.toDateTime());
+    else if (key == QLatin1String("lastConnected") || key == QLatin1String("lastRequestDate"))
+        db->setTime(record, StateDatabase::LastActiveTime, value.toDateTime());
+    else
+        return false;
+
+    return true;
+}
+
+static bool importGroup(StateDatabase *db, int record, QSettings *settings, const QString &group)
+{
+    settings->beginGroup(group);
+
+    bool ok = true;
+    QVariantMap properties;
+    QStringList keys = settings->allKeys();
+    foreach (const QString &key, keys) {
+        QVariant value = settings->value(key);
+        if (!importField(db, record, key, value, &ok))
+            properties.insert(key, value);
+    }
+
+    ok &= db->setProperties(record, properties);
+    settings->endGroup();
+    return ok;
+}
+
+bool StateDatabase::importSettings(AppSettings *settings)
+{
+    int identities = 0, contacts = 0, requests = 0;
+    int owner = -1;
+
+    settings->beginGroup(QLatin1String("identity"));
+    QStringList groups = settings->childGroups();
+    foreach (const QString &group, groups) {
+        bool ok = false;
+        int id = group.toInt(&ok);
+        if (!ok)
+            continue;
+
+        /* Left by an interrupted import, which is repeated in full */
+        int record = findRecord(IdentityRecord, id);
+        if (record < 0)
+            record = createRecord(IdentityRecord, id, id);
+        if (record < 0 || !importGroup(this, record, settings, group)) {
+            settings->endGroup();
+            return false;
+        }
+
+        if (owner < 0 || id < owner)
+            owner = id;
+        identities++;
+    }
+    settings->endGroup();
+
+    /* Contacts and requests weren't separated by identity; they belong to the first */
+    if (owner < 0)
+        owner = 0;
+
+    settings->beginGroup(QLatin1String("contacts"));
+    groups = settings->childGroups();
+    foreach (const QString &group, groups) {
+        bool ok = false;
+        int id = group.toInt(&ok);
+        if (!ok)
+            continue;
+
+        int record = findRecord(ContactRecord, id);
+        if (record < 0)
+            record = createRecord(ContactRecord, id, owner);
+        if (record < 0 || !importGroup(this, record, settings, group)) {
+            settings->endGroup();
+            return false;
+        }
+
+        contacts++;
+    }
+    settings->endGroup();
+
+    QHash<QByteArray,int> existingRequests;
+    foreach (int record, records(IncomingRequestRecord, owner))
+        existingRequests.insert(hostname(record), record);
+
+    settings->beginGroup(QLatin1String("contactRequests"));
+    groups = settings->childGroups();
+    foreach (const QString &group, groups) {
+        int record = existingRequests.value(group.toLatin1(), -1);
+        if (record < 0)
+            record = createRecord(IncomingRequestRecord, 0, owner);
+        if (record < 0) {
+            settings->endGroup();
+            return false;
+        }
+
+        setHostname(record, group.toLatin1());
+        if (!importGroup(this, record, settings, group)) {
+            settings->endGroup();
+            return false;
+        }
+        requests++;
+    }
+    settings->endGroup();
+
+    /* Everything must be on disk before it's removed from the settings */
+    if (!sync()) {
+        qWarning() << "StateDatabase: Imported settings couldn't be synced; keeping them in the settings file";
+        return false;
+    }
+
+    settings->remove("identity");
+    settings->remove("contacts");
+    settings->remove("contactRequests");
+    settings->flush();
+
+    /* Until this is on disk, the import is repeated at every start */
+    qToLittleEndian<quint32>(qFromLittleEndian<quint32>(m_map + HdrFlags) | SettingsImported, m_map + HdrFlags);
+    if (!sync())
+        return false;
+
+    qDebug() << "StateDatabase: Imported" << identities << "identities," << contacts << "contacts, and"
+             << requests << "contact requests from settings";
+    return true;
+}
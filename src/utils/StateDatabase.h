@@ -0,0 +1,214 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef STATEDATABASE_H
+#define STATEDATABASE_H
+
+#include <QObject>
+#include <QFile>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QTimer>
+#include <QMutex>
+#include <QDateTime>
+#include <QVariantMap>
+
+class AppSettings;
+
+/* Binary store for identities, contacts, incoming contact requests, and
+ * rejected contact request hostnames.
+ *
+ * Each entity is a fixed-size record in a memory-mapped file, addressed by
+ * its index in that file. Records are written to alternating slots, so a crash
+ * can't leave one half-written. Variable-length data (nicknames, avatars, and any
+ * other settings) is kept in a separate append-only blob file, referenced
+ * from the record. See StateDatabase.cpp for the file formats.
+ *
+ * Changes are written to the mapped file immediately, and synced to disk
+ * shortly afterwards. The database is used from the main thread, except for
+ * the blob reads by record id, which are safe from any thread. */
+class StateDatabase : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(StateDatabase)
+
+public:
+    enum RecordType
+    {
+        FreeRecord = 0,
+        IdentityRecord = 1,
+        ContactRecord = 2,
+        IncomingRequestRecord = 3,
+        /* Blacklisted hostname, owned by an identity; only the hostname is set */
+        RejectedHostRecord = 4,
+        /* Record with no valid version, copied to damagedRecordsPath() and kept out of use */
+        DamagedRecord = 255
+    };
+
+    enum TimeField
+    {
+        /* whenCreated for contacts, requestDate for requests */
+        CreatedTime,
+        /* lastConnected for contacts, lastRequestDate for requests */
+        LastActiveTime,
+        /* lastMessage for contacts */
+        LastMessageTime
+    };
+
+    enum BlobField
+    {
+        NicknameBlob,
+        AvatarBlob,
+        /* QVariantMap of any settings without a field of their own */
+        PropertiesBlob,
+        BlobFieldCount
+    };
+
+    explicit StateDatabase(const QString &path, QObject *parent = 0);
+    virtual ~StateDatabase();
+
+    bool open();
+    void close();
+    bool isOpen() const { return m_map != 0; }
+    QString errorString() const { return m_errorString; }
+    /* Records found damaged by open(), which were set aside in damagedRecordsPath() */
+    int damagedRecordCount() const { return m_damagedRecords; }
+    QString damagedRecordsPath() const;
+
+    /* Moves identities, contacts and contact requests out of an INI configuration,
+     * removing them from it. hasImportedSettings() is only true once that has
+     * completed, and an interrupted import can safely be repeated. */
+    bool importSettings(AppSettings *settings);
+    bool hasImportedSettings() const;
+
+    /* Records */
+    QList<int> records(RecordType type, int owner = -1) const;
+    int findRecord(RecordType type, int id) const;
+    int createRecord(RecordType type, int id, int owner);
+    void removeRecord(int record);
+
+    RecordType recordType(int record) const;
+    int recordId(int record) const;
+    int recordOwner(int record) const;
+
+    /* Fields */
+    QByteArray hostname(int record) const;
+    bool setHostname(int record, const QByteArray &hostname);
+    quint16 port(int record) const;
+    void setPort(int record, quint16 port);
+    QByteArray localSecret(int record) const;
+    void setLocalSecret(int record, const QByteArray &secret);
+    QByteArray remoteSecret(int record) const;
+    void setRemoteSecret(int record, const QByteArray &secret);
+    QDateTime time(int record, TimeField field) const;
+    void setTime(int record, TimeField field, const QDateTime &time);
+
+    QByteArray blob(int record, BlobField field) const;
+    /* Returns false if the data couldn't be written */
+    bool setBlob(int record, BlobField field, const QByteArray &data);
+
+    /* Thread-safe reads of an identity's or contact's blob, if the record is owned by
+     * owner. The version identifies the data, and changes whenever it's replaced; it's
+     * 0 if there is no data. */
+    QByteArray blob(RecordType type, int id, int owner, BlobField field, quint64 *version) const;
+    quint64 blobVersion(RecordType type, int id, int owner, BlobField field) const;
+
+    QString nickname(int record) const;
+    bool setNickname(int record, const QString &nickname);
+    QVariantMap properties(int record) const;
+    bool setProperties(int record, const QVariantMap &properties);
+
+    /* Between beginBatch and endBatch, new blob data is held in memory and written
+     * at the end in one write, followed by a sync. Batches may be nested. If the
+     * write fails, endBatch returns false; the data stays in memory, and records
+     * referring to it aren't synced, until a later sync manages to write it. */
+    void beginBatch();
+    bool endBatch();
+
+public slots:
+    /* Flush all changes to disk; returns false if anything couldn't be written */
+    bool sync();
+
+private:
+    QString m_path;
+    QString m_errorString;
+    /* Held while changing anything read by the thread-safe blob reads; recursive */
+    mutable QMutex m_mutex;
+    QFile m_file;
+    mutable QFile m_blobFile;
+    uchar *m_map;
+    /* Current version of each record, and which slot holds its last synced version */
+    uchar *m_records;
+    QVector<quint8> m_activeSlots;
+    QSet<int> m_unsyncedRecords;
+    mutable uchar *m_blobMap;
+    mutable qint64 m_blobMapSize;
+    int m_capacity;
+    quint32 m_blobGeneration;
+    quint64 m_blobGarbage;
+    int m_damagedRecords;
+    /* See beginBatch; m_batchBlobs begins at m_batchOffset in the blob file, and
+     * is only empty once written */
+    int m_batchDepth;
+    qint64 m_batchOffset;
+    QByteArray m_batchBlobs;
+
+    QHash<quint64,int> m_idIndex;
+    QVector<int> m_freeRecords;
+    QTimer m_syncTimer;
+
+    QString blobPath(quint32 generation) const;
+    bool openFiles();
+    bool openBlobFile();
+    void loadRecords();
+    bool hasSlotBlobs(const uchar *slot, const uchar *other) const;
+    void setAsideRecords(const QList<int> &records);
+    bool compact();
+    void removeStaleBlobFiles();
+    bool growRecords();
+    bool remapBlobs() const;
+    quint64 appendBlob(const QByteArray &data);
+    bool writeBatch();
+
+    uchar *recordData(int record) const;
+    uchar *slotData(int record, int slot) const;
+    uchar *clearRecord(int record);
+    bool isValidRecord(int record) const;
+    void recordChanged(int record);
+    void writeHeader();
+    void scheduleSync();
+};
+
+extern StateDatabase *database;
+
+#endif // STATEDATABASE_H
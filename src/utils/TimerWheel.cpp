@@ -0,0 +1,195 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "TimerWheel.h"
+#include <QCoreApplication>
+#include <QDebug>
+#include <string.h>
+
+WheelTimer::WheelTimer()
+    : m_prev(0), m_next(0), m_slot(0), m_expiry(0)
+{
+}
+
+WheelTimer::~WheelTimer()
+{
+    stop();
+}
+
+void WheelTimer::start(int msecs)
+{
+    TimerWheel::instance()->start(this, msecs);
+}
+
+void WheelTimer::stop()
+{
+    if (isActive())
+        TimerWheel::instance()->unlink(this);
+}
+
+WheelSlotTimer::WheelSlotTimer(QObject *receiver, const char *slot)
+    : m_receiver(receiver)
+{
+    const QMetaObject *mo = receiver->metaObject();
+    int index = mo->indexOfMethod(QMetaObject::normalizedSignature(slot).constData());
+    if (index < 0)
+        qWarning() << "WheelSlotTimer: No slot" << slot << "on" << mo->className();
+    else
+        m_method = mo->method(index);
+}
+
+void WheelSlotTimer::timeout()
+{
+    m_method.invoke(m_receiver, Qt::DirectConnection);
+}
+
+TimerWheel *TimerWheel::instance()
+{
+    static TimerWheel *p = 0;
+    if (!p)
+        p = new TimerWheel(qApp);
+    return p;
+}
+
+TimerWheel::TimerWheel(QObject *parent)
+    : QObject(parent), m_currentTick(0), m_count(0)
+{
+    memset(m_firstLevel, 0, sizeof(m_firstLevel));
+    memset(m_levels, 0, sizeof(m_levels));
+
+    m_clock.start();
+    m_ticker.setInterval(TickInterval);
+    connect(&m_ticker, SIGNAL(timeout()), SLOT(tick()));
+}
+
+void TimerWheel::start(WheelTimer *timer, int msecs)
+{
+    if (timer->isActive())
+        unlink(timer);
+
+    /* While idle, the wheel isn't turning; catch it up to the clock */
+    if (!m_count)
+        m_currentTick = clockTick();
+
+    /* Round up, so a timer never fires early */
+    static const quint64 maxTicks = (quint64(1) << (FirstLevelBits + LevelBits * (Levels - 1))) - 1;
+    quint64 ticks = qBound(quint64(1), (quint64(qMax(0, msecs)) + TickInterval - 1) / TickInterval, maxTicks);
+    timer->m_expiry = qMax(clockTick(), m_currentTick) + ticks;
+    if (timer->m_expiry - m_currentTick > maxTicks)
+        timer->m_expiry = m_currentTick + maxTicks;
+
+    insert(timer);
+    if (!m_count++)
+        m_ticker.start();
+}
+
+void TimerWheel::insert(WheelTimer *timer)
+{
+    quint64 expiry = timer->m_expiry;
+    quint64 delta = expiry - m_currentTick;
+    WheelTimer **slot;
+
+    if (delta < (1 << FirstLevelBits)) {
+        slot = &m_firstLevel[expiry & ((1 << FirstLevelBits) - 1)];
+    } else {
+        int level = 0;
+        while (level < Levels - 2 && delta >= (quint64(1) << (FirstLevelBits + LevelBits * (level + 1))))
+            level++;
+        int shift = FirstLevelBits + LevelBits * level;
+        slot = &m_levels[level][(expiry >> shift) & ((1 << LevelBits) - 1)];
+    }
+
+    timer->m_slot = slot;
+    timer->m_prev = 0;
+    timer->m_next = *slot;
+    if (*slot)
+        (*slot)->m_prev = timer;
+    *slot = timer;
+}
+
+void TimerWheel::unlink(WheelTimer *timer)
+{
+    if (timer->m_prev)
+        timer->m_prev->m_next = timer->m_next;
+    else
+        *timer->m_slot = timer->m_next;
+    if (timer->m_next)
+        timer->m_next->m_prev = timer->m_prev;
+
+    timer->m_prev = timer->m_next = 0;
+    timer->m_slot = 0;
+
+    if (!--m_count)
+        m_ticker.stop();
+}
+
+/* Moves the timers of one list of a higher level into the levels below */
+void TimerWheel::cascade(int level, int index)
+{
+    WheelTimer *timer = m_levels[level][index];
+    m_levels[level][index] = 0;
+
+    while (timer) {
+        WheelTimer *next = timer->m_next;
+        insert(timer);
+        timer = next;
+    }
+}
+
+void TimerWheel::tick()
+{
+    quint64 target = clockTick();
+
+    while (m_currentTick < target && m_count) {
+        m_currentTick++;
+
+        /* At the start of each turn of a level, spread the next list of the level above into it */
+        for (int level = 0; level < Levels - 1; level++) {
+            int shift = FirstLevelBits + LevelBits * level;
+            if (m_currentTick & ((quint64(1) << shift) - 1))
+                break;
+            cascade(level, (m_currentTick >> shift) & ((1 << LevelBits) - 1));
+        }
+
+        /* Timers are unlinked as they fire, so timeouts may start or stop any timer,
+         * including deleting their own */
+        WheelTimer **slot = &m_firstLevel[m_currentTick & ((1 << FirstLevelBits) - 1)];
+        while (*slot) {
+            WheelTimer *timer = *slot;
+            unlink(timer);
+            timer->timeout();
+        }
+    }
+
+    if (!m_count)
+        m_currentTick = target;
+}
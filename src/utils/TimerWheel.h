@@ -0,0 +1,133 @@
+/* Torsion - http://torsionim.org/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <QObject>
+#include <QMetaMethod>
+#include <QElapsedTimer>
+#include <QTimer>
+
+/* One-shot timer driven by the shared TimerWheel. Starting and stopping are
+ * constant time, and no timer object or registration with the event loop is
+ * needed per instance, which makes it suitable for per-connection timeouts.
+ * Subclasses implement timeout(); the timer may be deleted from within it. */
+class WheelTimer
+{
+    Q_DISABLE_COPY(WheelTimer)
+
+public:
+    WheelTimer();
+    virtual ~WheelTimer();
+
+    /* Resolution is TimerWheel::TickInterval; restarts if already active */
+    void start(int msecs);
+    void stop();
+    bool isActive() const { return m_slot != 0; }
+
+protected:
+    virtual void timeout() = 0;
+
+private:
+    friend class TimerWheel;
+
+    WheelTimer *m_prev;
+    WheelTimer *m_next;
+    /* List the timer is in, or 0 if inactive */
+    WheelTimer **m_slot;
+    quint64 m_expiry;
+};
+
+/* WheelTimer that invokes a slot, given by signature such as "close()" */
+class WheelSlotTimer : public WheelTimer
+{
+public:
+    WheelSlotTimer(QObject *receiver, const char *slot);
+
+protected:
+    virtual void timeout();
+
+private:
+    QObject *m_receiver;
+    QMetaMethod m_method;
+};
+
+/* Hierarchical timing wheel shared by all WheelTimers on the main thread.
+ *
+ * The first level has a list per tick for the next 256 ticks; each higher level
+ * has 64 lists that each cover a whole turn of the level below, and are spread
+ * into it as their turn comes. A single QTimer wakes up once per tick, and only
+ * while any timer is active. */
+class TimerWheel : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(TimerWheel)
+
+public:
+    /* Milliseconds per tick */
+    static const int TickInterval = 100;
+
+    static TimerWheel *instance();
+
+    int activeCount() const { return m_count; }
+
+private slots:
+    void tick();
+
+private:
+    friend class WheelTimer;
+
+    enum
+    {
+        FirstLevelBits = 8,
+        LevelBits = 6,
+        Levels = 4
+    };
+
+    WheelTimer *m_firstLevel[1 << FirstLevelBits];
+    WheelTimer *m_levels[Levels - 1][1 << LevelBits];
+    quint64 m_currentTick;
+    int m_count;
+    QElapsedTimer m_clock;
+    QTimer m_ticker;
+
+    explicit TimerWheel(QObject *parent = 0);
+
+    quint64 clockTick() const { return quint64(m_clock.elapsed()) / TickInterval; }
+    void start(WheelTimer *timer, int msecs);
+    void insert(WheelTimer *timer);
+    void unlink(WheelTimer *timer);
+    void cascade(int level, int index);
+};
+
+#endif // TIMERWHEEL_H